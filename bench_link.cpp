@@ -0,0 +1,222 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "bench_module.h"
+#include "jit.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// JITLink against RTDyld: every configuration runs in a fresh process, so
+// peak RSS covers one JIT only, and the median of the runs is reported.
+
+static llvm::cl::list<unsigned> function_counts("functions", llvm::cl::desc("Functions per workload"), llvm::cl::CommaSeparated);
+static llvm::cl::opt<unsigned> runs("runs", llvm::cl::desc("Processes per configuration, the median is reported"), llvm::cl::init(3));
+static llvm::cl::opt<unsigned> lookups("lookups", llvm::cl::desc("Lookups of a linked symbol timed per run"), llvm::cl::init(1000));
+
+// a single run, started by the parent process
+static llvm::cl::opt<bool> child("bench-child", llvm::cl::Hidden);
+static llvm::cl::opt<bool> child_jitlink("bench-jitlink", llvm::cl::Hidden);
+static llvm::cl::opt<unsigned> child_functions("bench-functions", llvm::cl::Hidden);
+static llvm::cl::opt<bool> child_debug_info("bench-debug-info", llvm::cl::Hidden);
+
+enum metric {
+    construct_us,
+    add_us,
+    // lookup of the entry (compile and link) and its first call
+    first_call_us,
+    // compile pipeline link stages: link, finalize, EH frame and debug
+    // registration
+    link_us,
+    // lookup of an already linked symbol
+    lookup_ns,
+    peak_rss_kb,
+    code_bytes,
+    num_metrics,
+};
+
+using measurement = std::array<uint64_t, num_metrics>;
+
+static uint64_t read_peak_rss_kb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize >> 10;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss >> 10;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int run_child() {
+    measurement m {};
+    bench_module_shape shape;
+    shape.functions = child_functions;
+    shape.debug_info = child_debug_info;
+
+    auto start = std::chrono::steady_clock::now();
+    JIT::options opts;
+    opts.jitlink = child_jitlink;
+    JIT jit(opts);
+    m[construct_us] = elapsed_ns(start) / 1000;
+
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto M = generate_bench_module(*context, "bench", shape);
+    llvm::orc::ThreadSafeModule module(std::move(M), std::move(context));
+
+    start = std::chrono::steady_clock::now();
+    jit.add_IR_module(std::move(module));
+    m[add_us] = elapsed_ns(start) / 1000;
+
+    start = std::chrono::steady_clock::now();
+    auto entry = jit.lookup_as_pointer<int(int)>("bench_entry");
+    volatile int result = entry(1);
+    (void)result;
+    m[first_call_us] = elapsed_ns(start) / 1000;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < lookups; ++i) {
+        if (!jit.lookup("bench_f0")) {
+            llvm::errs() << "bench_f0 not found\n";
+            return 1;
+        }
+    }
+    m[lookup_ns] = lookups ? elapsed_ns(start) / lookups : 0;
+
+    auto stats = jit.stats();
+    for (auto s : { JIT::pipeline_stage::link, JIT::pipeline_stage::finalize, JIT::pipeline_stage::eh_frame, JIT::pipeline_stage::debug_registration }) {
+        m[link_us] += stats.stages[static_cast<size_t>(s)].total.wall_ns / 1000;
+    }
+    m[code_bytes] = jit.budget_stats().resident_bytes;
+    m[peak_rss_kb] = read_peak_rss_kb();
+
+    for (auto value : m) {
+        llvm::outs() << value << " ";
+    }
+    llvm::outs() << "\n";
+    return 0;
+}
+
+static llvm::Expected<measurement> run_configuration(llvm::StringRef executable, bool jitlink, unsigned functions, bool debug_info) {
+    llvm::SmallString<128> output;
+    if (auto EC = llvm::sys::fs::createTemporaryFile("bench_link", "txt", output)) {
+        return llvm::createFileError(output, EC);
+    }
+    std::string functions_arg = "-bench-functions=" + std::to_string(functions);
+    std::string lookups_arg = "-lookups=" + std::to_string(lookups);
+    llvm::StringRef args[] = {
+        executable,
+        "-bench-child",
+        jitlink ? "-bench-jitlink=true" : "-bench-jitlink=false",
+        functions_arg,
+        debug_info ? "-bench-debug-info=true" : "-bench-debug-info=false",
+        lookups_arg,
+    };
+    std::optional<llvm::StringRef> redirects[] = { std::nullopt, llvm::StringRef(output), std::nullopt };
+
+    std::string error;
+    int status = llvm::sys::ExecuteAndWait(executable, args, std::nullopt, redirects, 0, 0, &error);
+    auto buffer = llvm::MemoryBuffer::getFile(output);
+    llvm::sys::fs::remove(output);
+    if (status != 0) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "run failed with status " + std::to_string(status) + (error.empty() ? "" : ": " + error));
+    }
+    if (!buffer) {
+        return llvm::createFileError(output, buffer.getError());
+    }
+
+    measurement m {};
+    llvm::SmallVector<llvm::StringRef, num_metrics> fields;
+    (*buffer)->getBuffer().trim().split(fields, ' ', -1, false);
+    if (fields.size() != num_metrics) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "malformed run output: " + (*buffer)->getBuffer().str());
+    }
+    for (size_t i = 0; i < num_metrics; ++i) {
+        if (fields[i].getAsInteger(10, m[i])) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "malformed run output: " + (*buffer)->getBuffer().str());
+        }
+    }
+    return m;
+}
+
+static int anchor;
+
+int main(int argc, char *argv[]) {
+
+    JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
+
+    JIT::set_log_level(JIT::log_level::error);
+
+    if (child) {
+        return run_child();
+    }
+
+    auto executable = llvm::sys::fs::getMainExecutable(argv[0], &anchor);
+    std::vector<unsigned> counts(function_counts.begin(), function_counts.end());
+    if (counts.empty()) {
+        counts = { 1, 100, 10000 };
+    }
+
+    llvm::outs() << "functions debug  linker   construct       add    first call      link     lookup     peak RSS       code\n"
+                    "                                 us        us            us        us         ns          KiB      bytes\n";
+    for (unsigned functions : counts) {
+        for (bool debug_info : { false, true }) {
+            for (bool jitlink : { false, true }) {
+                std::vector<measurement> results;
+                for (unsigned i = 0; i < std::max(1u, runs.getValue()); ++i) {
+                    auto m = run_configuration(executable, jitlink, functions, debug_info);
+                    if (!m) {
+                        llvm::logAllUnhandledErrors(m.takeError(), llvm::errs(), "bench_link: ");
+                        return 1;
+                    }
+                    results.push_back(*m);
+                }
+                // median of every metric on its own
+                measurement median;
+                for (size_t i = 0; i < num_metrics; ++i) {
+                    std::vector<uint64_t> values;
+                    for (auto & m : results) {
+                        values.push_back(m[i]);
+                    }
+                    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+                    median[i] = values[values.size() / 2];
+                }
+                llvm::outs() << llvm::format("%9u %5s %7s %11llu %9llu %13llu %9llu %10llu %12llu %10llu\n",
+                    functions, debug_info ? "yes" : "no", jitlink ? "jitlink" : "rtdyld",
+                    (unsigned long long)median[construct_us], (unsigned long long)median[add_us],
+                    (unsigned long long)median[first_call_us], (unsigned long long)median[link_us],
+                    (unsigned long long)median[lookup_ns], (unsigned long long)median[peak_rss_kb],
+                    (unsigned long long)median[code_bytes]);
+                llvm::outs().flush();
+            }
+        }
+    }
+    return 0;
+}
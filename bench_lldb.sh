@@ -0,0 +1,56 @@
+#!/bin/bash
+# Time the j.lldb flow (`b j` then run to the breakpoint) under lldb against
+# generated sources of growing size, with and without DWARF accelerator tables.
+#
+# usage: bench_lldb.sh [jit binary] [function counts...]
+
+set -e
+
+JIT=${1:-ROOTFS_DEBUG/bin/jit}
+shift || true
+SIZES=${*:-"100 1000 10000 50000"}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cat > "$WORK/bench.lldb" <<LLDB
+b j
+r
+bt
+LLDB
+
+# n small functions with a few locals each, so every one has a DIE and a line
+# table, and the j() the breakpoint is set on
+generate() {
+    local n=$1 out=$2
+    {
+        echo '#include <stdio.h>'
+        for ((i = 0; i < n; ++i)); do
+            echo "int f$i(int x) { int y = x * $i; for (int k = 0; k < 3; ++k) { y += k ^ x; } return y; }"
+        done
+        echo 'int j() {'
+        echo '  printf("HELLO JIT %d\n", f0(1));'
+        echo '  return 0;'
+        echo '}'
+    } > "$out"
+}
+
+printf "%10s %8s %10s\n" functions accel seconds
+for n in $SIZES; do
+    generate "$n" "$WORK/jit_code_$n.c"
+    for accel in 0 1; do
+        flags=()
+        if [ "$accel" = 1 ]; then
+            flags+=(-jit-accel-tables)
+        fi
+        start=$(date +%s.%N)
+        lldb -b -s "$WORK/bench.lldb" -- "$JIT" "${flags[@]}" "$WORK/jit_code_$n.c" > "$WORK/lldb_${n}_${accel}.log" 2>&1
+        end=$(date +%s.%N)
+        if ! grep -q "stop reason = breakpoint" "$WORK/lldb_${n}_${accel}.log"; then
+            echo "breakpoint on j not hit with $n functions, see the log:" >&2
+            cat "$WORK/lldb_${n}_${accel}.log" >&2
+            exit 1
+        fi
+        printf "%10s %8s %10.2f\n" "$n" "$accel" "$(echo "$end - $start" | bc)"
+    done
+done
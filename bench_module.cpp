@@ -0,0 +1,134 @@
+#include <llvm/BinaryFormat/Dwarf.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/IRBuilder.h>
+
+#include "bench_module.h"
+#include "jit.h"
+
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+std::unique_ptr<llvm::Module> generate_bench_module(llvm::LLVMContext & context, llvm::StringRef name, const bench_module_shape & shape) {
+    auto M = std::make_unique<llvm::Module>(name, context);
+    M->setTargetTriple(jit_target_triple);
+
+    auto * i32 = llvm::Type::getInt32Ty(context);
+    auto * function_type = llvm::FunctionType::get(i32, { i32 }, false);
+    llvm::IRBuilder<> builder(context);
+    std::mt19937 random(shape.seed);
+
+    std::unique_ptr<llvm::DIBuilder> DIB;
+    llvm::DIFile * file = nullptr;
+    llvm::DISubroutineType * subroutine_type = nullptr;
+    llvm::DIBasicType * int_type = nullptr;
+    if (shape.debug_info) {
+        M->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 5);
+        M->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+        DIB = std::make_unique<llvm::DIBuilder>(*M);
+        file = DIB->createFile((name + ".c").str(), ".");
+        DIB->createCompileUnit(llvm::dwarf::DW_LANG_C11, file, "jit bench", false, "", 0);
+        int_type = DIB->createBasicType("int", 32, llvm::dwarf::DW_ATE_signed);
+        subroutine_type = DIB->createSubroutineType(DIB->getOrCreateTypeArray({ int_type, int_type }));
+    }
+
+    // source lines: globals first, then one per function, the entry last
+    std::vector<llvm::GlobalVariable *> globals;
+    for (unsigned i = 0; i < shape.globals; ++i) {
+        auto symbol = (name + "_g" + llvm::Twine(i)).str();
+        auto * G = new llvm::GlobalVariable(*M, i32, false, llvm::GlobalValue::ExternalLinkage, builder.getInt32(0), symbol);
+        if (DIB) {
+            G->addDebugInfo(DIB->createGlobalVariableExpression(file, symbol, symbol, file, i + 1, int_type, false));
+        }
+        globals.push_back(G);
+    }
+
+    std::vector<llvm::GlobalVariable *> strings;
+    for (unsigned i = 0; i < shape.strings; ++i) {
+        auto text = (name + " string " + llvm::Twine(i) + " ").str();
+        text.resize(std::max<size_t>(shape.string_length, 1), '.');
+        auto * S = builder.CreateGlobalString(text, (name + ".str" + llvm::Twine(i)).str(), 0, M.get());
+        strings.push_back(S);
+    }
+
+    unsigned first_line = shape.globals + 1;
+    auto define = [&](const std::string & symbol, unsigned line) {
+        auto * F = llvm::Function::Create(function_type, llvm::Function::ExternalLinkage, symbol, *M);
+        auto * x = F->getArg(0);
+        x->setName("x");
+        builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", F));
+        if (DIB) {
+            auto * SP = DIB->createFunction(file, symbol, symbol, file, line, subroutine_type, line, llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
+            F->setSubprogram(SP);
+            auto * location = llvm::DILocation::get(context, line, 1, SP);
+            builder.SetCurrentDebugLocation(location);
+            auto * variable = DIB->createParameterVariable(SP, "x", 1, file, line, int_type);
+            DIB->insertDbgValueIntrinsic(x, variable, DIB->createExpression(), location, builder.GetInsertBlock());
+        }
+        return F;
+    };
+
+    // calls per function: the integer part of the density, plus one with the
+    // probability of its fraction
+    double whole_calls;
+    double fraction = std::modf(std::max(shape.call_density, 0.0), &whole_calls);
+    std::bernoulli_distribution extra_call(fraction);
+
+    std::vector<llvm::Function *> leaves;
+    leaves.reserve(shape.functions);
+    for (unsigned i = 0; i < shape.functions; ++i) {
+        auto * F = define((name + "_f" + llvm::Twine(i)).str(), first_line + i);
+        auto * x = F->getArg(0);
+        auto * scaled = builder.CreateMul(x, builder.getInt32(i + 1));
+        llvm::Value * result = builder.CreateAdd(scaled, builder.getInt32(i));
+        if (!globals.empty()) {
+            auto * G = globals[i % globals.size()];
+            auto * value = builder.CreateLoad(i32, G);
+            builder.CreateStore(builder.CreateAdd(value, builder.getInt32(1)), G);
+            result = builder.CreateAdd(result, value);
+        }
+        if (!strings.empty()) {
+            auto * S = strings[i % strings.size()];
+            auto * byte = builder.CreateLoad(builder.getInt8Ty(), S);
+            result = builder.CreateAdd(result, builder.CreateZExt(byte, i32));
+        }
+
+        unsigned calls = i == 0 ? 0 : static_cast<unsigned>(whole_calls) + (extra_call(random) ? 1 : 0);
+        if (calls) {
+            auto * entry_block = builder.GetInsertBlock();
+            auto * call_block = llvm::BasicBlock::Create(context, "calls", F);
+            auto * exit_block = llvm::BasicBlock::Create(context, "exit", F);
+            builder.CreateCondBr(builder.CreateICmpSLT(x, builder.getInt32(0)), call_block, exit_block);
+
+            builder.SetInsertPoint(call_block);
+            std::uniform_int_distribution<unsigned> callee(0, i - 1);
+            auto * argument = builder.CreateAdd(x, builder.getInt32(1));
+            llvm::Value * sum = result;
+            for (unsigned c = 0; c < calls; ++c) {
+                sum = builder.CreateAdd(sum, builder.CreateCall(leaves[callee(random)], { argument }));
+            }
+            builder.CreateBr(exit_block);
+
+            builder.SetInsertPoint(exit_block);
+            auto * merged = builder.CreatePHI(i32, 2);
+            merged->addIncoming(result, entry_block);
+            merged->addIncoming(sum, call_block);
+            result = merged;
+        }
+        builder.CreateRet(result);
+        leaves.push_back(F);
+    }
+
+    auto * entry = define((name + "_entry").str(), first_line + shape.functions);
+    llvm::Value * sum = builder.getInt32(0);
+    for (auto * F : leaves) {
+        sum = builder.CreateAdd(sum, builder.CreateCall(F, { entry->getArg(0) }));
+    }
+    builder.CreateRet(sum);
+
+    if (DIB) {
+        DIB->finalize();
+    }
+    return M;
+}
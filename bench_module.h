@@ -0,0 +1,34 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include <cstdint>
+#include <memory>
+
+// Synthetic workload of the benchmarks: `functions` leaf functions
+// `<name>_f<i>(i32) -> i32` and `<name>_entry(i32) -> i32`, which calls every
+// one of them and returns the sum, so a single call runs the whole module.
+struct bench_module_shape {
+    unsigned functions = 1;
+    // calls from each function to functions defined before it in the module,
+    // on average. The calls sit behind a branch on a negative argument that
+    // the entry never passes, so they are compiled and linked but a call of
+    // the entry still runs each function once.
+    double call_density = 0;
+    // i32 globals `<name>_g<i>`, each function reads and increments one
+    unsigned globals = 0;
+    // private string constants, each function reads a byte of one
+    unsigned strings = 0;
+    unsigned string_length = 32;
+    // a compile unit, one subprogram per function, a line per instruction and
+    // the location of each parameter and global
+    bool debug_info = false;
+    // picks the callees
+    uint32_t seed = 0;
+};
+
+// the triple is the JIT's, the data layout is left empty for the JIT to fill
+// in (eager mode)
+std::unique_ptr<llvm::Module> generate_bench_module(llvm::LLVMContext & context, llvm::StringRef name, const bench_module_shape & shape);
@@ -0,0 +1,163 @@
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "bench_module.h"
+#include "jit.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Pushes generated modules through add_IR_module and lookup one after the
+// other and reports, every -report-every modules, the time per module and how
+// memory has grown, so the point where the JIT stops scaling shows up as a
+// rising row. 10000 modules of 10 functions is the 100k function workload.
+
+static llvm::cl::opt<unsigned> num_modules("modules", llvm::cl::desc("Modules to add"), llvm::cl::init(1000));
+static llvm::cl::opt<unsigned> report_every("report-every", llvm::cl::desc("Modules per report row, 0 picks about 20 rows"), llvm::cl::init(0));
+static llvm::cl::opt<unsigned> functions("functions", llvm::cl::desc("Functions per module"), llvm::cl::init(10));
+static llvm::cl::opt<double> call_density("call-density", llvm::cl::desc("Calls per function to other functions of its module"), llvm::cl::init(1.0));
+static llvm::cl::opt<unsigned> globals("globals", llvm::cl::desc("Globals per module"), llvm::cl::init(4));
+static llvm::cl::opt<unsigned> strings("strings", llvm::cl::desc("String constants per module"), llvm::cl::init(4));
+static llvm::cl::opt<unsigned> string_length("string-length", llvm::cl::desc("Bytes per string constant"), llvm::cl::init(32));
+static llvm::cl::opt<bool> debug_info("debug-info", llvm::cl::desc("Generate DWARF for every module"));
+static llvm::cl::opt<bool> rtdyld("rtdyld", llvm::cl::desc("Link with RTDyld instead of JITLink"));
+static llvm::cl::opt<unsigned> compile_threads("compile-threads", llvm::cl::desc("JIT compile threads"), llvm::cl::init(0));
+static llvm::cl::opt<bool> print_stats("stats", llvm::cl::desc("Print the JIT pipeline stages at the end"));
+
+// resident set of the process, the peak where the current one is not
+// available
+static uint64_t rss_kb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.WorkingSetSize >> 10;
+#else
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size, resident;
+    if (statm >> size >> resident) {
+        return resident * llvm::sys::Process::getPageSizeEstimate() >> 10;
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss >> 10;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+
+    JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
+
+    JIT::set_log_level(JIT::log_level::error);
+
+    bench_module_shape shape;
+    shape.functions = functions;
+    shape.call_density = call_density;
+    shape.globals = globals;
+    shape.strings = strings;
+    shape.string_length = string_length;
+    shape.debug_info = debug_info;
+
+    unsigned interval = report_every ? report_every : std::max(1u, num_modules / 20);
+
+    uint64_t base_rss_kb = rss_kb();
+    auto start = std::chrono::steady_clock::now();
+    JIT::options opts;
+    opts.jitlink = !rtdyld;
+    opts.compile_threads = compile_threads;
+    JIT jit(opts);
+    llvm::outs() << "JIT constructed in " << elapsed_ns(start) / 1000 << " us, "
+                 << num_modules << " modules of " << functions << " functions, "
+                 << (rtdyld ? "RTDyld" : "JITLink") << (debug_info ? ", debug info" : "") << "\n";
+
+    // per module averages over the rows' interval, lookup is of the first
+    // module's entry once linked, growth is the RSS and code added per module
+    llvm::outs() << "  modules  functions   generate       add  first call   lookup        RSS   RSS growth       code  code growth\n"
+                    "                             us        us          us       ns        KiB     B/module        KiB     B/module\n";
+
+    uint64_t generate_ns = 0, add_ns = 0, first_call_ns = 0;
+    uint64_t row_rss_kb = rss_kb(), row_code_bytes = 0;
+    unsigned row_modules = 0;
+    for (unsigned m = 0; m < num_modules; ++m) {
+        auto name = "m" + std::to_string(m);
+        shape.seed = m;
+
+        start = std::chrono::steady_clock::now();
+        auto context = std::make_unique<llvm::LLVMContext>();
+        auto M = generate_bench_module(*context, name, shape);
+        llvm::orc::ThreadSafeModule module(std::move(M), std::move(context));
+        generate_ns += elapsed_ns(start);
+
+        start = std::chrono::steady_clock::now();
+        jit.add_IR_module(std::move(module));
+        add_ns += elapsed_ns(start);
+
+        start = std::chrono::steady_clock::now();
+        auto entry = jit.lookup_as_pointer<int(int)>(name + "_entry");
+        volatile int result = entry(1);
+        (void)result;
+        first_call_ns += elapsed_ns(start);
+
+        if (++row_modules < interval && m + 1 < num_modules) {
+            continue;
+        }
+
+        // the symbol table grows with every module
+        const unsigned lookups = 100;
+        start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < lookups; ++i) {
+            if (!jit.lookup("m0_entry")) {
+                llvm::errs() << "m0_entry not found\n";
+                return 1;
+            }
+        }
+        uint64_t lookup_ns = elapsed_ns(start) / lookups;
+
+        uint64_t now_rss_kb = rss_kb();
+        uint64_t code_bytes = jit.budget_stats().resident_bytes;
+        auto growth = [row_modules](uint64_t before, uint64_t after) {
+            return after > before ? (after - before) / row_modules : 0;
+        };
+        llvm::outs() << llvm::format("%9u %10llu %10llu %9llu %11llu %8llu %10llu %12llu %10llu %12llu\n",
+            m + 1, (unsigned long long)(m + 1) * functions,
+            (unsigned long long)(generate_ns / row_modules / 1000), (unsigned long long)(add_ns / row_modules / 1000),
+            (unsigned long long)(first_call_ns / row_modules / 1000), (unsigned long long)lookup_ns,
+            (unsigned long long)now_rss_kb, (unsigned long long)growth(row_rss_kb << 10, now_rss_kb << 10),
+            (unsigned long long)(code_bytes >> 10), (unsigned long long)growth(row_code_bytes, code_bytes));
+        llvm::outs().flush();
+
+        generate_ns = add_ns = first_call_ns = 0;
+        row_rss_kb = now_rss_kb;
+        row_code_bytes = code_bytes;
+        row_modules = 0;
+    }
+
+    uint64_t end_rss_kb = rss_kb();
+    llvm::outs() << "RSS grew by " << (end_rss_kb > base_rss_kb ? end_rss_kb - base_rss_kb : 0) << " KiB, "
+                 << jit.budget_stats().resident_bytes << " bytes of code and data mapped\n";
+
+    if (print_stats) {
+        jit.dump_stats(llvm::outs());
+    }
+    return 0;
+}
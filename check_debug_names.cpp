@@ -0,0 +1,70 @@
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit.h"
+#include "jit_gdb.h"
+
+#include <string>
+
+// Compiles a C function in-process with debug_accelerator_tables and checks
+// that the debug object registered for it has a non-empty .debug_names, so
+// the compile unit made it into the name index. With -no-accel-tables checks
+// the opposite, that the option is what adds the section.
+
+static llvm::cl::opt<bool> no_accel_tables("no-accel-tables", llvm::cl::desc("Expect no .debug_names, the option is off"));
+
+static const char * source = R"(
+int f(int x) { int y = x * 3; return y + 1; }
+int j(void) { return f(2); }
+)";
+
+int main(int argc, char *argv[]) {
+
+    JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
+
+    JIT::set_log_level(JIT::log_level::error);
+
+    JIT::options opts;
+    opts.jitlink = true;
+    opts.debug_accelerator_tables = !no_accel_tables;
+    JIT jit(opts);
+
+    if (!jit.add_C_source(source, "check_debug_names.c", { "-O0", "-g" })) {
+        llvm::errs() << "check_debug_names: compiling the source failed\n";
+        return 1;
+    }
+    if (jit.lookup_as_pointer<int(void)>("j")() != 7) {
+        llvm::errs() << "check_debug_names: j() returned the wrong value\n";
+        return 1;
+    }
+    jit.flush_debug_registration();
+
+    auto objects = jit_gdb_copy_objects();
+    if (objects.empty()) {
+        llvm::errs() << "check_debug_names: no debug object registered\n";
+        return 1;
+    }
+    uint64_t names = 0;
+    for (auto & buffer : objects) {
+        auto object = llvm::object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+        if (!object) {
+            llvm::logAllUnhandledErrors(object.takeError(), llvm::errs(), "check_debug_names: ");
+            return 1;
+        }
+        for (const auto & section : (*object)->sections()) {
+            auto name = section.getName();
+            if (name && *name == ".debug_names") {
+                names += section.getSize();
+            } else if (!name) {
+                llvm::consumeError(name.takeError());
+            }
+        }
+    }
+
+    llvm::outs() << "check_debug_names: " << names << " bytes of .debug_names in " << objects.size() << " debug objects\n";
+    if (no_accel_tables ? names != 0 : names == 0) {
+        llvm::errs() << "check_debug_names: expected " << (no_accel_tables ? "no" : "a non-empty") << " .debug_names\n";
+        return 1;
+    }
+    return 0;
+}
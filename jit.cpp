@@ -1,35 +1,123 @@
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/ExecutionEngine/JITSymbol.h>
 #include <llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h>
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
 #include <llvm/ExecutionEngine/Orc/Debugging/DebuggerSupport.h>
 #include <llvm/ExecutionEngine/Orc/Debugging/DebuggerSupportPlugin.h>
+#include <llvm/ExecutionEngine/Orc/Debugging/PerfSupportPlugin.h>
 #include <llvm/ExecutionEngine/Orc/DebugObjectManagerPlugin.h>
 #include <llvm/ExecutionEngine/Orc/EPCEHFrameRegistrar.h>
 #include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/IRTransformLayer.h>
 #include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ObjectTransformLayer.h>
 #include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/Orc/TaskDispatch.h>
 #include <llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderGDB.h>
+#include <llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderPerf.h>
 #include <llvm/ExecutionEngine/Orc/TargetProcess/RegisterEHFrames.h>
 #include <llvm/ExecutionEngine/Orc/TargetProcess/TargetExecutionUtils.h>
 #include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/StandardInstrumentations.h>
 #include <llvm/TargetParser/Host.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Compression.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/PrettyStackTrace.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/TimeProfiler.h>
 
 #include "jit.h"
+#include "jit_eviction.h"
+#include "jit_gdb.h"
+#include "jit_log.h"
+#include "jit_memory.h"
+#include "jit_object_cache.h"
+#include "jit_optimize.h"
+#include "jit_perf.h"
+#include "jit_pgo.h"
+#include "jit_profiler.h"
+#include "jit_speculation.h"
+#include "jit_stats.h"
+#include "jit_tiered.h"
+#include "jit_trace.h"
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <stdio.h>
 
 llvm::ExitOnError ExitOnErr;
 
+// runs ORC materialization and compile tasks on a fixed size thread pool.
+class pooled_task_dispatcher : public llvm::orc::TaskDispatcher {
+    llvm::ThreadPool pool;
+
+    public:
+
+    pooled_task_dispatcher(unsigned threads) : pool(llvm::hardware_concurrency(threads)) {}
+
+    void dispatch(std::unique_ptr<llvm::orc::Task> T) override {
+        // ThreadPool tasks must be copyable
+        pool.async([UnownedT = T.release()]() mutable {
+            std::unique_ptr<llvm::orc::Task> T(UnownedT);
+            T->run();
+        });
+    }
+
+    void shutdown() override {
+        pool.wait();
+    }
+};
+
+// runs every task (materializations, lookups continuing on another thread)
+// inside a trace span named after the task
+class traced_task_dispatcher : public llvm::orc::TaskDispatcher {
+    std::unique_ptr<llvm::orc::TaskDispatcher> inner;
+    jit_trace & trace;
+
+    public:
+
+    traced_task_dispatcher(std::unique_ptr<llvm::orc::TaskDispatcher> inner, jit_trace & trace) : inner(std::move(inner)), trace(trace) {}
+
+    void dispatch(std::unique_ptr<llvm::orc::Task> T) override {
+        std::string description;
+        llvm::raw_string_ostream os(description);
+        T->printDescription(os);
+        inner->dispatch(llvm::orc::makeGenericNamedTask(
+          [this, T = std::move(T), description = std::move(os.str())]() {
+            jit_trace::scope S(&trace, "task", description);
+            T->run();
+          },
+          "traced task"
+        ));
+    }
+
+    void shutdown() override {
+        inner->shutdown();
+    }
+};
+
 JIT::main_llvm_init::main_llvm_init(int argc, const char *argv[]) {
     // Initialize LLVM.
     X = std::make_unique<llvm::InitLLVM>(argc, argv);
@@ -57,59 +145,236 @@ JIT::main_llvm_init::main_llvm_init(int argc, const char *argv[]) {
     ExitOnErr.setBanner(std::string(argv[0]) + ": ");
 }
 
-std::unique_ptr<llvm::orc::LLJIT> build_jit(bool jitlink) {
-  
-    llvm::outs() << "JIT creating ...\n";
-  
-    jit_ps(main);
-    jit_ps(__jit_debug_descriptor);
-    jit_ps(__jit_debug_register_code);
-    jit_ps(llvm_orc_registerJITLoaderGDBWrapper);
-    jit_ps(llvm_orc_registerJITLoaderGDBAllocAction);
-  
-    auto JTMB = llvm::orc::JITTargetMachineBuilder(llvm::Triple(jit_target_triple));
-    
-    // Retrieve host CPU name and sub-target features and add them to builder.
-    // codegen opt level are kept to default values.
-    llvm::StringMap<bool> FeatureMap;
-    llvm::sys::getHostCPUFeatures(FeatureMap);
-    for (auto &Feature : FeatureMap)
-        JTMB.getFeatures().AddFeature(Feature.first(), Feature.second);
- 
-    JTMB.setCPU(std::string(llvm::sys::getHostCPUName()));
-    
-    // Position Independent Code(
-    JTMB.setRelocationModel(llvm::Reloc::PIC_);
-    
-    // Don't make assumptions about displacement sizes
-    JTMB.setCodeModel(llvm::CodeModel::Large);
+// module flag used to carry a per-module optimization level override from
+// add_IR_module to the IR transform stage
+static const char * jit_opt_level_flag = "jit.opt_level";
+// same for the debug information policy
+static const char * jit_debug_info_flag = "jit.debug_info";
+
+static const char * opt_level_name(JIT::opt_level opt) {
+    switch (opt) {
+        case JIT::opt_level::O0: return "O0";
+        case JIT::opt_level::O1: return "O1";
+        case JIT::opt_level::O2: return "O2";
+        case JIT::opt_level::O3: return "O3";
+        case JIT::opt_level::Os: return "Os";
+    }
+    llvm_unreachable("unknown JIT::opt_level");
+}
+
+static llvm::OptimizationLevel to_llvm_opt_level(JIT::opt_level opt) {
+    switch (opt) {
+        case JIT::opt_level::O0: return llvm::OptimizationLevel::O0;
+        case JIT::opt_level::O1: return llvm::OptimizationLevel::O1;
+        case JIT::opt_level::O2: return llvm::OptimizationLevel::O2;
+        case JIT::opt_level::O3: return llvm::OptimizationLevel::O3;
+        case JIT::opt_level::Os: return llvm::OptimizationLevel::Os;
+    }
+    llvm_unreachable("unknown JIT::opt_level");
+}
+
+JIT::opt_level JIT::module_opt_level(const llvm::Module & M, opt_level fallback) {
+    if (auto * level = llvm::mdconst::extract_or_null<llvm::ConstantInt>(M.getModuleFlag(jit_opt_level_flag))) {
+        return static_cast<opt_level>(level->getZExtValue());
+    }
+    return fallback;
+}
 
-    // Create an LLJIT instance and use a custom object linking layer creator to
-    // register the GDBRegistrationListener with our RTDyldObjectLinkingLayer.
+void JIT::set_module_opt_level(llvm::orc::ThreadSafeModule & TSM, opt_level opt) {
+    TSM.withModuleDo([&](llvm::Module & M) {
+        auto * level = llvm::ConstantInt::get(llvm::Type::getInt32Ty(M.getContext()), static_cast<uint32_t>(opt));
+        M.setModuleFlag(llvm::Module::Override, jit_opt_level_flag, llvm::ConstantAsMetadata::get(level));
+    });
+}
+
+JIT::debug_info JIT::module_debug_info(const llvm::Module & M, debug_info fallback) {
+    if (auto * debug = llvm::mdconst::extract_or_null<llvm::ConstantInt>(M.getModuleFlag(jit_debug_info_flag))) {
+        return static_cast<debug_info>(debug->getZExtValue());
+    }
+    return fallback;
+}
+
+void JIT::set_module_debug_info(llvm::orc::ThreadSafeModule & TSM, debug_info debug) {
+    TSM.withModuleDo([&](llvm::Module & M) {
+        auto * level = llvm::ConstantInt::get(llvm::Type::getInt32Ty(M.getContext()), static_cast<uint32_t>(debug));
+        M.setModuleFlag(llvm::Module::Override, jit_debug_info_flag, llvm::ConstantAsMetadata::get(level));
+    });
+}
+
+// drop what `debug` does not keep, before optimization so the passes do not
+// carry it along
+static void strip_debug_info(llvm::Module & M, JIT::debug_info debug) {
+    switch (debug) {
+        case JIT::debug_info::full:
+            break;
+        case JIT::debug_info::line_tables:
+            llvm::stripNonLineTableDebugInfo(M);
+            break;
+        case JIT::debug_info::symbols:
+        case JIT::debug_info::none:
+            llvm::StripDebugInfo(M);
+            break;
+    }
+}
+
+void optimize_module(llvm::Module & M, JIT::opt_level opt, llvm::TargetMachine * TM) {
+    if (opt == JIT::opt_level::O0) {
+        return;
+    }
+
+    // clang -O0 marks every function optnone + noinline, which would turn the
+    // pipeline into a no-op, the JIT decides the level instead.
+    for (auto & F : M) {
+        if (F.hasFnAttribute(llvm::Attribute::OptimizeNone)) {
+            F.removeFnAttr(llvm::Attribute::OptimizeNone);
+            F.removeFnAttr(llvm::Attribute::NoInline);
+        }
+    }
+
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+
+    // a span per pass while a JIT trace is recording on this thread
+    llvm::PassInstrumentationCallbacks PIC;
+    std::optional<llvm::StandardInstrumentations> SI;
+    if (llvm::timeTraceProfilerEnabled()) {
+        SI.emplace(M.getContext(), false);
+        SI->registerCallbacks(PIC, &MAM);
+    }
+
+    llvm::PassBuilder PB(TM, llvm::PipelineTuningOptions(), std::nullopt, &PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    llvm::ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(to_llvm_opt_level(opt));
+    MPM.run(M, MAM);
+}
+
+// shared between LLJITBuilder and LLLazyJITBuilder
+template <typename Builder>
+static void setup_builder(Builder & builder, const JIT::options & opts, llvm::orc::JITTargetMachineBuilder JTMB, jit_object_cache * object_cache, jit_code_memory * code_memory, jit_perf_map * perf_map, jit_stats * metrics, jit_trace * trace) {
+    // Materialization tasks run in place on the thread that triggered them
+    // unless compile threads were requested, ConcurrentIRCompiler is used
+    // whenever NumCompileThreads is non-zero.
+    std::unique_ptr<llvm::orc::TaskDispatcher> dispatcher;
+    if (opts.compile_threads > 0) {
+        JIT_LOG(info, "JIT compiling on " + llvm::Twine(opts.compile_threads) + " threads.");
+        dispatcher = std::make_unique<pooled_task_dispatcher>(opts.compile_threads);
+    } else {
+        dispatcher = std::make_unique<llvm::orc::InPlaceTaskDispatcher>();
+    }
+    if (trace) {
+        dispatcher = std::make_unique<traced_task_dispatcher>(std::move(dispatcher), *trace);
+    }
+    builder.setExecutorProcessControl(ExitOnErr(llvm::orc::SelfExecutorProcessControl::Create(std::make_shared<llvm::orc::SymbolStringPool>(), std::move(dispatcher))));
+    builder.setNumCompileThreads(opts.compile_threads);
+
+    if (opts.compress_debug_sections) {
+        if (llvm::compression::zlib::isAvailable()) {
+            JIT_LOG(info, "JIT compressing debug sections with zlib.");
+            JTMB.getOptions().CompressDebugSections = llvm::DebugCompressionType::Zlib;
+        } else {
+            JIT_LOG(warning, "JIT zlib unavailable, debug sections left uncompressed.");
+        }
+    }
+
+    if (opts.debug_accelerator_tables) {
+        // LLDB tuning selects .debug_names accelerator tables on ELF, also
+        // read by GDB in place of its index
+        JIT_LOG(info, "JIT emitting DWARF accelerator tables.");
+        JTMB.getOptions().DebuggerTuning = llvm::DebuggerKind::LLDB;
+    }
+
+    if (object_cache) {
+        JIT_LOG(info, "JIT object cache enabled in " + opts.object_cache_dir + ".");
+        object_cache->set_target(JTMB);
+    }
+    // same compilers LLJIT picks by default, with the cache (when enabled)
+    // attached and codegen timed
+    builder.setCompileFunctionCreator(
+      [object_cache, metrics, concurrent = opts.compile_threads > 0](
+        llvm::orc::JITTargetMachineBuilder JTMB
+      ) -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+        std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler> compiler;
+        if (concurrent) {
+          compiler = std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(JTMB), object_cache);
+        } else {
+          auto TM = JTMB.createTargetMachine();
+          if (!TM) {
+            return TM.takeError();
+          }
+          compiler = std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*TM), object_cache);
+        }
+        if (metrics) {
+          return std::make_unique<jit_stats::compiler>(*metrics, std::move(compiler));
+        }
+        return std::move(compiler);
+      }
+    );
+
+    // Use a custom object linking layer creator to register the
+    // GDBRegistrationListener with our RTDyldObjectLinkingLayer.
     
-    auto builder = llvm::orc::LLJITBuilder();
     builder.setJITTargetMachineBuilder(std::move(JTMB));
-    if (jitlink) {
+    if (opts.jitlink) {
       builder.setObjectLinkingLayerCreator(
-        [&](llvm::orc::ExecutionSession &ES, const llvm::Triple &TT
+        [code_memory, perf_map, metrics, jitdump = opts.perf_jitdump](llvm::orc::ExecutionSession &ES, const llvm::Triple &TT
         ) {
-          llvm::outs() << "JIT JitLink ObjectLinkingLayer creating...\n";
-          auto EPC = ExitOnErr(llvm::orc::SelfExecutorProcessControl::Create(std::make_shared<llvm::orc::SymbolStringPool>()));
-          
-          auto ObjLinkingLayer = std::make_unique<llvm::orc::ObjectLinkingLayer>(ES, EPC->getMemMgr());
-          
+          JIT_LOG(debug, "JIT JitLink ObjectLinkingLayer creating...");
+          // the layer keeps a reference to the memory manager, so it has to
+          // come from the session's process control rather than a local one
+          auto ObjLinkingLayer = std::make_unique<llvm::orc::ObjectLinkingLayer>(ES, ES.getExecutorProcessControl().getMemMgr());
+
+          // the stats plugins bracket the EH frame plugin and the debug
+          // plugins, see jit_stats.h
+          if (metrics) {
+            ObjLinkingLayer->addPlugin(std::make_unique<jit_stats::plugin>(*metrics, jit_stats::plugin::position::first));
+          }
+
           ObjLinkingLayer->addPlugin(std::make_unique<llvm::orc::EHFrameRegistrationPlugin>(ES, ExitOnErr(llvm::orc::EPCEHFrameRegistrar::Create(ES))));
+          if (metrics) {
+            ObjLinkingLayer->addPlugin(std::make_unique<jit_stats::plugin>(*metrics, jit_stats::plugin::position::after_eh_frame));
+          }
           
           if (TT.isOSBinFormatMachO()) {
-            llvm::outs() << "JIT JitLink ObjLinkingLayer Debugging Information may not work on darwin.\n";
+            JIT_LOG(warning, "JIT JitLink ObjLinkingLayer Debugging Information may not work on darwin.");
             // ObjLinkingLayer->addPlugin(ExitOnErr(llvm::orc::GDBJITDebugInfoRegistrationPlugin::Create(ES, JD, TM->getTargetTripl));
           } else {
 #ifdef _COMPILER_ASAN_ENABLED_
-            llvm::outs() << "JIT JitLink asan enabled, not registering DebugObjectManagerPlugin.\n";
+            JIT_LOG(info, "JIT JitLink asan enabled, not registering DebugObjectManagerPlugin.");
 #else
-            llvm::outs() << "JIT JitLink asan disabled, registering DebugObjectManagerPlugin.\n";
+            JIT_LOG(debug, "JIT JitLink asan disabled, registering DebugObjectManagerPlugin.");
             // EPCDebugObjectRegistrar doesn't take a JITDylib, so we have to directly provide the call address
-            ObjLinkingLayer->addPlugin(std::make_unique<llvm::orc::DebugObjectManagerPlugin>(ES, std::make_unique<llvm::orc::EPCDebugObjectRegistrar>(ES, llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderGDBWrapper))));
+            // objects of debug_info::none modules never reach it
+            ObjLinkingLayer->addPlugin(std::make_unique<jit_gdb_debug_filter>(std::make_unique<llvm::orc::DebugObjectManagerPlugin>(ES, std::make_unique<llvm::orc::EPCDebugObjectRegistrar>(ES, llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderGDBWrapper)))));
+#endif
+          }
+
+          if (code_memory) {
+            ObjLinkingLayer->addPlugin(std::make_unique<jit_code_memory::plugin>(*code_memory));
+          }
+
+          if (perf_map) {
+            ObjLinkingLayer->addPlugin(std::make_unique<jit_perf_map::plugin>(*perf_map));
+          }
+          if (jitdump) {
+#ifdef __linux__
+            // writes /tmp/jit-<pid>.dump with code bytes and line tables for
+            // perf inject --jit
+            ObjLinkingLayer->addPlugin(std::make_unique<llvm::orc::PerfSupportPlugin>(
+              ES.getExecutorProcessControl(),
+              llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfStart),
+              llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfEnd),
+              llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfImpl),
+              true, false));
+            JIT_LOG(info, "JIT JitLink jitdump enabled.");
+#else
+            JIT_LOG(warning, "JIT JitLink jitdump needs Linux, disabled.");
 #endif
           }
 
@@ -119,91 +384,787 @@ std::unique_ptr<llvm::orc::LLJIT> build_jit(bool jitlink) {
           // Make sure the debug info sections aren't stripped.
           //ObjLinkingLayer->setProcessAllSections(true);
 
-          llvm::outs() << "JIT JitLink ObjectLinkingLayer created.\n";
+          JIT_LOG(debug, "JIT JitLink ObjectLinkingLayer created.");
           
           return ObjLinkingLayer;
         }
       );
       builder.setPrePlatformSetup(
-        [](
+        [metrics](
           llvm::orc::LLJIT &J
         ) {
           // Try to enable debugging of JIT'd code (only works with JITLink for
-          // ELF and MachO).
-          if (auto E = llvm::orc::enableDebuggerSupport(J)) {
-            llvm::errs() << "JIT JitLink failed to enable debugger support, Debug Information may be unavailable for JIT compiled code.\nError: " << E << "\n";
+          // ELF and MachO). For ELF it would add a second, unfiltered debug
+          // plugin next to the one the layer creator installed.
+          if (J.getTargetTriple().isOSBinFormatELF()) {
+            JIT_LOG(info, "JIT JitLink debugger support enabled.");
+          } else if (auto E = llvm::orc::enableDebuggerSupport(J)) {
+            JIT_LOG(warning, "JIT JitLink failed to enable debugger support, Debug Information may be unavailable for JIT compiled code.\nError: " + llvm::toString(std::move(E)));
+            llvm::consumeError(std::move(E));
           } else {
-            llvm::outs() << "JIT JitLink debugger support enabled.\n";
+            JIT_LOG(info, "JIT JitLink debugger support enabled.");
+          }
+          auto & ObjLinkingLayer = static_cast<llvm::orc::ObjectLinkingLayer &>(J.getObjLinkingLayer());
+          // after the debug plugins of enableDebuggerSupport, it claims the
+          // GDB entries they register so remove_module can unregister them.
+          // The ELF filter does that itself, before its debug plugin frees
+          // the objects.
+          if (!J.getTargetTriple().isOSBinFormatELF()) {
+            ObjLinkingLayer.addPlugin(std::make_unique<jit_gdb_plugin>());
+          }
+          if (metrics) {
+            ObjLinkingLayer.addPlugin(std::make_unique<jit_stats::plugin>(*metrics, jit_stats::plugin::position::last));
           }
           return llvm::Error::success();
         }
       );
     } else {
       builder.setObjectLinkingLayerCreator(
-        [&](llvm::orc::ExecutionSession &ES, const llvm::Triple &TT
+        [code_memory, perf_map, metrics, jitdump = opts.perf_jitdump](llvm::orc::ExecutionSession &ES, const llvm::Triple &TT
       ) {
-        llvm::outs() << "JIT RTDyldObjectLinkingLayer creating...\n";
-        auto GetMemMgr = []() {
+        JIT_LOG(debug, "JIT RTDyldObjectLinkingLayer creating...");
+        auto GetMemMgr = [code_memory]() -> std::unique_ptr<llvm::RuntimeDyld::MemoryManager> {
+            if (code_memory) {
+                return std::make_unique<jit_code_memory::memory_manager>(*code_memory);
+            }
             return std::make_unique<llvm::SectionMemoryManager>();
         };
         auto ObjLinkingLayer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(ES, std::move(GetMemMgr));
 
         // Register the event listener.
-        ObjLinkingLayer->registerJITEventListener(*llvm::JITEventListener::createGDBRegistrationListener());
+        static jit_gdb_listener_filter gdb_listener(*llvm::JITEventListener::createGDBRegistrationListener());
+        ObjLinkingLayer->registerJITEventListener(gdb_listener);
+
+        if (perf_map) {
+          ObjLinkingLayer->registerJITEventListener(perf_map->event_listener());
+        }
+        if (jitdump) {
+          // null unless LLVM was built with LLVM_USE_PERF
+          if (auto * listener = llvm::JITEventListener::createPerfJITEventListener()) {
+            ObjLinkingLayer->registerJITEventListener(*listener);
+            JIT_LOG(info, "JIT RTDyld jitdump enabled.");
+          } else {
+            JIT_LOG(warning, "JIT RTDyld jitdump needs LLVM built with LLVM_USE_PERF, disabled.");
+          }
+        }
 
         // Make sure the debug info sections aren't stripped.
         ObjLinkingLayer->setProcessAllSections(true);
 
-        llvm::outs() << "JIT RTDyldObjectLinkingLayer created.\n";
+        if (metrics) {
+          // the link stage started in the object transform layer, see build_jit
+          ObjLinkingLayer->setNotifyEmitted([metrics](llvm::orc::MaterializationResponsibility &R, std::unique_ptr<llvm::MemoryBuffer> Obj) {
+            metrics->object_emitted(*Obj);
+          });
+        }
+
+        JIT_LOG(debug, "JIT RTDyldObjectLinkingLayer created.");
         
         return ObjLinkingLayer;
       });
     }
+}
+
+// called by a lazy stub when compiling its function failed
+static void lazy_compile_failure() {
+    llvm::errs() << "JIT lazy compilation failed, aborting.\n";
+    abort();
+}
+
+// read the bodies of a lazily loaded bitcode module, called with the context
+// lock held before the module is transformed or compiled.
+static llvm::Error materialize_module(llvm::Module & M) {
+    return M.materializeAll();
+}
+
+// partition a lazily compiled module so that the requested functions are
+// compiled together with every function in their call graph SCC.
+static std::optional<llvm::orc::CompileOnDemandLayer::GlobalValueSet> partition_by_scc(llvm::orc::CompileOnDemandLayer::GlobalValueSet requested) {
+    if (requested.empty()) {
+        return requested;
+    }
+
+    // the layer holds the context lock while partitioning, the call graph
+    // needs every body of a lazily loaded module to find the cycles.
+    auto & M = *const_cast<llvm::Module *>((*requested.begin())->getParent());
+    if (auto Err = materialize_module(M)) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT lazy partition failed: ");
+        return std::nullopt;
+    }
+    llvm::CallGraph CG(M);
+
+    auto partition = requested;
+    for (auto SCC = llvm::scc_begin(&CG); !SCC.isAtEnd(); ++SCC) {
+        bool is_requested = llvm::any_of(*SCC, [&](llvm::CallGraphNode * node) {
+            return node->getFunction() && requested.count(node->getFunction());
+        });
+        if (!is_requested) {
+            continue;
+        }
+        for (auto * node : *SCC) {
+            if (auto * F = node->getFunction(); F && !F->isDeclaration()) {
+                partition.insert(F);
+            }
+        }
+    }
+    return partition;
+}
+
+// read only the bodies that are about to be extracted into a partition, the
+// rest of a lazily loaded module stays on disk (or in the mapped buffer).
+static llvm::orc::CompileOnDemandLayer::PartitionFunction materialize_partition(llvm::orc::CompileOnDemandLayer::PartitionFunction partition) {
+    return [partition = std::move(partition)](llvm::orc::CompileOnDemandLayer::GlobalValueSet requested)
+      -> std::optional<llvm::orc::CompileOnDemandLayer::GlobalValueSet> {
+        auto result = partition(requested);
+        for (auto * GV : result ? *result : requested) {
+            if (GV->isMaterializable()) {
+                if (auto Err = const_cast<llvm::GlobalValue *>(GV)->materialize()) {
+                    llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT lazy partition failed: ");
+                }
+            }
+        }
+        return result;
+    };
+}
+
+llvm::orc::JITTargetMachineBuilder host_target_machine_builder() {
+    auto JTMB = llvm::orc::JITTargetMachineBuilder(llvm::Triple(jit_target_triple));
+    
+    // Retrieve host CPU name and sub-target features and add them to builder.
+    // codegen opt level are kept to default values.
+    llvm::StringMap<bool> FeatureMap;
+    llvm::sys::getHostCPUFeatures(FeatureMap);
+    for (auto &Feature : FeatureMap)
+        JTMB.getFeatures().AddFeature(Feature.first(), Feature.second);
+ 
+    JTMB.setCPU(std::string(llvm::sys::getHostCPUName()));
     
-    auto jit = ExitOnErr(builder.create());
+    // Position Independent Code(
+    JTMB.setRelocationModel(llvm::Reloc::PIC_);
+    
+    // Don't make assumptions about displacement sizes
+    JTMB.setCodeModel(llvm::CodeModel::Large);
+
+    return JTMB;
+}
+
+// on_compile sees every module on its way to codegen, before optimization,
+// code_memory (when set) is fed by the object linking layer, perf_map (when
+// set) names every function it links, metrics (when set) times every stage
+// and trace (when set) records every task
+std::unique_ptr<llvm::orc::LLJIT> build_jit(const JIT::options & opts, jit_object_cache * object_cache, jit_code_memory * code_memory, jit_perf_map * perf_map, jit_stats * metrics, jit_trace * trace, std::function<void(llvm::Module &)> on_compile) {
+  
+    JIT_LOG(debug, "JIT creating ...");
+  
+    jit_ps(main);
+    jit_ps(__jit_debug_descriptor);
+    jit_ps(__jit_debug_register_code);
+    jit_ps(llvm_orc_registerJITLoaderGDBWrapper);
+    jit_ps(llvm_orc_registerJITLoaderGDBAllocAction);
+  
+    auto JTMB = host_target_machine_builder();
+
+    // keep a copy for the optimization stage, it needs a TargetMachine for
+    // target specific cost models
+    auto OptJTMB = JTMB;
+
+    // Create an LLJIT instance, in lazy mode an LLLazyJIT that only compiles
+    // a function (or its call graph SCC) when its stub is first called.
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    if (opts.mode == JIT::compile_mode::lazy) {
+        auto builder = llvm::orc::LLLazyJITBuilder();
+        setup_builder(builder, opts, std::move(JTMB), object_cache, code_memory, perf_map, metrics, trace);
+        builder.setLazyCompileFailureAddr(llvm::orc::ExecutorAddr::fromPtr(&lazy_compile_failure));
+        auto lazy = ExitOnErr(builder.create());
+        if (opts.partition == JIT::lazy_partition::scc) {
+            JIT_LOG(info, "JIT lazy compilation enabled, partitioning by call graph SCC.");
+            lazy->setPartitionFunction(materialize_partition(partition_by_scc));
+        } else {
+            JIT_LOG(info, "JIT lazy compilation enabled, partitioning by function.");
+            lazy->setPartitionFunction(materialize_partition(llvm::orc::CompileOnDemandLayer::compileRequested));
+        }
+        jit = std::move(lazy);
+    } else {
+        auto builder = llvm::orc::LLJITBuilder();
+        setup_builder(builder, opts, std::move(JTMB), object_cache, code_memory, perf_map, metrics, trace);
+        jit = ExitOnErr(builder.create());
+    }
+
+    // optimize IR on its way from addIRModule to the compile layer.
+    JIT_LOG(info, "JIT IR optimization level set to " + llvm::Twine(opt_level_name(opts.opt)) + ".");
+    jit->getIRTransformLayer().setTransform(
+      [OptJTMB = std::move(OptJTMB), default_opt = opts.opt, default_debug = opts.debug, frame_pointers = opts.frame_pointers, metrics, on_compile = std::move(on_compile)](
+        llvm::orc::ThreadSafeModule TSM, llvm::orc::MaterializationResponsibility & R
+      ) mutable -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        auto Err = TSM.withModuleDo([&](llvm::Module & M) {
+          // bodies of lazily loaded bitcode are parsed here
+          jit_stats::timer T(metrics, JIT::pipeline_stage::parse, M.getModuleIdentifier());
+          return materialize_module(M);
+        });
+        if (Err) {
+          return std::move(Err);
+        }
+        auto debug = TSM.withModuleDo([&](llvm::Module & M) { return JIT::module_debug_info(M, default_debug); });
+        TSM.withModuleDo([&](llvm::Module & M) { strip_debug_info(M, debug); });
+        if (debug == JIT::debug_info::none) {
+          TSM.withModuleDo([](llvm::Module & M) { jit_gdb_skip_registration(M); });
+        }
+        if (frame_pointers) {
+          TSM.withModuleDo([](llvm::Module & M) {
+            for (auto & F : M) {
+              if (!F.isDeclaration()) {
+                F.addFnAttr("frame-pointer", "all");
+              }
+            }
+          });
+        }
+        TSM.withModuleDo(on_compile);
+        auto opt = TSM.withModuleDo([&](llvm::Module & M) { return JIT::module_opt_level(M, default_opt); });
+        if (opt == JIT::opt_level::O0) {
+          return std::move(TSM);
+        }
+        Err = TSM.withModuleDo([&](llvm::Module & M) -> llvm::Error {
+          jit_stats::timer T(metrics, JIT::pipeline_stage::optimize, M.getModuleIdentifier());
+          auto TM = OptJTMB.createTargetMachine();
+          if (!TM) {
+            return TM.takeError();
+          }
+          optimize_module(M, opt, TM->get());
+          return llvm::Error::success();
+        });
+        if (Err) {
+          return std::move(Err);
+        }
+        return std::move(TSM);
+      }
+    );
+
+    if (metrics && !opts.jitlink) {
+      // RTDyld links an object in one go, time it from here to its emission
+      jit->getObjTransformLayer().setTransform(
+        [metrics](std::unique_ptr<llvm::MemoryBuffer> Obj) -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+          metrics->object_received(*Obj);
+          return std::move(Obj);
+        }
+      );
+    }
     
-    llvm::outs() << "JIT created.\n";
+    JIT_LOG(info, "JIT created.");
     
     return jit;
 }
 
-JIT::JIT() : jit(build_jit(false)) {}
-JIT::JIT(bool jitlink) : jit(build_jit(jitlink)) {}
+JIT::JIT() : JIT(options()) {}
+JIT::JIT(bool jitlink) : JIT(jitlink, opt_level::O0) {}
+JIT::JIT(bool jitlink, opt_level opt) : JIT(options { jitlink, opt }) {}
+static std::unique_ptr<jit_object_cache> make_object_cache(const JIT::options & opts) {
+    if (opts.object_cache_dir.empty()) {
+        return nullptr;
+    }
+    // tiered and pgo mode put the addresses of their call counters into the
+    // IR, they change from run to run and so would every key. The eviction
+    // thunks do too but bypass the cache, the bodies they call are reloaded
+    // from it.
+    if (opts.mode == JIT::compile_mode::tiered || opts.mode == JIT::compile_mode::pgo) {
+        JIT_LOG(warning, "JIT object cache is not used in tiered and pgo mode, disabled.");
+        return nullptr;
+    }
+    return std::make_unique<jit_object_cache>(opts.object_cache_dir, opts.object_cache_size_limit);
+}
+
+static std::unique_ptr<jit_trace> make_trace(const JIT::options & opts) {
+    if (opts.trace_file.empty()) {
+        return nullptr;
+    }
+    auto trace = jit_trace::start(opts.trace_file, opts.trace_granularity_us);
+    if (!trace) {
+        llvm::logAllUnhandledErrors(trace.takeError(), llvm::errs(), "JIT trace disabled: ");
+        return nullptr;
+    }
+    JIT_LOG(info, "JIT recording a trace for " + opts.trace_file + ".");
+    return std::move(*trace);
+}
+
+static std::unique_ptr<jit_perf_map> make_perf_map(const JIT::options & opts) {
+    if (!opts.perf_map) {
+        return nullptr;
+    }
+    auto map = std::make_unique<jit_perf_map>();
+    if (!*map) {
+        return nullptr;
+    }
+    JIT_LOG(info, "JIT writing perf map.");
+    return map;
+}
+
+JIT::JIT(const options & opts) :
+    opts(opts),
+    object_cache(make_object_cache(this->opts)),
+    code_memory(std::make_unique<jit_code_memory>()),
+    perf_map(make_perf_map(this->opts)),
+    trace(make_trace(this->opts)),
+    metrics(std::make_unique<jit_stats>(trace.get(), object_cache.get())),
+    jit(build_jit(this->opts, object_cache.get(), code_memory.get(), perf_map.get(), metrics.get(), trace.get(), [this](llvm::Module & M) {
+        // set before the first module is added
+        if (speculation) {
+            speculation->on_compile(M);
+        }
+    }))
+{
+    if (opts.mode == compile_mode::tiered || opts.mode == compile_mode::pgo) {
+        JIT_LOG(info, "JIT " + llvm::Twine(opts.mode == compile_mode::pgo ? "profile guided" : "tiered") + " compilation enabled, tier-up after " + llvm::Twine(opts.tier_up_threshold) + " calls at " + opt_level_name(opts.tier_up_opt) + ".");
+        tiered = std::make_unique<tiered_state>(*this);
+    }
+    if (opts.speculate) {
+        if (opts.mode == compile_mode::lazy) {
+            JIT_LOG(info, "JIT speculative compilation enabled, " + llvm::Twine(opts.speculation_depth) + " call graph levels deep.");
+            speculation = std::make_unique<speculation_state>(*this);
+        } else {
+            JIT_LOG(warning, "JIT speculative compilation needs lazy mode, disabled.");
+        }
+    }
+    if (opts.code_budget) {
+        if (opts.mode == compile_mode::eager) {
+            JIT_LOG(info, "JIT code budget of " + llvm::Twine(opts.code_budget) + " bytes, least recently used modules are evicted past it.");
+            eviction = std::make_unique<eviction_state>(*this, *code_memory, opts.code_budget);
+        } else {
+            JIT_LOG(warning, "JIT code budget needs eager mode, disabled.");
+        }
+    }
+    if (opts.async_debug_registration) {
+        JIT_LOG(info, "JIT debug objects registered asynchronously.");
+        jit_gdb_start_async(opts.coalesce_debug_objects);
+    } else if (opts.coalesce_debug_objects) {
+        JIT_LOG(warning, "JIT debug object coalescing needs asynchronous registration, disabled.");
+    }
+    if (opts.defer_debug_registration) {
+        JIT_LOG(info, "JIT debug objects registered once a debugger attaches.");
+        jit_gdb_start_deferred(opts.debug_registration_signal);
+    }
+}
+
+JIT::~JIT() {
+    // before the members go, removing the modules unregisters synchronously
+    if (opts.defer_debug_registration) {
+        jit_gdb_stop_deferred();
+    }
+    if (opts.async_debug_registration) {
+        jit_gdb_stop_async();
+    }
 
-void JIT::add_IR_module(llvm::orc::ThreadSafeModule && module) {
-    llvm::outs() << "JIT addIRModule being called.\n";
-    ExitOnErr(jit->addIRModule(std::move(module)));
-    llvm::outs() << "JIT addIRModule called.\n";
+    // the background workers add modules and look up symbols
+    if (eviction) {
+        eviction->stop();
+    }
+    if (speculation) {
+        speculation->stop();
+    }
+    if (tiered) {
+        tiered->stop();
+    }
+    // finish the materializations in flight and join the compile threads, so
+    // nothing links or reports to code_memory while the members are destroyed
+    if (auto Err = jit->getExecutionSession().endSession()) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT shutdown: ");
+    }
+}
+
+llvm::Expected<JIT::module_handle> JIT::try_add_IR_module(llvm::orc::ThreadSafeModule && module) {
+    auto tracker = jit->getMainJITDylib().createResourceTracker();
+    auto add = [&]() -> llvm::Error {
+        if (tiered) {
+            return tiered->add(std::move(module), tracker);
+        }
+        if (eviction) {
+            return eviction->add(std::move(module), tracker);
+        }
+        if (opts.mode == compile_mode::lazy) {
+            // same as addLazyIRModule, the data layout is already set
+            return static_cast<llvm::orc::LLLazyJIT &>(*jit).getCompileOnDemandLayer().add(tracker, std::move(module));
+        }
+        return jit->addIRModule(tracker, std::move(module));
+    };
+    if (auto Err = add()) {
+        return llvm::joinErrors(std::move(Err), tracker->remove());
+    }
+
+    std::lock_guard<std::mutex> guard(modules_lock);
+    module_handle handle { next_module_handle++ };
+    modules[handle.id] = std::move(tracker);
+    return handle;
+}
+
+JIT::module_handle JIT::add_IR_module(llvm::orc::ThreadSafeModule && module) {
+    jit_trace::scope S(trace.get(), "add_IR_module", module.withModuleDo([](llvm::Module & M) { return M.getModuleIdentifier(); }));
+    JIT_LOG(debug, "JIT addIRModule being called.");
+    auto handle = ExitOnErr(try_add_IR_module(std::move(module)));
+    JIT_LOG(debug, "JIT addIRModule called.");
+    return handle;
+}
+
+JIT::module_handle JIT::add_IR_module(llvm::orc::ThreadSafeModule && module, opt_level opt) {
+    set_module_opt_level(module, opt);
+    return add_IR_module(std::move(module));
+}
+
+JIT::module_handle JIT::add_IR_module(llvm::orc::ThreadSafeModule && module, opt_level opt, debug_info debug) {
+    set_module_debug_info(module, debug);
+    return add_IR_module(std::move(module), opt);
+}
+
+JIT::module_handle JIT::add_IR_module(llvm::StringRef file_name) {
+    auto module = load_IR_module(file_name);
+    if (!module) {
+        llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), "JIT IR Read error.\n");
+        return {};
+    }
+    return add_IR_module(std::move(*module));
+}
+
+JIT::module_handle JIT::add_IR_module(llvm::StringRef file_name, opt_level opt) {
+    auto module = load_IR_module(file_name);
+    if (!module) {
+        llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), "JIT IR Read error.\n");
+        return {};
+    }
+    return add_IR_module(std::move(*module), opt);
+}
+
+JIT::module_handle JIT::add_IR_module(llvm::StringRef file_name, opt_level opt, debug_info debug) {
+    auto module = load_IR_module(file_name);
+    if (!module) {
+        llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), "JIT IR Read error.\n");
+        return {};
+    }
+    return add_IR_module(std::move(*module), opt, debug);
+}
+
+JIT::module_handle JIT::add_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer) {
+    auto module = load_IR_module(std::move(buffer));
+    if (!module) {
+        llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), "JIT IR Read error.\n");
+        return {};
+    }
+    return add_IR_module(std::move(*module));
+}
+
+JIT::module_handle JIT::add_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer, opt_level opt) {
+    auto module = load_IR_module(std::move(buffer));
+    if (!module) {
+        llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), "JIT IR Read error.\n");
+        return {};
+    }
+    return add_IR_module(std::move(*module), opt);
 }
 
-void JIT::add_IR_module(llvm::StringRef file_name) {
+JIT::module_handle JIT::add_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer, opt_level opt, debug_info debug) {
+    auto module = load_IR_module(std::move(buffer));
+    if (!module) {
+        llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), "JIT IR Read error.\n");
+        return {};
+    }
+    return add_IR_module(std::move(*module), opt, debug);
+}
+
+llvm::Error JIT::remove_module(module_handle handle) {
+    jit_trace::scope S(trace.get(), "remove_module");
+    if (opts.mode == compile_mode::lazy) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT modules added in lazy mode can not be removed");
+    }
+
+    llvm::orc::ResourceTrackerSP tracker;
+    {
+        std::lock_guard<std::mutex> guard(modules_lock);
+        auto it = modules.find(handle.id);
+        if (it == modules.end()) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT unknown module handle %llu", static_cast<unsigned long long>(handle.id));
+        }
+        tracker = std::move(it->second);
+        modules.erase(it);
+    }
+
+    // stop tier-ups first, the stubs of the module are freed with its record
+    // once the code jumping through them is gone.
+    std::unique_ptr<tiered_state::module_record> record;
+    if (tiered) {
+        record = tiered->remove(*tracker);
+    }
+    // the code of an evictable module has its own tracker, the evictor swaps
+    // it on every eviction
+    std::unique_ptr<eviction_state::module_record> resident;
+    if (eviction) {
+        resident = eviction->remove(*tracker);
+    }
+    if (resident) {
+        if (auto Err = resident->code->remove()) {
+            return llvm::joinErrors(std::move(Err), tracker->remove());
+        }
+    }
+    if (auto Err = tracker->remove()) {
+        return Err;
+    }
+    JIT_LOG(info, "JIT module " + llvm::Twine(handle.id) + " removed.");
+    return llvm::Error::success();
+}
+
+llvm::Expected<llvm::orc::ThreadSafeModule> JIT::load_IR_module(llvm::StringRef file_name) {
+    // memory mapped when the file is large enough
+    auto buffer = llvm::MemoryBuffer::getFile(file_name);
+    if (!buffer) {
+        return llvm::createFileError(file_name, buffer.getError());
+    }
+    return load_IR_module(std::move(*buffer));
+}
+
+llvm::Expected<llvm::orc::ThreadSafeModule> JIT::load_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer) {
+    jit_stats::timer T(metrics.get(), pipeline_stage::parse, buffer->getBufferIdentifier());
     auto Ctx = std::make_unique<llvm::LLVMContext>();
     std::unique_ptr<llvm::Module> M;
-    {
+    auto * start = reinterpret_cast<const unsigned char *>(buffer->getBufferStart());
+    auto * end = reinterpret_cast<const unsigned char *>(buffer->getBufferEnd());
+    if (llvm::isBitcode(start, end)) {
+        // only module level records are read here, the module owns the buffer
+        // and function bodies are read when they are compiled (see
+        // materialize_module and materialize_partition).
+        auto lazy = llvm::getOwningLazyBitcodeModule(std::move(buffer), *Ctx);
+        if (!lazy) {
+            return lazy.takeError();
+        }
+        M = std::move(*lazy);
+    } else {
         llvm::SMDiagnostic Err;
-        M = llvm::parseIRFile(file_name, Err, *Ctx);
+        M = llvm::parseIR(buffer->getMemBufferRef(), Err, *Ctx);
         if (!M) {
-            Err.print("JIT IR Read error.\n", llvm::errs());
-            return;
+            std::string message;
+            llvm::raw_string_ostream os(message);
+            Err.print(nullptr, os);
+            return llvm::make_error<llvm::StringError>(os.str(), llvm::inconvertibleErrorCode());
         }
     }
     
-    llvm::outs() << "JIT addIRModule setting module data layout to JIT data layout.\n";
+    JIT_LOG(debug, "JIT addIRModule setting module data layout to JIT data layout.");
     M->setDataLayout(jit->getDataLayout());
-    llvm::outs() << "JIT addIRModule setting module triple to JIT triple.\n";
+    JIT_LOG(debug, "JIT addIRModule setting module triple to JIT triple.");
     M->setTargetTriple(jit->getTargetTriple().getTriple());
     
-    add_IR_module(std::move(llvm::orc::ThreadSafeModule(std::move(M), std::move(Ctx))));
+    return llvm::orc::ThreadSafeModule(std::move(M), std::move(Ctx));
+}
+
+std::vector<JIT::module_result> JIT::add_IR_modules(std::vector<module_source> sources, const std::atomic<bool> * cancel) {
+    std::vector<module_result> results(sources.size());
+    auto cancelled = [cancel] {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    };
+
+    // tier 0 must stay unoptimized, the tier-up recompile optimizes instead
+    bool optimize = !tiered;
+    auto JTMB = host_target_machine_builder();
+
+    auto prepare = [&](module_source & source) -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        auto module = source.buffer ? load_IR_module(std::move(source.buffer)) : load_IR_module(source.file_name);
+        if (!module) {
+            return module.takeError();
+        }
+        auto Err = module->withModuleDo([&](llvm::Module & M) -> llvm::Error {
+            // the whole module is verified and optimized, lazy loading only
+            // defers the parse to this thread
+            {
+                jit_stats::timer T(metrics.get(), pipeline_stage::parse, M.getModuleIdentifier());
+                if (auto Err = M.materializeAll()) {
+                    return Err;
+                }
+            }
+            {
+                jit_stats::timer T(metrics.get(), pipeline_stage::verify, M.getModuleIdentifier());
+                std::string message;
+                llvm::raw_string_ostream os(message);
+                if (llvm::verifyModule(M, &os)) {
+                    return llvm::make_error<llvm::StringError>("invalid module: " + os.str(), llvm::inconvertibleErrorCode());
+                }
+            }
+            if (!optimize || cancelled()) {
+                return llvm::Error::success();
+            }
+            jit_stats::timer T(metrics.get(), pipeline_stage::optimize, M.getModuleIdentifier());
+            auto TM = llvm::orc::JITTargetMachineBuilder(JTMB).createTargetMachine();
+            if (!TM) {
+                return TM.takeError();
+            }
+            optimize_module(M, module_opt_level(M, opts.opt), TM->get());
+            return llvm::Error::success();
+        });
+        if (Err) {
+            return std::move(Err);
+        }
+        if (optimize) {
+            // already optimized, the transform stage must not run it again
+            set_module_opt_level(*module, opt_level::O0);
+        }
+        return module;
+    };
+
+    llvm::ThreadPool pool(llvm::hardware_concurrency(opts.compile_threads));
+    for (size_t i = 0; i < sources.size(); ++i) {
+        pool.async([&, i] {
+            auto & source = sources[i];
+            auto & result = results[i];
+            result.name = source.buffer ? source.buffer->getBufferIdentifier().str() : source.file_name;
+            jit_trace::scope S(trace.get(), "add_IR_modules", result.name);
+            if (cancelled()) {
+                result.error = "cancelled";
+                return;
+            }
+            auto module = prepare(source);
+            if (!module) {
+                result.error = llvm::toString(module.takeError());
+                return;
+            }
+            if (cancelled()) {
+                result.error = "cancelled";
+                return;
+            }
+            auto handle = try_add_IR_module(std::move(*module));
+            if (!handle) {
+                result.error = llvm::toString(handle.takeError());
+                return;
+            }
+            result.handle = *handle;
+            result.added = true;
+        });
+    }
+    pool.wait();
+
+    size_t added = llvm::count_if(results, [](const module_result & result) { return result.added; });
+    JIT_LOG(info, "JIT addIRModules: " + llvm::Twine(added) + " of " + llvm::Twine(results.size()) + " modules added.");
+    return results;
+}
+
+void JIT::reoptimize() {
+    if (tiered) {
+        tiered->reoptimize();
+    }
+}
+
+std::vector<JIT::function_profile> JIT::profile() {
+    if (!tiered) {
+        return {};
+    }
+    return tiered->profile();
+}
+
+llvm::Error JIT::save_profile(llvm::StringRef file_name) {
+    if (!tiered) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT profiles need tiered or pgo mode");
+    }
+    return write_profile(file_name, tiered->profile());
+}
+
+llvm::Error JIT::load_profile(llvm::StringRef file_name) {
+    if (!tiered) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT profiles need tiered or pgo mode");
+    }
+    auto profile = read_profile(file_name);
+    if (!profile) {
+        return profile.takeError();
+    }
+    JIT_LOG(info, "JIT loaded profile of " + llvm::Twine(profile->size()) + " functions from " + file_name + ".");
+    tiered->load_profile(std::move(*profile));
+    return llvm::Error::success();
+}
+
+llvm::Error JIT::save_speculation_trace(llvm::StringRef file_name) {
+    if (!speculation) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT speculation traces need lazy mode with speculate");
+    }
+    return write_speculation_trace(file_name, speculation->get_trace());
+}
+
+llvm::Error JIT::load_speculation_trace(llvm::StringRef file_name) {
+    if (!speculation) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT speculation traces need lazy mode with speculate");
+    }
+    auto trace = read_speculation_trace(file_name);
+    if (!trace) {
+        return trace.takeError();
+    }
+    JIT_LOG(info, "JIT loaded speculation trace of " + llvm::Twine(trace->size()) + " functions from " + file_name + ".");
+    speculation->load_trace(*trace);
+    return llvm::Error::success();
+}
+
+JIT::code_budget_stats JIT::budget_stats() {
+    code_budget_stats stats;
+    stats.resident_bytes = code_memory->bytes();
+    if (eviction) {
+        stats.evictions = eviction->evictions.load();
+        stats.recompiles = eviction->recompiles.load();
+    }
+    return stats;
+}
+
+JIT::pipeline_stats JIT::stats() {
+    return metrics->snapshot();
+}
+
+void JIT::dump_stats(llvm::raw_ostream & os) {
+    metrics->dump(os);
+}
+
+void JIT::flush_debug_registration() {
+    jit_gdb_flush();
+}
+
+llvm::Error JIT::start_profiling(unsigned frequency, size_t max_samples) {
+    std::lock_guard<std::mutex> guard(profiling_lock);
+    if (profiling) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT profiling already started");
+    }
+    auto profiler = profiling_state::start(frequency, max_samples);
+    if (!profiler) {
+        return profiler.takeError();
+    }
+    profiling = std::move(*profiler);
+    JIT_LOG(info, "JIT profiling at " + llvm::Twine(frequency) + " Hz.");
+    return llvm::Error::success();
+}
+
+llvm::Error JIT::stop_profiling(llvm::raw_ostream & report, llvm::StringRef pprof_file) {
+    std::unique_ptr<profiling_state> profiler;
+    {
+        std::lock_guard<std::mutex> guard(profiling_lock);
+        profiler = std::move(profiling);
+    }
+    if (!profiler) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT profiling not started");
+    }
+    profiler->stop();
+    profiler->write_report(report);
+    if (!pprof_file.empty()) {
+        return profiler->write_pprof(pprof_file);
+    }
+    return llvm::Error::success();
+}
+
+void JIT::profile_thread() {
+    profiling_state::add_thread();
 }
 
 llvm::Expected<llvm::orc::ExecutorAddr> JIT::lookup(llvm::StringRef symbol) {
+    jit_trace::scope S(trace.get(), "lookup", symbol);
+    // the thread likely calls what it looks up
+    profiling_state::add_thread();
+    // the lookup blocks until everything it links is emitted
+    jit_gdb_batch batch(opts.batch_debug_registration);
     return ExitOnErr(jit->lookup(symbol));
 }
 
 void JIT::run_static_initializer() {
+    jit_trace::scope S(trace.get(), "run_static_initializer");
+    jit_gdb_batch batch(opts.batch_debug_registration);
     ExitOnErr(jit->initialize(jit->getMainJITDylib()));
 }
 void JIT::run_static_deinitializer() {
+    jit_trace::scope S(trace.get(), "run_static_deinitializer");
     ExitOnErr(jit->deinitialize(jit->getMainJITDylib()));
 }
 
@@ -1,8 +1,20 @@
+#pragma once
+
 #include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include <llvm/ExecutionEngine/Orc/Mangling.h>
 #include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 // https://github.com/NVIDIA/warp/blob/main/warp/native/clang/clang.cpp
 
@@ -39,13 +51,280 @@
 #endif
 
 
+class jit_code_memory;
+class jit_object_cache;
+class jit_perf_map;
+class jit_stats;
+class jit_trace;
+
+// All members may be called concurrently from any number of threads, except
+// construction, destruction and run_static_(de)initializer.
 class JIT {
+    public:
+
+    // optimization level of the IR transform stage that runs before codegen
+    enum class opt_level { O0, O1, O2, O3, Os };
+
+    enum class compile_mode {
+        // every module is compiled at `opt` when first looked up
+        eager,
+        // functions are compiled at O0 with call counters first, hot functions
+        // are recompiled at `tier_up_opt` in the background
+        tiered,
+        // add_IR_module only registers definitions, functions are compiled
+        // on their first call through a lazy stub
+        lazy,
+        // tiered, tier 0 also counts branch edges and the recompile uses the
+        // profile for branch weights, inlining and block layout
+        pgo,
+    };
+
+    // debug information kept for a module
+    enum class debug_info {
+        // DWARF as emitted by the frontend
+        full,
+        // line tables only, enough for source locations in backtraces and
+        // profiles
+        line_tables,
+        // no DWARF, the object is still registered so debuggers show symbols
+        symbols,
+        // no DWARF and the object is neither copied for nor registered with
+        // the debugger
+        none,
+    };
+
+    // unit of compilation in lazy mode
+    enum class lazy_partition {
+        // only the called function
+        function,
+        // the called function and its call graph SCC
+        scc,
+    };
+
+    struct options {
+        bool jitlink = false;
+        // default optimization level, can be overridden per add_IR_module call
+        opt_level opt = opt_level::O0;
+        // default debug information, can be overridden per add_IR_module call
+        debug_info debug = debug_info::full;
+        compile_mode mode = compile_mode::eager;
+        // calls after which a tiered function is recompiled, 0 only
+        // recompiles on reoptimize()
+        uint64_t tier_up_threshold = 1000;
+        // level of the tier-up recompile, an add_IR_module override takes
+        // precedence
+        opt_level tier_up_opt = opt_level::O3;
+        lazy_partition partition = lazy_partition::function;
+        // threads compiling and linking modules in the background, 0 compiles
+        // on the thread that triggered the compile (serial)
+        unsigned compile_threads = 0;
+        // directory of the persistent object cache, empty disables it. Not
+        // used in tiered and pgo mode, their modules embed addresses that
+        // change from run to run. With a code_budget evicted modules are
+        // reloaded from it.
+        std::string object_cache_dir;
+        // the least recently used objects are evicted past this many bytes
+        uint64_t object_cache_size_limit = 512ull << 20;
+        // lazy mode: compile the likely callees of every compiled function on
+        // a background thread before they are first called
+        bool speculate = false;
+        // call graph levels speculated below a function compiled on demand
+        unsigned speculation_depth = 2;
+        // eager mode: bytes of JIT'd code and data kept mapped, past it the
+        // least recently called modules are evicted and recompiled on their
+        // next call. 0 disables eviction.
+        uint64_t code_budget = 0;
+        // merge the debug objects linked by one lookup or static
+        // initialization into one symbol file and register it with the
+        // debugger in a single rendezvous instead of one per object, see
+        // jit_gdb_batch
+        bool batch_debug_registration = false;
+        // register debug objects with the debugger from a background thread
+        // instead of the thread that linked them, the code is callable before
+        // the debugger knows about it, see flush_debug_registration
+        bool async_debug_registration = false;
+        // with async_debug_registration: merge every this many small debug
+        // objects into one registration, see jit_gdb_start_async. 0 disables
+        // it.
+        unsigned coalesce_debug_objects = 0;
+        // keep only a compressed copy of each object and register no debug
+        // objects until a debugger attaches, `debug_registration_signal` is
+        // raised or flush_debug_registration is called, which registers the
+        // copies, see jit_gdb_start_deferred.
+        bool defer_debug_registration = false;
+        int debug_registration_signal = 0;
+        // emit DWARF sections zlib compressed (SHF_COMPRESSED), shrinking the
+        // debug object copies kept for the debugger and the cached objects
+        bool compress_debug_sections = false;
+        // emit .debug_names accelerator tables so debuggers find functions
+        // by name without scanning all of the DWARF of every object.
+        // add_C_source compiles with -gpubnames for it, IR modules from clang
+        // need -gpubnames (or -glldb) for their compile units to be indexed
+        bool debug_accelerator_tables = false;
+        // Linux perf: append every JIT'd function to /tmp/perf-<pid>.map
+        bool perf_map = false;
+        // Linux perf: write jitdump records (code bytes and line tables) to
+        // /tmp/jit-<pid>.dump for perf inject --jit. RTDyld needs LLVM built
+        // with LLVM_USE_PERF.
+        bool perf_jitdump = false;
+        // keep the frame pointer in every JIT'd function, so stack walks
+        // (start_profiling, perf --call-graph fp) see through JIT'd frames
+        bool frame_pointers = false;
+        // record a timeline of the JIT on every thread, including LLVM's
+        // per-pass time trace scopes, and write it to this file in Chrome
+        // trace format when the JIT is destroyed, see jit_trace.h. Empty
+        // disables it.
+        std::string trace_file;
+        // LLVM scopes shorter than this are left out of the trace
+        unsigned trace_granularity_us = 10;
+    };
+
+    // severity of the JIT's log messages, see jit_log.h
+    enum class log_level { error, warning, info, debug };
+
+    // code and data of one added module, see remove_module
+    struct module_handle {
+        // 0 when adding the module failed
+        uint64_t id = 0;
+        explicit operator bool() const { return id != 0; }
+    };
+
+    // one input of add_IR_modules, the file is read when `buffer` is empty
+    struct module_source {
+        std::string file_name;
+        std::unique_ptr<llvm::MemoryBuffer> buffer;
+    };
+
+    // outcome of one add_IR_modules input, in input order
+    struct module_result {
+        std::string name;
+        bool added = false;
+        module_handle handle;
+        // parse, verifier, optimization or link error, "cancelled" when the
+        // batch was cancelled before the module was added
+        std::string error;
+    };
+
+    // execution profile of one tiered function, edges are only collected in
+    // pgo mode
+    struct function_profile {
+        std::string name;
+        uint64_t calls = 0;
+        // times each successor of each conditional branch and switch was
+        // taken, in block order
+        std::vector<uint64_t> edges;
+    };
+
+    // see budget_stats
+    struct code_budget_stats {
+        uint64_t resident_bytes = 0;
+        uint64_t evictions = 0;
+        uint64_t recompiles = 0;
+    };
+
+    // stages of the compile pipeline timed by stats()
+    enum class pipeline_stage {
+        // reading textual IR or bitcode, including lazily loaded bodies
+        parse,
+        verify,
+        optimize,
+        // instruction selection and object emission (or an object cache hit)
+        codegen,
+        // building, allocating and fixing up the link graph (JITLink), the
+        // whole RTDyld load and finalization
+        link,
+        // copying to the final protections and running allocation actions
+        // (JITLink)
+        finalize,
+        eh_frame,
+        // debug object copies, GDB JIT interface registration (JITLink)
+        debug_registration,
+    };
+    static constexpr size_t num_pipeline_stages = 8;
+
+    // time spent in one stage, CPU time is that of the thread doing the work
+    struct stage_time {
+        uint64_t count = 0;
+        uint64_t wall_ns = 0;
+        uint64_t cpu_ns = 0;
+    };
+
+    struct stage_stats {
+        stage_time total;
+        uint64_t max_wall_ns = 0;
+        // wall time histogram, bucket i counts the runs that took [2^i,
+        // 2^(i+1)) microseconds, bucket 0 also the shorter ones
+        std::array<uint64_t, 32> wall_us_log2 {};
+    };
+
+    // see stats
+    struct pipeline_stats {
+        std::array<stage_stats, num_pipeline_stages> stages;
+        // by module identifier
+        std::map<std::string, std::array<stage_time, num_pipeline_stages>> modules;
+        // functions compiled, relocations applied, stubs created (tiered and
+        // code budget), object bytes produced by codegen
+        uint64_t functions = 0;
+        uint64_t relocations = 0;
+        uint64_t stubs = 0;
+        uint64_t object_bytes = 0;
+        // modules whose object was loaded from the object cache and those
+        // compiled because it had none, 0 without a cache
+        uint64_t object_cache_hits = 0;
+        uint64_t object_cache_misses = 0;
+    };
+
+    static const char * pipeline_stage_name(pipeline_stage stage);
+
+    struct tiered_state;
+    struct speculation_state;
+    struct eviction_state;
+    struct profiling_state;
+
+    private:
+
+    options opts;
+    // must outlive jit, its compilers hold a pointer to it
+    std::unique_ptr<jit_object_cache> object_cache;
+    // must outlive jit, its object linking layer reports to it
+    std::unique_ptr<jit_code_memory> code_memory;
+    // must outlive jit, the object linking layer writes to it
+    std::unique_ptr<jit_perf_map> perf_map;
+    // must outlive jit and metrics, destroying it writes the trace once the
+    // compile threads are joined
+    std::unique_ptr<jit_trace> trace;
+    // must outlive jit, its compiler and object linking layer report to it
+    std::unique_ptr<jit_stats> metrics;
     std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::unique_ptr<tiered_state> tiered;
+    std::unique_ptr<speculation_state> speculation;
+
+    std::mutex profiling_lock;
+    std::unique_ptr<profiling_state> profiling;
+
+    // one resource tracker per added module
+    std::mutex modules_lock;
+    std::unordered_map<uint64_t, llvm::orc::ResourceTrackerSP> modules;
+    uint64_t next_module_handle = 1;
+
+    // destroyed first, after ~JIT stopped the evictor and ended the session
+    std::unique_ptr<eviction_state> eviction;
+
+    // parse textual IR or bitcode and fit it to the JIT data layout and
+    // triple, bitcode is loaded lazily
+    llvm::Expected<llvm::orc::ThreadSafeModule> load_IR_module(llvm::StringRef file_name);
+    llvm::Expected<llvm::orc::ThreadSafeModule> load_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+    // add_IR_module without exiting on error
+    llvm::Expected<module_handle> try_add_IR_module(llvm::orc::ThreadSafeModule && module);
 
     public:
 
     JIT();
     JIT(bool jitlink);
+    JIT(bool jitlink, opt_level opt);
+    JIT(const options & opts);
+    ~JIT();
 
     struct main_llvm_init final {
         std::unique_ptr<llvm::InitLLVM> X;
@@ -57,8 +336,103 @@ class JIT {
         }
     };
 
-    void add_IR_module(llvm::orc::ThreadSafeModule && module);
-    void add_IR_module(llvm::StringRef name);
+    // per-module overrides, carried as module flags from add_IR_module to the
+    // compile stage
+    static void set_module_opt_level(llvm::orc::ThreadSafeModule & module, opt_level opt);
+    static opt_level module_opt_level(const llvm::Module & module, opt_level fallback);
+    static void set_module_debug_info(llvm::orc::ThreadSafeModule & module, debug_info debug);
+    static debug_info module_debug_info(const llvm::Module & module, debug_info fallback);
+
+    module_handle add_IR_module(llvm::orc::ThreadSafeModule && module);
+    module_handle add_IR_module(llvm::StringRef name);
+    module_handle add_IR_module(llvm::orc::ThreadSafeModule && module, opt_level opt);
+    module_handle add_IR_module(llvm::StringRef name, opt_level opt);
+
+    // textual IR or bitcode from memory (eg. a MemoryBuffer::getFile mapping),
+    // bitcode function bodies are only read when they are compiled
+    module_handle add_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer);
+    module_handle add_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer, opt_level opt);
+
+    // debug information is stripped or downgraded before the module is
+    // optimized and compiled
+    module_handle add_IR_module(llvm::orc::ThreadSafeModule && module, opt_level opt, debug_info debug);
+    module_handle add_IR_module(llvm::StringRef name, opt_level opt, debug_info debug);
+    module_handle add_IR_module(std::unique_ptr<llvm::MemoryBuffer> buffer, opt_level opt, debug_info debug);
+
+    // free the code, data, stubs, EH frames and debugger entries of a module,
+    // its symbols are undefined afterwards. Nothing may run code of the module
+    // or hold its addresses while it is removed. Not supported in lazy mode,
+    // the CompileOnDemandLayer keeps compiled partitions for the lifetime of
+    // the JIT.
+    llvm::Error remove_module(module_handle handle);
+
+    // parse, verify and optimize many modules in parallel, each in its own
+    // LLVMContext, and add them as they become ready. Optimization happens
+    // here instead of in the compile stage (tiered mode keeps tier 0 at O0).
+    // Setting `*cancel` stops modules that have not been added yet.
+    std::vector<module_result> add_IR_modules(std::vector<module_source> sources, const std::atomic<bool> * cancel = nullptr);
+
+    // compile C source in-process with the clang frontend and add the
+    // resulting module, `file_name` names the source in diagnostics and debug
+    // info, `args` are extra clang driver arguments (eg. -O0 -g3).
+    module_handle add_C_source(llvm::StringRef source, llvm::StringRef file_name, llvm::ArrayRef<std::string> args = {});
+
+    // tiered and pgo mode: recompile every function that ran and has not been
+    // recompiled yet, without waiting for the threshold
+    void reoptimize();
+
+    // tiered and pgo mode: the profile collected so far, save_profile writes
+    // it to a file that load_profile reads back on the next start. Functions
+    // added after load_profile start from the loaded counts and are
+    // recompiled right away when they were hot.
+    std::vector<function_profile> profile();
+    llvm::Error save_profile(llvm::StringRef file_name);
+    llvm::Error load_profile(llvm::StringRef file_name);
+
+    // lazy mode with speculate: save the order in which functions were
+    // compiled on demand, a trace loaded on the next start also speculates the
+    // functions that followed each compiled function in it.
+    llvm::Error save_speculation_trace(llvm::StringRef file_name);
+    llvm::Error load_speculation_trace(llvm::StringRef file_name);
+
+    // register every debug object made so far before returning, including
+    // the ones queued by async_debug_registration, and end
+    // defer_debug_registration. Call it when a debugger or profiler attaches.
+    void flush_debug_registration();
+
+    // sample the CPU time of every thread `frequency` times a second (Linux
+    // x86-64 and AArch64), at most `max_samples` are kept. One profiler per
+    // process.
+    llvm::Error start_profiling(unsigned frequency = 1000, size_t max_samples = 1 << 15);
+
+    // stop sampling, write the flat profile, hot source lines and call graph
+    // of the JIT'd functions to `report` and, when `pprof_file` is set, every
+    // sample in pprof format. Needs the debug objects of the profiled code to
+    // be registered, see jit_profiler.h.
+    llvm::Error stop_profiling(llvm::raw_ostream & report, llvm::StringRef pprof_file = {});
+
+    // samples of the calling thread get call stacks, not only the leaf PC.
+    // Implied for the thread calling start_profiling or lookup.
+    void profile_thread();
+
+    // bytes of JIT'd code and data currently mapped, and with a code_budget
+    // the evictions and recompiles of evicted modules so far
+    code_budget_stats budget_stats();
+
+    // time spent in each compile pipeline stage so far, in aggregate and per
+    // module, and counts of what was compiled and linked. dump_stats writes
+    // it as text.
+    pipeline_stats stats();
+    void dump_stats(llvm::raw_ostream & os);
+
+    // messages above `level` are dropped where they are logged, warning by
+    // default. Levels above JIT_LOG_MAX_LEVEL are compiled out.
+    static void set_log_level(log_level level);
+    // receives the messages on the log thread, llvm::errs() by default (null
+    // restores it). It must not log itself.
+    static void set_log_sink(std::function<void(log_level, llvm::StringRef)> sink);
+    // write every message logged so far to the sink before returning
+    static void flush_log();
 
     llvm::Expected<llvm::orc::ExecutorAddr> lookup(llvm::StringRef symbol);
 
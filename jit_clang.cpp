@@ -0,0 +1,115 @@
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/CodeGen/CodeGenAction.h>
+#include <clang/Driver/Compilation.h>
+#include <clang/Driver/Driver.h>
+#include <clang/Driver/Job.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/TargetParser/Host.h>
+
+#include "jit.h"
+#include "jit_log.h"
+#include "jit_stats.h"
+#include "jit_trace.h"
+
+// The driver only derives the cc1 arguments (resource dir, system include
+// paths) from its own location, nothing is executed. CMake points it at the
+// clang of the LLVM installation the JIT is built against and passes that
+// clang's resource dir, the JIT executable would only find the builtin
+// headers if it were installed next to clang.
+static std::string clang_driver_path() {
+#ifdef JIT_CLANG_DRIVER_PATH
+    return JIT_CLANG_DRIVER_PATH;
+#else
+    return llvm::sys::fs::getMainExecutable(nullptr, reinterpret_cast<void *>(&clang_driver_path));
+#endif
+}
+
+JIT::module_handle JIT::add_C_source(llvm::StringRef source, llvm::StringRef file_name, llvm::ArrayRef<std::string> args) {
+    jit_trace::scope S(trace.get(), "add_C_source", file_name);
+    llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts = new clang::DiagnosticOptions();
+    auto * DiagClient = new clang::TextDiagnosticPrinter(llvm::errs(), &*DiagOpts);
+    llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> DiagID(new clang::DiagnosticIDs());
+    clang::DiagnosticsEngine Diags(DiagID, &*DiagOpts, DiagClient);
+
+    static const std::string driver_path = clang_driver_path();
+    clang::driver::Driver TheDriver(driver_path, llvm::sys::getProcessTriple(), Diags);
+    TheDriver.setTitle("JIT");
+    TheDriver.setCheckInputsExist(false);
+
+    llvm::SmallVector<const char *, 16> driver_args = { driver_path.c_str() };
+#ifdef JIT_CLANG_RESOURCE_DIR
+    // before `args`, the last -resource-dir wins
+    driver_args.push_back("-resource-dir");
+    driver_args.push_back(JIT_CLANG_RESOURCE_DIR);
+#endif
+    if (opts.debug_accelerator_tables) {
+        // clang only tunes for GDB here and leaves the compile unit out of
+        // the name index, the LLDB tuning of the JIT would emit an empty one
+        driver_args.push_back("-gpubnames");
+    }
+    for (auto & arg : args) {
+        driver_args.push_back(arg.c_str());
+    }
+    std::string input = file_name.str();
+    driver_args.push_back(input.c_str());
+    driver_args.push_back("-fsyntax-only");
+
+    std::unique_ptr<clang::driver::Compilation> C(TheDriver.BuildCompilation(driver_args));
+    if (!C || C->getJobs().empty() || !llvm::isa<clang::driver::Command>(*C->getJobs().begin())) {
+        JIT_LOG(error, "JIT C compile error: no frontend job for " + file_name + ".");
+        return {};
+    }
+    auto & Cmd = llvm::cast<clang::driver::Command>(*C->getJobs().begin());
+
+    auto CI = std::make_shared<clang::CompilerInvocation>();
+    if (!clang::CompilerInvocation::CreateFromArgs(*CI, Cmd.getArguments(), Diags)) {
+        JIT_LOG(error, "JIT C compile error: invalid arguments for " + file_name + ".");
+        return {};
+    }
+    // same as `-Xclang -triple`, the driver keeps targeting the host
+    CI->getTargetOpts().Triple = jit->getTargetTriple().str();
+    // compile straight from memory
+    CI->getPreprocessorOpts().addRemappedFile(input, llvm::MemoryBuffer::getMemBufferCopy(source, input).release());
+
+    clang::CompilerInstance Clang;
+    Clang.setInvocation(std::move(CI));
+    Clang.createDiagnostics();
+    if (!Clang.hasDiagnostics()) {
+        return {};
+    }
+
+    auto Ctx = std::make_unique<llvm::LLVMContext>();
+    clang::EmitLLVMOnlyAction Act(Ctx.get());
+    bool compiled;
+    {
+        // the frontend stands in for the IR parse
+        jit_stats::timer T(metrics.get(), pipeline_stage::parse, file_name);
+        compiled = Clang.ExecuteAction(Act);
+    }
+    if (!compiled) {
+        JIT_LOG(error, "JIT C compile error: " + file_name + " failed to compile.");
+        return {};
+    }
+    auto M = Act.takeModule();
+    if (!M) {
+        return {};
+    }
+
+    JIT_LOG(debug, "JIT addCSource setting module data layout to JIT data layout.");
+    M->setDataLayout(jit->getDataLayout());
+    JIT_LOG(debug, "JIT addCSource setting module triple to JIT triple.");
+    M->setTargetTriple(jit->getTargetTriple().getTriple());
+
+    return add_IR_module(llvm::orc::ThreadSafeModule(std::move(M), std::move(Ctx)));
+}
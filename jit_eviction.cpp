@@ -0,0 +1,437 @@
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/EHPersonalities.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit_eviction.h"
+#include "jit_log.h"
+#include "jit_memory.h"
+#include "jit_object_cache.h"
+#include "jit_optimize.h"
+#include "jit_stats.h"
+
+#include <algorithm>
+#include <chrono>
+
+static std::string body_name(unsigned module_id, llvm::StringRef name) {
+    return ("__jit_resident." + llvm::Twine(module_id) + "." + name).str();
+}
+
+static bool is_routable(const llvm::Function & F) {
+    return !F.isDeclaration()
+        && !F.isIntrinsic()
+        && !F.hasAvailableExternallyLinkage();
+}
+
+// a thunk forwards the arguments with an ordinary call
+static bool is_forwardable(const llvm::Function & F) {
+    return !F.isVarArg() && llvm::none_of(F.args(), [](const llvm::Argument & A) {
+        return A.hasInAllocaAttr() || A.hasPreallocatedAttr();
+    });
+}
+
+static bool has_writable_globals(const llvm::Module & M) {
+    return llvm::any_of(M.globals(), [](const llvm::GlobalVariable & GV) {
+        return !GV.isDeclaration() && !GV.isConstant();
+    });
+}
+
+static void erase_global_ctors_dtors(llvm::Module & M) {
+    for (auto * name : { "llvm.global_ctors", "llvm.global_dtors" }) {
+        if (auto * GV = M.getNamedGlobal(name)) {
+            GV->eraseFromParent();
+        }
+    }
+}
+
+// called by a thunk that found no body, aborts when compiling it failed
+static void * resolve_body(JIT::eviction_state * state, uint64_t module_id, uint64_t function) {
+    auto body = state->resolve(static_cast<unsigned>(module_id), function);
+    if (!body) {
+        llvm::logAllUnhandledErrors(body.takeError(), llvm::errs(), "JIT reloading an evicted module failed: ");
+        abort();
+    }
+    return body->toPtr<void *>();
+}
+
+// the weak definitions of several modules still resolve to one of them
+static llvm::GlobalValue::LinkageTypes thunk_linkage(llvm::GlobalValue::LinkageTypes linkage) {
+    switch (linkage) {
+        case llvm::GlobalValue::LinkOnceODRLinkage:
+        case llvm::GlobalValue::WeakODRLinkage:
+            return llvm::GlobalValue::WeakODRLinkage;
+        case llvm::GlobalValue::LinkOnceAnyLinkage:
+        case llvm::GlobalValue::WeakAnyLinkage:
+        case llvm::GlobalValue::CommonLinkage:
+            return llvm::GlobalValue::WeakAnyLinkage;
+        default:
+            return llvm::GlobalValue::ExternalLinkage;
+    }
+}
+
+// a module of declarations in its own context that defines the public name of
+// every function of `mod` as
+//
+//   entries += 1; body = targets[i]; if (!body) body = resolve_body(...);
+//   result = body(args...); exits += 1; return result;
+//
+// the exit is counted on unwinding too when the body has a personality. The
+// records live in the host process so their addresses are baked into the IR
+// as constants. Entries and the address are sequentially consistent, see
+// evict.
+static llvm::orc::ThreadSafeModule make_thunks(const llvm::orc::ThreadSafeModule & module, JIT::eviction_state & state, JIT::eviction_state::module_record & mod) {
+    auto thunks = llvm::orc::cloneToNewContext(module, [](const llvm::GlobalValue &) { return false; });
+    thunks.withModuleDo([&](llvm::Module & M) {
+        auto & Ctx = M.getContext();
+        auto * PtrTy = llvm::PointerType::getUnqual(Ctx);
+        auto * I64Ty = llvm::Type::getInt64Ty(Ctx);
+        auto address = [&](llvm::IRBuilder<> & B, const void * p) {
+            return B.CreateIntToPtr(B.getInt64(reinterpret_cast<uintptr_t>(p)), PtrTy);
+        };
+        auto bump = [&](llvm::IRBuilder<> & B, std::atomic<uint64_t> & counter, llvm::AtomicOrdering ordering) {
+            B.CreateAtomicRMW(llvm::AtomicRMWInst::Add, address(B, &counter), B.getInt64(1), llvm::MaybeAlign(8), ordering);
+        };
+        auto * resolve_ty = llvm::FunctionType::get(PtrTy, { PtrTy, I64Ty, I64Ty }, false);
+
+        for (size_t i = 0; i < mod.functions.size(); ++i) {
+            auto & fn = mod.functions[i];
+            auto * thunk = M.getFunction(fn.name);
+            thunk->setLinkage(thunk_linkage(fn.linkage));
+            auto forwarded = thunk->getAttributes().removeFnAttributes(Ctx);
+            thunk->setAttributes(forwarded);
+            thunk->setUWTableKind(llvm::UWTableKind::Default);
+            if (!fn.personality.empty()) {
+                auto personality = M.getOrInsertFunction(fn.personality, llvm::FunctionType::get(llvm::Type::getInt32Ty(Ctx), true));
+                thunk->setPersonalityFn(llvm::cast<llvm::Constant>(personality.getCallee()));
+            }
+
+            auto * entry = llvm::BasicBlock::Create(Ctx, "entry", thunk);
+            auto * resolve = llvm::BasicBlock::Create(Ctx, "resolve", thunk);
+            auto * call = llvm::BasicBlock::Create(Ctx, "call", thunk);
+
+            llvm::IRBuilder<> B(entry);
+            bump(B, mod.entries, llvm::AtomicOrdering::SequentiallyConsistent);
+            auto * target = B.CreateAlignedLoad(PtrTy, address(B, &mod.targets[i]), llvm::MaybeAlign(8));
+            target->setAtomic(llvm::AtomicOrdering::SequentiallyConsistent);
+            auto * weights = llvm::MDBuilder(Ctx).createBranchWeights(1, 1 << 20);
+            B.CreateCondBr(B.CreateIsNull(target), resolve, call, weights);
+
+            B.SetInsertPoint(resolve);
+            auto * resolved = B.CreateCall(resolve_ty, address(B, reinterpret_cast<const void *>(&resolve_body)), { address(B, &state), B.getInt64(mod.id), B.getInt64(i) });
+            B.CreateBr(call);
+
+            B.SetInsertPoint(call);
+            auto * body = B.CreatePHI(PtrTy, 2);
+            body->addIncoming(target, entry);
+            body->addIncoming(resolved, resolve);
+            llvm::SmallVector<llvm::Value *, 8> args;
+            for (auto & A : thunk->args()) {
+                args.push_back(&A);
+            }
+            llvm::CallBase * result;
+            if (thunk->hasPersonalityFn()) {
+                auto * done = llvm::BasicBlock::Create(Ctx, "done", thunk);
+                auto * cleanup = llvm::BasicBlock::Create(Ctx, "cleanup", thunk);
+                result = B.CreateInvoke(thunk->getFunctionType(), body, done, cleanup, args);
+
+                llvm::IRBuilder<> C(cleanup);
+                auto * pad = C.CreateLandingPad(llvm::StructType::get(PtrTy, C.getInt32Ty()), 0);
+                pad->setCleanup(true);
+                bump(C, mod.exits, llvm::AtomicOrdering::Release);
+                C.CreateResume(pad);
+
+                B.SetInsertPoint(done);
+            } else {
+                result = B.CreateCall(thunk->getFunctionType(), body, args);
+            }
+            result->setCallingConv(thunk->getCallingConv());
+            result->setAttributes(forwarded);
+            bump(B, mod.exits, llvm::AtomicOrdering::Release);
+            if (result->getType()->isVoidTy()) {
+                B.CreateRetVoid();
+            } else {
+                B.CreateRet(result);
+            }
+        }
+
+        // the other declarations, the bodies and ctor lists among them, have
+        // no use here
+        for (auto & GV : llvm::make_early_inc_range(M.global_values())) {
+            if (GV.isDeclaration() && GV.use_empty()) {
+                GV.eraseFromParent();
+            }
+        }
+    });
+    return thunks;
+}
+
+JIT::eviction_state::eviction_state(JIT & owner, jit_code_memory & memory, uint64_t budget) :
+    owner(owner),
+    memory(memory),
+    budget(budget)
+{
+    memory.set_budget(budget, [this] {
+        wake = true;
+        evictor_cv.notify_one();
+    });
+    evictor = std::thread([this] { run_evictor(); });
+}
+
+JIT::eviction_state::~eviction_state() {
+    stop();
+    // the JIT ended its session first, no link reports to the memory anymore
+    memory.set_budget(0, nullptr);
+}
+
+void JIT::eviction_state::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    evictor_cv.notify_all();
+    if (evictor.joinable()) {
+        evictor.join();
+    }
+}
+
+llvm::Error JIT::eviction_state::add(llvm::orc::ThreadSafeModule && module, llvm::orc::ResourceTrackerSP tracker) {
+    auto record = std::make_unique<module_record>();
+    auto & mod = *record;
+    mod.tracker = tracker;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        mod.id = next_module_id++;
+
+        auto Err = module.withModuleDo([&](llvm::Module & M) -> llvm::Error {
+            if (auto Err = M.materializeAll()) {
+                return Err;
+            }
+
+            // the bodies are referenced by name from the reloaded copy
+            promote(M);
+            mod.evictable = !has_writable_globals(M);
+
+            std::vector<llvm::Function *> bodies;
+            for (auto & F : M) {
+                if (!is_routable(F)) {
+                    continue;
+                }
+                if (!is_forwardable(F)) {
+                    // keeps its name and the module its code
+                    mod.evictable = false;
+                    continue;
+                }
+                bodies.push_back(&F);
+            }
+
+            for (auto * F : bodies) {
+                auto & fn = mod.functions.emplace_back();
+                fn.name = F->getName().str();
+                fn.body = body_name(mod.id, fn.name);
+                fn.linkage = F->getLinkage();
+                if (F->hasPersonalityFn() && !llvm::isFuncletEHPersonality(llvm::classifyEHPersonality(F->getPersonalityFn()))) {
+                    fn.personality = F->getPersonalityFn()->stripPointerCasts()->getName().str();
+                }
+
+                // the address of the function is the thunk everywhere, direct
+                // calls inside the module keep the body.
+                auto * stub = llvm::Function::Create(F->getFunctionType(), llvm::GlobalValue::ExternalLinkage, "", M);
+                stub->setCallingConv(F->getCallingConv());
+                stub->setAttributes(F->getAttributes());
+                F->replaceUsesWithIf(stub, [](llvm::Use & U) {
+                    auto * call = llvm::dyn_cast<llvm::CallBase>(U.getUser());
+                    return !call || !call->isCallee(&U);
+                });
+                stub->takeName(F);
+                stub->setDSOLocal(false);
+
+                F->setName(fn.body);
+                F->setLinkage(llvm::GlobalValue::ExternalLinkage);
+                F->setVisibility(llvm::GlobalValue::HiddenVisibility);
+                F->setComdat(nullptr);
+            }
+            return llvm::Error::success();
+        });
+        if (Err) {
+            return Err;
+        }
+    }
+    mod.targets = std::make_unique<std::atomic<void *>[]>(mod.functions.size());
+
+    // optimize once here, reloads only run codegen
+    auto Err = module.withModuleDo([&](llvm::Module & M) -> llvm::Error {
+        auto opt = JIT::module_opt_level(M, owner.opts.opt);
+        if (opt != opt_level::O0) {
+            jit_stats::timer T(owner.metrics.get(), JIT::pipeline_stage::optimize, M.getModuleIdentifier());
+            auto TM = host_target_machine_builder().createTargetMachine();
+            if (!TM) {
+                return TM.takeError();
+            }
+            optimize_module(M, opt, TM->get());
+        }
+        return llvm::Error::success();
+    });
+    if (Err) {
+        return Err;
+    }
+    JIT::set_module_opt_level(module, opt_level::O0);
+
+    mod.pristine = llvm::orc::cloneToNewContext(module);
+    mod.pristine.withModuleDo(erase_global_ctors_dtors);
+
+    auto thunks = make_thunks(module, *this, mod);
+    JIT::set_module_debug_info(thunks, debug_info::none);
+    // the thunks embed the addresses of the counters and targets, the bodies
+    // embed none and are cached
+    thunks.withModuleDo(jit_object_cache::bypass);
+    if (auto Err = owner.jit->addIRModule(tracker, std::move(thunks))) {
+        return Err;
+    }
+    owner.metrics->stubs.fetch_add(mod.functions.size(), std::memory_order_relaxed);
+    mod.code = owner.jit->getMainJITDylib().createResourceTracker();
+    if (auto Err = owner.jit->addIRModule(mod.code, std::move(module))) {
+        return Err;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    modules.push_back(std::move(record));
+    return llvm::Error::success();
+}
+
+std::unique_ptr<JIT::eviction_state::module_record> JIT::eviction_state::remove(const llvm::orc::ResourceTracker & tracker) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = llvm::find_if(modules, [&](auto & mod) { return mod->tracker.get() == &tracker; });
+    if (it == modules.end()) {
+        return nullptr;
+    }
+    auto record = std::move(*it);
+    modules.erase(it);
+    return record;
+}
+
+JIT::eviction_state::module_record * JIT::eviction_state::find(unsigned module_id) {
+    auto it = llvm::find_if(modules, [&](auto & mod) { return mod->id == module_id; });
+    return it == modules.end() ? nullptr : it->get();
+}
+
+llvm::Expected<llvm::orc::ExecutorAddr> JIT::eviction_state::resolve(unsigned module_id, size_t function) {
+    std::string body;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto * mod = find(module_id);
+        if (!mod) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT module %u called after its removal", module_id);
+        }
+        // resolved by another caller meanwhile
+        if (auto * target = mod->targets[function].load()) {
+            return llvm::orc::ExecutorAddr::fromPtr(target);
+        }
+        body = mod->functions[function].body;
+    }
+
+    // compiles the module when it was evicted, the caller is counted in
+    // flight so the evictor leaves the code alone until it returns
+    auto address = owner.jit->lookup(body);
+    if (!address) {
+        return address.takeError();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto * mod = find(module_id);
+    if (!mod) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT module %u removed while it was called", module_id);
+    }
+    mod->targets[function].store(address->toPtr<void *>());
+    if (!mod->resident) {
+        mod->resident = true;
+        mod->last_used = clock;
+        if (mod->loads++ > 0) {
+            ++recompiles;
+            JIT_LOG(info, "JIT module " + llvm::Twine(mod->id) + " reloaded after eviction.");
+        }
+    }
+    return *address;
+}
+
+bool JIT::eviction_state::evict(module_record & mod) {
+    auto entries = mod.entries.load();
+    if (entries != mod.seen_entries || entries != mod.exits.load()) {
+        return false;
+    }
+    // callers that enter from here on resolve the bodies again, which waits
+    // for the lock
+    for (size_t i = 0; i < mod.functions.size(); ++i) {
+        mod.targets[i].store(nullptr);
+    }
+    // A caller that read an address before it was cleared counted its entry
+    // before the read, which is before the store above and so before this
+    // load (all sequentially consistent). Its thunk reads the addresses
+    // again on the next call.
+    if (mod.entries.load() != entries) {
+        return false;
+    }
+
+    if (auto Err = mod.code->remove()) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT eviction failed: ");
+        return false;
+    }
+    mod.code = owner.jit->getMainJITDylib().createResourceTracker();
+    if (auto Err = owner.jit->addIRModule(mod.code, llvm::orc::cloneToNewContext(mod.pristine))) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT eviction failed: ");
+        return false;
+    }
+    mod.resident = false;
+    ++evictions;
+    JIT_LOG(info, "JIT module " + llvm::Twine(mod.id) + " evicted, " + llvm::Twine(memory.bytes()) + " bytes resident.");
+    return true;
+}
+
+void JIT::eviction_state::collect() {
+    ++clock;
+    for (auto & mod : modules) {
+        auto entries = mod->entries.load();
+        if (entries != mod->seen_entries) {
+            mod->seen_entries = entries;
+            mod->last_used = clock;
+        }
+    }
+
+    // modules called during the last interval are never evicted
+    while (memory.bytes() > budget) {
+        module_record * victim = nullptr;
+        for (auto & mod : modules) {
+            bool idle = mod->entries.load() == mod->exits.load();
+            if (mod->resident && mod->evictable && idle && mod->last_used < clock
+                && (!victim || mod->last_used < victim->last_used)) {
+                victim = mod.get();
+            }
+        }
+        if (!victim || !evict(*victim)) {
+            break;
+        }
+    }
+}
+
+void JIT::eviction_state::run_evictor() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        // the periodic pass keeps the recency of every module current
+        evictor_cv.wait_for(guard, std::chrono::seconds(1), [this] { return stopping || wake; });
+        if (stopping) {
+            return;
+        }
+        wake = false;
+        collect();
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/IR/GlobalValue.h>
+#include <llvm/Support/Error.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class jit_code_memory;
+
+// Code memory budget for eager mode.
+//
+// The public name of every function of a module is a thunk that calls the
+// body, which is renamed, calls inside the module stay direct so they can
+// still be inlined. The thunks live as long as the module. A thunk counts the
+// call in the module before it reads the address of the body and again once
+// the body returned, so every thread that is on its way into a body or
+// anywhere in it is counted. A thunk that finds no address compiles the
+// module (or waits for the compile in flight) and stores the address for
+// later calls.
+//
+// Once the mapped code and data exceed the budget, a background thread evicts
+// the least recently called modules that have no call in flight. It clears
+// the addresses of the bodies, then checks that no call entered the module
+// since it found it idle: a caller that read an address before it was cleared
+// counted its entry first and keeps the module resident. Otherwise the code
+// is removed and the IR added again, uncompiled, callers that come later
+// compile it again (or load it from the object cache). No body is freed while a caller may still reach it.
+//
+// Modules are optimized when added and kept as IR for reloading. Modules that
+// define writable globals would lose their state and are never evicted, nor
+// are modules with functions the thunks cannot forward (variadic, inalloca or
+// preallocated arguments), those keep their names. Only function addresses
+// stay valid across an eviction. Leaving a body by longjmp, or by unwinding
+// out of a function without a personality, leaves its module busy, which
+// only keeps it resident.
+struct JIT::eviction_state {
+    struct function_record {
+        std::string name;
+        std::string body;
+        // of the public name, weak definitions stay weak
+        llvm::GlobalValue::LinkageTypes linkage;
+        // the body's, the thunk counts the exits of unwinding calls with it.
+        // Empty without one or for funclet based personalities.
+        std::string personality;
+    };
+
+    struct module_record {
+        unsigned id = 0;
+        // the thunks, the handle of the module
+        llvm::orc::ResourceTrackerSP tracker;
+        // the code while resident, the uncompiled IR once evicted
+        llvm::orc::ResourceTrackerSP code;
+        // optimized copy without ctors and dtors
+        llvm::orc::ThreadSafeModule pristine;
+        std::vector<function_record> functions;
+        // the address of each body, read by its thunk, null until it is
+        // resolved and after an eviction
+        std::unique_ptr<std::atomic<void *>[]> targets;
+        bool evictable = true;
+
+        // bumped by the thunks
+        std::atomic<uint64_t> entries { 0 };
+        std::atomic<uint64_t> exits { 0 };
+
+        // guarded by the state lock
+        bool resident = false;
+        unsigned loads = 0;
+        uint64_t seen_entries = 0;
+        uint64_t last_used = 0;
+    };
+
+    JIT & owner;
+    jit_code_memory & memory;
+    uint64_t budget;
+
+    // guards modules, promote, next_module_id, clock and the records
+    std::mutex lock;
+    std::vector<std::unique_ptr<module_record>> modules;
+    llvm::orc::SymbolLinkagePromoter promote;
+    unsigned next_module_id = 0;
+    // eviction passes so far, a record's last_used is the pass that last saw
+    // it called
+    uint64_t clock = 0;
+
+    std::condition_variable evictor_cv;
+    std::atomic<bool> wake { false };
+    bool stopping = false;
+    std::thread evictor;
+
+    std::atomic<uint64_t> evictions { 0 };
+    std::atomic<uint64_t> recompiles { 0 };
+
+    eviction_state(JIT & owner, jit_code_memory & memory, uint64_t budget);
+    ~eviction_state();
+
+    // join the evictor, nothing is evicted or reloaded by it afterwards
+    void stop();
+
+    llvm::Error add(llvm::orc::ThreadSafeModule && module, llvm::orc::ResourceTrackerSP tracker);
+
+    // forget the module of `tracker`, the caller removes its code and thunks
+    // before the record is destroyed
+    std::unique_ptr<module_record> remove(const llvm::orc::ResourceTracker & tracker);
+
+    // the address of `function` of module `module_id`, compiled when the
+    // module was evicted. Called by a thunk that found none, the call is
+    // counted so the module stays resident meanwhile.
+    llvm::Expected<llvm::orc::ExecutorAddr> resolve(unsigned module_id, size_t function);
+
+    private:
+
+    // lock held
+    module_record * find(unsigned module_id);
+    // remove the code of an idle module, false when it was called meanwhile
+    bool evict(module_record & mod);
+    void collect();
+
+    void run_evictor();
+};
@@ -0,0 +1,1101 @@
+//===- JITLoaderGDB.h - Register objects via GDB JIT interface -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderGDB.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/Object/ELF.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/BinaryStreamReader.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "jit_gdb.h"
+#include "jit_gdb_merge.h"
+#include "jit_log.h"
+
+// First version as landed in August 2009
+static constexpr uint32_t JitDescriptorVersion = 1;
+
+extern "C" {
+
+// We put information about the JITed function in this global, which the
+// debugger reads.  Make sure to specify the version statically, because the
+// debugger checks the version before we can set it during runtime.
+struct JIT_DLL_EXPORT jit_descriptor __jit_debug_descriptor = {JitDescriptorVersion, 0,
+                                                nullptr, nullptr};
+
+// Debuggers that implement the GDB JIT interface put a special breakpoint in
+// this function.
+LLVM_ATTRIBUTE_NOINLINE JIT_DLL_EXPORT void __jit_debug_register_code() {
+  // The noinline and the asm prevent calls to this function from being
+  // optimized out.
+#if !defined(_MSC_VER)
+  asm volatile("" ::: "memory");
+#endif
+}
+}
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Serialize rendezvous with the debugger as well as access to shared data.
+static std::mutex JITDebugLock;
+
+// Entries registered on this thread, claimed by jit_gdb_plugin.
+static thread_local std::vector<jit_code_entry *> RegisteredOnThread;
+
+// Entries are carved from slabs that live as long as the process and recycled
+// through a free list linked by next_entry, guarded by JITDebugLock.
+static constexpr size_t EntriesPerSlab = 256;
+static std::vector<std::unique_ptr<jit_code_entry[]>> EntrySlabs;
+static jit_code_entry *FreeEntries = nullptr;
+
+// Open jit_gdb_batch scopes and the entries registered while one was open,
+// oldest first, guarded by JITDebugLock.
+static unsigned BatchDepth = 0;
+static std::vector<jit_code_entry *> BatchEntries;
+
+static jit_code_entry *allocateEntry() {
+  if (!FreeEntries) {
+    EntrySlabs.push_back(std::make_unique<jit_code_entry[]>(EntriesPerSlab));
+    jit_code_entry *Slab = EntrySlabs.back().get();
+    for (size_t I = 0; I < EntriesPerSlab; ++I) {
+      Slab[I].next_entry = FreeEntries;
+      FreeEntries = &Slab[I];
+    }
+  }
+  jit_code_entry *E = FreeEntries;
+  FreeEntries = E->next_entry;
+  return E;
+}
+
+static void releaseEntry(jit_code_entry *E) {
+  E->prev_entry = nullptr;
+  E->next_entry = FreeEntries;
+  FreeEntries = E;
+}
+
+// Asynchronous registration: linking threads push their entries onto
+// PendingEntries, a lock-free stack linked by next_entry, and the registration
+// thread swaps it out and links it into the descriptor under JITDebugLock.
+static std::atomic<bool> AsyncRegistration{false};
+static std::atomic<jit_code_entry *> PendingEntries{nullptr};
+
+// Guards the registration thread and its users.
+static std::mutex RegistrationThreadLock;
+static unsigned AsyncUsers = 0;
+static std::thread RegistrationThread;
+
+// Wakes the registration thread, StopRegistration is guarded by PendingLock.
+static std::mutex PendingLock;
+static std::condition_variable PendingCV;
+static bool StopRegistration = false;
+
+// Entries taken from the pool in bulk, so the link path only takes
+// JITDebugLock once every EntriesPerRefill objects in asynchronous mode.
+static constexpr size_t EntriesPerRefill = 32;
+static thread_local jit_code_entry *LocalEntries = nullptr;
+
+static jit_code_entry *takeLocalEntry() {
+  if (!LocalEntries) {
+    std::lock_guard<std::mutex> Lock(JITDebugLock);
+    for (size_t I = 0; I < EntriesPerRefill; ++I) {
+      jit_code_entry *E = allocateEntry();
+      E->next_entry = LocalEntries;
+      LocalEntries = E;
+    }
+  }
+  jit_code_entry *E = LocalEntries;
+  LocalEntries = E->next_entry;
+  return E;
+}
+
+// Deferred registration: until a debugger attaches, jit_gdb_debug_filter
+// keeps objects from the debug plugin, and entries of objects that got past
+// it before are parked in their own list (newest first, linked like the
+// descriptor's) instead of the descriptor. Written under JITDebugLock, the
+// filter reads Parking without it.
+static std::atomic<bool> Parking{false};
+static jit_code_entry *ParkedNewest = nullptr;
+static DenseSet<jit_code_entry *> Parked;
+
+// What the filter keeps of an object linked while parking, owned by the
+// filter under the object's resource key. Buffer and Entry are set once it is
+// registered.
+struct jit_gdb_deferred_object {
+  // zlib compressed when available
+  SmallVector<uint8_t, 0> Object;
+  size_t Size = 0;
+  StringMap<uint64_t> SectionAddresses;
+  std::vector<char> Buffer;
+  jit_code_entry *Entry = nullptr;
+};
+
+// the deferred objects not registered yet, in the order they were linked,
+// guarded by JITDebugLock
+static DenseMap<jit_gdb_deferred_object *, uint64_t> DeferredObjects;
+static uint64_t DeferredCount = 0;
+
+// Polls for a debugger and for the attach signal, guarded by
+// RegistrationThreadLock.
+static unsigned DeferredUsers = 0;
+static std::thread AttachWatcher;
+static std::mutex AttachLock;
+static std::condition_variable AttachCV;
+static bool StopAttachWatcher = false;
+static volatile std::sig_atomic_t AttachSignalled = 0;
+
+// The attach signal and the action it had before, restored by the last stop.
+static int AttachSignal = 0;
+#ifdef _WIN32
+static void (*PreviousAttachHandler)(int) = SIG_DFL;
+#else
+static struct sigaction PreviousAttachAction;
+#endif
+
+// Coalescing: once CoalesceThreshold small objects sit in the descriptor on
+// their own, the registration thread merges copies of them into one symbol
+// file without JITDebugLock, registers that and unregisters them. Removing a
+// member dissolves its merged object, the other members are registered on
+// their own again and are not merged a second time. Guarded by JITDebugLock.
+static constexpr size_t CoalesceMaxObjectSize = 64 * 1024;
+static unsigned CoalesceThreshold = 0;
+
+struct MergedObject {
+  std::vector<char> Buffer;
+  std::vector<jit_code_entry *> Members;
+};
+
+// small entries registered on their own, and the merged objects by their
+// entry and by the entries of their members
+static DenseSet<jit_code_entry *> Loose;
+static DenseMap<jit_code_entry *, std::unique_ptr<MergedObject>> Merged;
+static DenseMap<jit_code_entry *, jit_code_entry *> MergedInto;
+
+// A merge running without JITDebugLock, an entry unregistered meanwhile
+// leaves Members and makes it stale.
+struct PendingMerge {
+  DenseSet<jit_code_entry *> Members;
+  bool Stale = false;
+};
+static std::vector<PendingMerge *> PendingMerges;
+
+static void linkEntryInto(jit_code_entry *&Head, jit_code_entry *E) {
+  E->prev_entry = nullptr;
+  E->next_entry = Head;
+  if (Head)
+    Head->prev_entry = E;
+  Head = E;
+}
+
+static void unlinkEntryFrom(jit_code_entry *&Head, jit_code_entry *E) {
+  if (E->prev_entry)
+    E->prev_entry->next_entry = E->next_entry;
+  else
+    Head = E->next_entry;
+  if (E->next_entry)
+    E->next_entry->prev_entry = E->prev_entry;
+  E->prev_entry = nullptr;
+  E->next_entry = nullptr;
+}
+
+// Insert E at the head of the descriptor list, JITDebugLock held. Returns false
+// when the rendezvous is deferred to the end of the open batch or until a
+// debugger attaches. Small objects are queued for coalescing when `Coalesce`.
+static bool linkEntry(jit_code_entry *E, bool Coalesce = true) {
+  if (Parking) {
+    linkEntryInto(ParkedNewest, E);
+    Parked.insert(E);
+    return false;
+  }
+
+  linkEntryInto(__jit_debug_descriptor.first_entry, E);
+  if (Coalesce && CoalesceThreshold &&
+      E->symfile_size <= CoalesceMaxObjectSize)
+    Loose.insert(E);
+
+  if (BatchDepth > 0) {
+    BatchEntries.push_back(E);
+    return false;
+  }
+  __jit_debug_descriptor.relevant_entry = E;
+  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+  return true;
+}
+
+// Link every pending entry in the order it was registered, JITDebugLock held.
+static void drainPendingEntries() {
+  jit_code_entry *E = PendingEntries.exchange(nullptr, std::memory_order_acquire);
+  jit_code_entry *Oldest = nullptr;
+  while (E) {
+    jit_code_entry *Next = E->next_entry;
+    E->next_entry = Oldest;
+    Oldest = E;
+    E = Next;
+  }
+  while (Oldest) {
+    jit_code_entry *Next = Oldest->next_entry;
+    if (linkEntry(Oldest))
+      __jit_debug_register_code();
+    Oldest = Next;
+  }
+}
+
+static void pushPendingEntry(jit_code_entry *E) {
+  jit_code_entry *Head = PendingEntries.load(std::memory_order_relaxed);
+  do {
+    E->next_entry = Head;
+  } while (!PendingEntries.compare_exchange_weak(
+      Head, E, std::memory_order_release, std::memory_order_relaxed));
+  // Only the push onto an empty stack wakes the thread. Taking PendingLock
+  // orders the push after the thread's check of the stack or before its wait,
+  // so the wakeup cannot fall in between and get lost.
+  if (!Head) {
+    { std::lock_guard<std::mutex> Wait(PendingLock); }
+    PendingCV.notify_one();
+  }
+}
+
+// Announce E to the debugger as registered or unregistered, JITDebugLock held.
+static void rendezvous(jit_code_entry *E, uint32_t Action) {
+  __jit_debug_descriptor.relevant_entry = E;
+  __jit_debug_descriptor.action_flag = Action;
+  __jit_debug_register_code();
+}
+
+// Merge copies of the objects of Members (oldest first) into one, the objects
+// themselves may be freed once their entries are unregistered, which does not
+// wait for the merge. JITDebugLock is held through `Lock` on entry and on
+// return and released while merging. Null when a member was unregistered
+// meanwhile, Pending then holds the others.
+static Expected<std::unique_ptr<MergedObject>>
+mergeUnlocked(std::unique_lock<std::mutex> &Lock,
+              std::vector<jit_code_entry *> Members, PendingMerge &Pending) {
+  std::vector<std::string> Copies;
+  for (jit_code_entry *E : Members)
+    Copies.push_back(StringRef(E->symfile_addr, E->symfile_size).str());
+  Pending.Members.insert(Members.begin(), Members.end());
+  PendingMerges.push_back(&Pending);
+
+  Lock.unlock();
+  std::vector<StringRef> Objects(Copies.begin(), Copies.end());
+  auto Buffer = jit_merge_debug_objects(Objects);
+  Copies.clear();
+  Lock.lock();
+
+  PendingMerges.erase(llvm::find(PendingMerges, &Pending));
+  if (!Buffer)
+    return Buffer.takeError();
+  if (Pending.Stale)
+    return nullptr;
+  auto Object = std::make_unique<MergedObject>();
+  Object->Buffer = std::move(*Buffer);
+  Object->Members = std::move(Members);
+  return std::move(Object);
+}
+
+// Register the merged object in place of its members, which leave the list
+// and are unregistered when `Announced`, JITDebugLock held.
+static void installMerged(std::unique_ptr<MergedObject> Object,
+                          bool Announced) {
+  // the merged object first, so the debugger never misses a member's code
+  jit_code_entry *E = allocateEntry();
+  E->symfile_addr = Object->Buffer.data();
+  E->symfile_size = Object->Buffer.size();
+  linkEntryInto(__jit_debug_descriptor.first_entry, E);
+  rendezvous(E, JIT_REGISTER_FN);
+  for (jit_code_entry *Member : Object->Members) {
+    Loose.erase(Member);
+    unlinkEntryFrom(__jit_debug_descriptor.first_entry, Member);
+    if (Announced)
+      rendezvous(Member, JIT_UNREGISTER_FN);
+    MergedInto[Member] = E;
+  }
+  __jit_debug_descriptor.relevant_entry = nullptr;
+  __jit_debug_descriptor.action_flag = JIT_NOACTION;
+  Merged[E] = std::move(Object);
+}
+
+// Merge the loose entries into one object once there are enough of them.
+// Called with JITDebugLock held through `Lock`, which is released while the
+// copies are merged. Not while a batch is open or entries are parked, neither
+// has told the debugger about its entries yet.
+static void coalesceEntries(std::unique_lock<std::mutex> &Lock) {
+  if (!CoalesceThreshold || Loose.size() < CoalesceThreshold ||
+      BatchDepth > 0 || Parking)
+    return;
+
+  // oldest first, as they were registered
+  std::vector<jit_code_entry *> Members;
+  for (jit_code_entry *E = __jit_debug_descriptor.first_entry; E;
+       E = E->next_entry) {
+    if (!Loose.count(E))
+      continue;
+    if (jit_can_merge_debug_object(StringRef(E->symfile_addr, E->symfile_size)))
+      Members.push_back(E);
+    else
+      // what cannot be merged now never can
+      Loose.erase(E);
+  }
+  if (Members.size() < 2)
+    return;
+  std::reverse(Members.begin(), Members.end());
+
+  PendingMerge Pending;
+  auto Object = mergeUnlocked(Lock, Members, Pending);
+  if (!Object) {
+    JIT_LOG(warning, toString(Object.takeError()));
+    for (jit_code_entry *Member : Pending.Members)
+      Loose.erase(Member);
+    return;
+  }
+  // A member was removed meanwhile, or a batch or parking began. The others
+  // stay loose and are merged next time.
+  if (!*Object || BatchDepth > 0 || Parking)
+    return;
+
+  JIT_LOG(debug, "Merging " + Twine(Members.size()) +
+                     " debug objects registered with the GDB JIT interface");
+  installMerged(std::move(*Object), /*Announced=*/true);
+}
+
+// Unregister the merged object E and register its members that are not in
+// Removing on their own again, JITDebugLock held. The members that are go
+// into Detached, they are not linked anywhere.
+static void dissolveMerged(jit_code_entry *E,
+                           const DenseSet<jit_code_entry *> &Removing,
+                           DenseSet<jit_code_entry *> &Detached) {
+  auto It = Merged.find(E);
+  std::unique_ptr<MergedObject> Object = std::move(It->second);
+  Merged.erase(It);
+
+  unlinkEntryFrom(__jit_debug_descriptor.first_entry, E);
+  rendezvous(E, JIT_UNREGISTER_FN);
+  releaseEntry(E);
+
+  for (jit_code_entry *Member : Object->Members) {
+    MergedInto.erase(Member);
+    if (Removing.count(Member))
+      Detached.insert(Member);
+    else if (linkEntry(Member, /*Coalesce=*/false))
+      __jit_debug_register_code();
+  }
+}
+
+static void runRegistrationThread() {
+  std::unique_lock<std::mutex> Wait(PendingLock);
+  while (!StopRegistration) {
+    PendingCV.wait(Wait, [] {
+      return StopRegistration ||
+             PendingEntries.load(std::memory_order_relaxed) != nullptr;
+    });
+    // producers waking the thread need PendingLock
+    Wait.unlock();
+    {
+      std::unique_lock<std::mutex> Lock(JITDebugLock);
+      drainPendingEntries();
+      coalesceEntries(Lock);
+    }
+    Wait.lock();
+  }
+}
+
+// Section marking objects that are not registered, see
+// jit_gdb_skip_registration.
+static constexpr const char *SkipSectionName = ".jit.skip_registration";
+
+// Register debug object, returns false when the rendezvous is deferred to the
+// end of the open batch or to the registration thread.
+static bool appendJITDebugDescriptor(const char *ObjAddr, size_t Size) {
+  JIT_LOG(debug, "Adding debug object to GDB JIT interface ([0x" +
+                     Twine::utohexstr(reinterpret_cast<uintptr_t>(ObjAddr)) +
+                     " -- 0x" +
+                     Twine::utohexstr(reinterpret_cast<uintptr_t>(ObjAddr + Size)) +
+                     "])");
+
+  if (AsyncRegistration.load(std::memory_order_acquire)) {
+    jit_code_entry *E = takeLocalEntry();
+    E->symfile_addr = ObjAddr;
+    E->symfile_size = Size;
+    RegisteredOnThread.push_back(E);
+    pushPendingEntry(E);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> Lock(JITDebugLock);
+
+  jit_code_entry *E = allocateEntry();
+  E->symfile_addr = ObjAddr;
+  E->symfile_size = Size;
+
+  RegisteredOnThread.push_back(E);
+  return linkEntry(E);
+}
+
+extern "C" JIT_DLL_EXPORT orc::shared::CWrapperFunctionResult
+llvm_orc_registerJITLoaderGDBAllocAction(const char *Data, size_t Size) {
+  using namespace orc::shared;
+  return WrapperFunction<SPSError(SPSExecutorAddrRange, bool)>::handle(
+             Data, Size,
+             [](ExecutorAddrRange R, bool AutoRegisterCode) {
+               bool Now = appendJITDebugDescriptor(
+                   R.Start.toPtr<const char *>(), R.size());
+               // Run into the rendezvous breakpoint.
+               if (AutoRegisterCode && Now)
+                 __jit_debug_register_code();
+               return Error::success();
+             })
+      .release();
+}
+
+extern "C" JIT_DLL_EXPORT orc::shared::CWrapperFunctionResult
+llvm_orc_registerJITLoaderGDBWrapper(const char *Data, uint64_t Size) {
+  using namespace orc::shared;
+  return WrapperFunction<SPSError(SPSExecutorAddrRange, bool)>::handle(
+             Data, Size,
+             [](ExecutorAddrRange R, bool AutoRegisterCode) {
+               bool Now = appendJITDebugDescriptor(
+                   R.Start.toPtr<const char *>(), R.size());
+               // Run into the rendezvous breakpoint.
+               if (AutoRegisterCode && Now)
+                 __jit_debug_register_code();
+               return Error::success();
+             })
+      .release();
+}
+
+std::vector<jit_code_entry *> jit_gdb_take_registered() {
+  return std::exchange(RegisteredOnThread, {});
+}
+
+void jit_gdb_start_async(unsigned CoalesceEvery) {
+  std::lock_guard<std::mutex> Lock(RegistrationThreadLock);
+  if (AsyncUsers++ > 0)
+    return;
+  {
+    std::lock_guard<std::mutex> DebugLock(JITDebugLock);
+    CoalesceThreshold = CoalesceEvery;
+  }
+  {
+    std::lock_guard<std::mutex> Wait(PendingLock);
+    StopRegistration = false;
+  }
+  RegistrationThread = std::thread(runRegistrationThread);
+  AsyncRegistration.store(true, std::memory_order_release);
+}
+
+void jit_gdb_stop_async() {
+  std::lock_guard<std::mutex> Lock(RegistrationThreadLock);
+  if (--AsyncUsers > 0)
+    return;
+  AsyncRegistration.store(false, std::memory_order_release);
+  {
+    std::lock_guard<std::mutex> Wait(PendingLock);
+    StopRegistration = true;
+  }
+  PendingCV.notify_one();
+  RegistrationThread.join();
+  jit_gdb_flush();
+  // merged objects stay until their members are unregistered
+  std::lock_guard<std::mutex> DebugLock(JITDebugLock);
+  CoalesceThreshold = 0;
+  Loose.clear();
+}
+
+// The section load addresses go into the section headers, as the debug
+// plugin would have put them.
+template <typename ELFT>
+static Error setSectionAddresses(std::vector<char> &Buffer,
+                                 const StringMap<uint64_t> &Addresses) {
+  auto Obj = object::ELFFile<ELFT>::create(StringRef(Buffer.data(), Buffer.size()));
+  if (!Obj)
+    return Obj.takeError();
+  auto Headers = Obj->sections();
+  if (!Headers)
+    return Headers.takeError();
+  for (const typename ELFT::Shdr &Header : *Headers) {
+    // DWARF and the other unloaded sections stay at 0
+    if (!(Header.sh_flags & ELF::SHF_ALLOC))
+      continue;
+    auto Name = Obj->getSectionName(Header);
+    if (!Name)
+      return Name.takeError();
+    auto It = Addresses.find(*Name);
+    if (It != Addresses.end())
+      const_cast<typename ELFT::Shdr &>(Header).sh_addr = It->second;
+  }
+  return Error::success();
+}
+
+static Expected<std::vector<char>>
+expandDeferred(const jit_gdb_deferred_object &Deferred) {
+  std::vector<char> Buffer;
+  if (Deferred.Object.size() == Deferred.Size) {
+    Buffer.assign(Deferred.Object.begin(), Deferred.Object.end());
+  } else {
+    SmallVector<uint8_t, 0> Inflated;
+    if (auto Err = compression::zlib::decompress(Deferred.Object, Inflated,
+                                                 Deferred.Size))
+      return std::move(Err);
+    Buffer.assign(Inflated.begin(), Inflated.end());
+  }
+  auto [Class, Data] = object::getElfArchType(StringRef(Buffer.data(), Buffer.size()));
+  Error Err = Error::success();
+  if (Class == ELF::ELFCLASS64)
+    Err = Data == ELF::ELFDATA2LSB
+              ? setSectionAddresses<object::ELF64LE>(Buffer, Deferred.SectionAddresses)
+              : setSectionAddresses<object::ELF64BE>(Buffer, Deferred.SectionAddresses);
+  else
+    Err = Data == ELF::ELFDATA2LSB
+              ? setSectionAddresses<object::ELF32LE>(Buffer, Deferred.SectionAddresses)
+              : setSectionAddresses<object::ELF32BE>(Buffer, Deferred.SectionAddresses);
+  if (Err)
+    return std::move(Err);
+  return std::move(Buffer);
+}
+
+// JITDebugLock held, Parking over.
+static void registerDeferred(jit_gdb_deferred_object &Deferred) {
+  auto Buffer = expandDeferred(Deferred);
+  if (!Buffer) {
+    JIT_LOG(warning, "Cannot register a deferred debug object: " +
+                         toString(Buffer.takeError()));
+    return;
+  }
+  Deferred.Buffer = std::move(*Buffer);
+  jit_code_entry *E = allocateEntry();
+  E->symfile_addr = Deferred.Buffer.data();
+  E->symfile_size = Deferred.Buffer.size();
+  Deferred.Entry = E;
+  if (linkEntry(E))
+    __jit_debug_register_code();
+}
+
+// A deferred object was linked, registered right away when parking ended
+// meanwhile.
+static void deferObject(jit_gdb_deferred_object &Deferred) {
+  std::lock_guard<std::mutex> Lock(JITDebugLock);
+  if (Parking)
+    DeferredObjects[&Deferred] = DeferredCount++;
+  else
+    registerDeferred(Deferred);
+}
+
+// Forget deferred objects before they are freed, unregistering those that
+// were registered.
+static void
+dropDeferred(ArrayRef<std::unique_ptr<jit_gdb_deferred_object>> Objects) {
+  std::vector<jit_code_entry *> Entries;
+  {
+    std::lock_guard<std::mutex> Lock(JITDebugLock);
+    for (const auto &Deferred : Objects) {
+      DeferredObjects.erase(Deferred.get());
+      if (Deferred->Entry)
+        Entries.push_back(Deferred->Entry);
+    }
+  }
+  jit_gdb_unregister(Entries);
+}
+
+// Register every parked entry and then every deferred object oldest first,
+// one rendezvous each since a debugger that just attached may only read
+// relevant_entry. JITDebugLock held.
+static void releaseParkedEntries() {
+  Parking = false;
+  if (ParkedNewest) {
+    JIT_LOG(debug, "Registering " + Twine(Parked.size()) +
+                       " parked debug objects with the GDB JIT interface");
+
+    jit_code_entry *Oldest = ParkedNewest;
+    while (Oldest->next_entry)
+      Oldest = Oldest->next_entry;
+    while (Oldest) {
+      jit_code_entry *Prev = Oldest->prev_entry;
+      if (linkEntry(Oldest))
+        __jit_debug_register_code();
+      Oldest = Prev;
+    }
+    ParkedNewest = nullptr;
+    Parked.clear();
+  }
+
+  if (DeferredObjects.empty())
+    return;
+
+  JIT_LOG(debug, "Registering " + Twine(DeferredObjects.size()) +
+                     " deferred debug objects with the GDB JIT interface");
+
+  std::vector<std::pair<uint64_t, jit_gdb_deferred_object *>> Objects;
+  for (auto &[Deferred, Order] : DeferredObjects)
+    Objects.push_back({Order, Deferred});
+  DeferredObjects.clear();
+  llvm::sort(Objects);
+  for (auto &Object : Objects)
+    registerDeferred(*Object.second);
+}
+
+static bool debuggerAttached() {
+#ifdef _WIN32
+  return IsDebuggerPresent();
+#elif defined(__linux__)
+  auto Status = MemoryBuffer::getFileAsStream("/proc/self/status");
+  if (!Status)
+    return false;
+  StringRef Rest = (*Status)->getBuffer();
+  while (!Rest.empty()) {
+    StringRef Line;
+    std::tie(Line, Rest) = Rest.split('\n');
+    if (Line.consume_front("TracerPid:"))
+      return Line.trim() != "0";
+  }
+  return false;
+#else
+  return false;
+#endif
+}
+
+static void onAttachSignal(int) { AttachSignalled = 1; }
+
+static void runAttachWatcher() {
+  std::unique_lock<std::mutex> Wait(AttachLock);
+  while (!StopAttachWatcher) {
+    AttachCV.wait_for(Wait, std::chrono::seconds(1));
+    if (StopAttachWatcher)
+      return;
+    if (AttachSignalled || debuggerAttached()) {
+      jit_gdb_flush();
+      return;
+    }
+  }
+}
+
+void jit_gdb_start_deferred(int Signal) {
+  std::lock_guard<std::mutex> Lock(RegistrationThreadLock);
+  if (DeferredUsers++ > 0)
+    return;
+  {
+    std::lock_guard<std::mutex> DebugLock(JITDebugLock);
+    Parking = true;
+  }
+  AttachSignal = Signal;
+  if (Signal) {
+#ifdef _WIN32
+    PreviousAttachHandler = std::signal(Signal, onAttachSignal);
+#else
+    struct sigaction Action = {};
+    Action.sa_handler = onAttachSignal;
+    Action.sa_flags = SA_RESTART;
+    sigemptyset(&Action.sa_mask);
+    if (sigaction(Signal, &Action, &PreviousAttachAction) != 0) {
+      JIT_LOG(warning, "Cannot install the debugger attach signal handler: " +
+                           Twine(std::strerror(errno)));
+      AttachSignal = 0;
+    }
+#endif
+  }
+  {
+    std::lock_guard<std::mutex> Wait(AttachLock);
+    StopAttachWatcher = false;
+  }
+  AttachWatcher = std::thread(runAttachWatcher);
+}
+
+void jit_gdb_stop_deferred() {
+  std::lock_guard<std::mutex> Lock(RegistrationThreadLock);
+  if (--DeferredUsers > 0)
+    return;
+  {
+    std::lock_guard<std::mutex> Wait(AttachLock);
+    StopAttachWatcher = true;
+  }
+  AttachCV.notify_one();
+  AttachWatcher.join();
+  if (AttachSignal) {
+#ifdef _WIN32
+    std::signal(AttachSignal, PreviousAttachHandler);
+#else
+    sigaction(AttachSignal, &PreviousAttachAction, nullptr);
+#endif
+    AttachSignal = 0;
+  }
+  // what is still parked stays parked until flushed or unregistered
+  std::lock_guard<std::mutex> DebugLock(JITDebugLock);
+  Parking = false;
+}
+
+void jit_gdb_flush() {
+  std::lock_guard<std::mutex> Lock(JITDebugLock);
+  drainPendingEntries();
+  releaseParkedEntries();
+}
+
+std::vector<std::unique_ptr<MemoryBuffer>> jit_gdb_copy_objects() {
+  std::lock_guard<std::mutex> Lock(JITDebugLock);
+  drainPendingEntries();
+  std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+  for (jit_code_entry *List : {__jit_debug_descriptor.first_entry, ParkedNewest})
+    for (jit_code_entry *E = List; E; E = E->next_entry)
+      Objects.push_back(MemoryBuffer::getMemBufferCopy(
+          StringRef(E->symfile_addr, E->symfile_size)));
+  for (auto &Deferred : DeferredObjects) {
+    auto Buffer = expandDeferred(*Deferred.first);
+    if (!Buffer) {
+      consumeError(Buffer.takeError());
+      continue;
+    }
+    Objects.push_back(MemoryBuffer::getMemBufferCopy(
+        StringRef(Buffer->data(), Buffer->size())));
+  }
+  return Objects;
+}
+
+void jit_gdb_begin_batch() {
+  std::lock_guard<std::mutex> Lock(JITDebugLock);
+  ++BatchDepth;
+}
+
+void jit_gdb_end_batch() {
+  std::unique_lock<std::mutex> Lock(JITDebugLock);
+  if (--BatchDepth > 0)
+    return;
+  // the objects linked during the batch may still be queued
+  ++BatchDepth;
+  drainPendingEntries();
+  --BatchDepth;
+  if (BatchEntries.empty())
+    return;
+  std::vector<jit_code_entry *> Batch = std::exchange(BatchEntries, {});
+
+  JIT_LOG(debug, "Registering " + Twine(Batch.size()) +
+                     " debug objects with the GDB JIT interface");
+
+  // A debugger only reads relevant_entry on a rendezvous, so the batch is
+  // merged into one object and registered with one. Objects that cannot be
+  // merged get a rendezvous each.
+  std::vector<jit_code_entry *> Members;
+  for (jit_code_entry *E : Batch) {
+    if (Batch.size() > 1 &&
+        jit_can_merge_debug_object(StringRef(E->symfile_addr, E->symfile_size)))
+      Members.push_back(E);
+    else
+      rendezvous(E, JIT_REGISTER_FN);
+  }
+  if (Members.size() == 1)
+    rendezvous(Members.front(), JIT_REGISTER_FN);
+  if (Members.size() > 1) {
+    // not coalesced meanwhile, they are not announced yet
+    for (jit_code_entry *Member : Members)
+      Loose.erase(Member);
+    PendingMerge Pending;
+    auto Object = mergeUnlocked(Lock, Members, Pending);
+    if (Object && *Object) {
+      installMerged(std::move(*Object), /*Announced=*/false);
+      return;
+    }
+    if (!Object)
+      JIT_LOG(warning, toString(Object.takeError()));
+    // a member was removed meanwhile or the merge failed, the others are
+    // registered on their own
+    for (jit_code_entry *Member : Members) {
+      if (!Pending.Members.count(Member))
+        continue;
+      if (CoalesceThreshold && Member->symfile_size <= CoalesceMaxObjectSize)
+        Loose.insert(Member);
+      rendezvous(Member, JIT_REGISTER_FN);
+    }
+  }
+  __jit_debug_descriptor.relevant_entry = nullptr;
+  __jit_debug_descriptor.action_flag = JIT_NOACTION;
+}
+
+void jit_gdb_unregister(ArrayRef<jit_code_entry *> Entries) {
+  if (Entries.empty())
+    return;
+
+  std::lock_guard<std::mutex> Lock(JITDebugLock);
+  // A queued entry is not in the list yet.
+  drainPendingEntries();
+
+  // An entry registered in a batch that is still open has not been announced
+  // yet, removing it would leave it dangling in BatchEntries. Announce the
+  // batch first, one object at a time, this only happens when a link fails or
+  // a module is removed while another thread is in a batch.
+  for (jit_code_entry *E : BatchEntries)
+    rendezvous(E, JIT_REGISTER_FN);
+  BatchEntries.clear();
+
+  DenseSet<jit_code_entry *> Removing(Entries.begin(), Entries.end());
+  DenseSet<jit_code_entry *> Detached;
+  for (jit_code_entry *E : Entries) {
+    // never announced, nothing to tell the debugger
+    if (Parked.erase(E)) {
+      unlinkEntryFrom(ParkedNewest, E);
+      releaseEntry(E);
+      continue;
+    }
+    // the debugger only knows the merged object, which goes with the first
+    // member removed
+    auto Into = MergedInto.find(E);
+    if (Into != MergedInto.end())
+      dissolveMerged(Into->second, Removing, Detached);
+    if (Detached.erase(E)) {
+      releaseEntry(E);
+      continue;
+    }
+    Loose.erase(E);
+    for (PendingMerge *Pending : PendingMerges)
+      if (Pending->Members.erase(E))
+        Pending->Stale = true;
+
+    JIT_LOG(debug,
+            "Removing debug object from GDB JIT interface ([0x" +
+                Twine::utohexstr(reinterpret_cast<uintptr_t>(E->symfile_addr)) +
+                " -- 0x" +
+                Twine::utohexstr(reinterpret_cast<uintptr_t>(E->symfile_addr + E->symfile_size)) +
+                "])");
+
+    // Unlink this entry from the list, detached so a debugger that follows
+    // next_entry from relevant_entry does not unregister the live neighbour
+    // as well.
+    unlinkEntryFrom(__jit_debug_descriptor.first_entry, E);
+
+    __jit_debug_descriptor.relevant_entry = E;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+    releaseEntry(E);
+  }
+  __jit_debug_descriptor.relevant_entry = nullptr;
+  __jit_debug_descriptor.action_flag = JIT_NOACTION;
+}
+
+void jit_gdb_skip_registration(Module &M) {
+  // non-allocated, JITLink does not load it, and not empty so the assembler
+  // keeps it
+  M.appendModuleInlineAsm((".section " + Twine(SkipSectionName) +
+                           ",\"\",%progbits\n.byte 0\n.previous")
+                              .str());
+}
+
+static bool skipsRegistration(const object::ObjectFile &Obj) {
+  for (const object::SectionRef &Section : Obj.sections()) {
+    Expected<StringRef> Name = Section.getName();
+    if (!Name) {
+      consumeError(Name.takeError());
+      continue;
+    }
+    if (*Name == SkipSectionName)
+      return true;
+  }
+  return false;
+}
+
+jit_gdb_debug_filter::jit_gdb_debug_filter(
+    std::unique_ptr<ObjectLinkingLayer::Plugin> inner)
+    : inner(std::move(inner)) {}
+
+jit_gdb_debug_filter::~jit_gdb_debug_filter() {
+  for (auto &Objects : deferred)
+    dropDeferred(Objects.second);
+}
+
+void jit_gdb_debug_filter::notifyMaterializing(
+    MaterializationResponsibility &MR, jitlink::LinkGraph &G,
+    jitlink::JITLinkContext &Ctx, MemoryBufferRef InputObject) {
+  auto Obj = object::ObjectFile::createObjectFile(InputObject);
+  if (!Obj)
+    consumeError(Obj.takeError());
+  else if (skipsRegistration(**Obj))
+    return;
+  if (!Parking.load(std::memory_order_relaxed)) {
+    // the other callbacks of the debug plugin pass over objects it has not
+    // seen
+    inner->notifyMaterializing(MR, G, Ctx, InputObject);
+    return;
+  }
+
+  // nobody to show it to yet, keep it small until somebody is
+  auto Deferred = std::make_unique<jit_gdb_deferred_object>();
+  ArrayRef<uint8_t> Bytes = arrayRefFromStringRef(InputObject.getBuffer());
+  Deferred->Size = Bytes.size();
+  if (compression::zlib::isAvailable())
+    compression::zlib::compress(Bytes, Deferred->Object);
+  if (Deferred->Object.empty() || Deferred->Object.size() >= Deferred->Size)
+    Deferred->Object.assign(Bytes.begin(), Bytes.end());
+  std::lock_guard<std::mutex> Lock(lock);
+  linking[&MR] = std::move(Deferred);
+}
+
+void jit_gdb_debug_filter::modifyPassConfig(MaterializationResponsibility &MR,
+                                            jitlink::LinkGraph &G,
+                                            jitlink::PassConfiguration &Config) {
+  jit_gdb_deferred_object *Deferred = nullptr;
+  {
+    std::lock_guard<std::mutex> Lock(lock);
+    auto It = linking.find(&MR);
+    if (It != linking.end())
+      Deferred = It->second.get();
+  }
+  if (!Deferred) {
+    inner->modifyPassConfig(MR, G, Config);
+    return;
+  }
+  Config.PostAllocationPasses.push_back([Deferred](jitlink::LinkGraph &G) {
+    for (jitlink::Section &Section : G.sections()) {
+      jitlink::SectionRange Range(Section);
+      if (!Range.empty())
+        Deferred->SectionAddresses[Section.getName()] =
+            Range.getStart().getValue();
+    }
+    return Error::success();
+  });
+}
+
+Error jit_gdb_debug_filter::notifyEmitted(MaterializationResponsibility &MR) {
+  std::unique_ptr<jit_gdb_deferred_object> Deferred;
+  {
+    std::lock_guard<std::mutex> Lock(lock);
+    auto It = linking.find(&MR);
+    if (It != linking.end()) {
+      Deferred = std::move(It->second);
+      linking.erase(It);
+    }
+  }
+  if (Deferred) {
+    jit_gdb_deferred_object &Object = *Deferred;
+    if (auto Err = MR.withResourceKeyDo([&](ResourceKey K) {
+          std::lock_guard<std::mutex> Lock(lock);
+          deferred[K].push_back(std::move(Deferred));
+        }))
+      return Err;
+    deferObject(Object);
+    return Error::success();
+  }
+  // registers the debug object on this thread
+  Error Err = inner->notifyEmitted(MR);
+  return joinErrors(std::move(Err), registered.notifyEmitted(MR));
+}
+
+Error jit_gdb_debug_filter::notifyFailed(MaterializationResponsibility &MR) {
+  {
+    std::lock_guard<std::mutex> Lock(lock);
+    linking.erase(&MR);
+  }
+  Error Err = registered.notifyFailed(MR);
+  return joinErrors(std::move(Err), inner->notifyFailed(MR));
+}
+
+// the entries go before the objects they point to
+Error jit_gdb_debug_filter::notifyRemovingResources(JITDylib &JD, ResourceKey K) {
+  std::vector<std::unique_ptr<jit_gdb_deferred_object>> Removed;
+  {
+    std::lock_guard<std::mutex> Lock(lock);
+    auto It = deferred.find(K);
+    if (It != deferred.end()) {
+      Removed = std::move(It->second);
+      deferred.erase(It);
+    }
+  }
+  dropDeferred(Removed);
+  Error Err = registered.notifyRemovingResources(JD, K);
+  return joinErrors(std::move(Err), inner->notifyRemovingResources(JD, K));
+}
+
+void jit_gdb_debug_filter::notifyTransferringResources(JITDylib &JD, ResourceKey DstKey, ResourceKey SrcKey) {
+  {
+    std::lock_guard<std::mutex> Lock(lock);
+    auto It = deferred.find(SrcKey);
+    if (It != deferred.end()) {
+      auto Moved = std::move(It->second);
+      deferred.erase(It);
+      auto &Dst = deferred[DstKey];
+      for (auto &Deferred : Moved)
+        Dst.push_back(std::move(Deferred));
+    }
+  }
+  registered.notifyTransferringResources(JD, DstKey, SrcKey);
+  inner->notifyTransferringResources(JD, DstKey, SrcKey);
+}
+
+void jit_gdb_listener_filter::notifyObjectLoaded(
+    ObjectKey K, const object::ObjectFile &Obj,
+    const RuntimeDyld::LoadedObjectInfo &L) {
+  if (!skipsRegistration(Obj))
+    inner.notifyObjectLoaded(K, Obj, L);
+}
+
+// the GDB listener passes over keys it has not registered
+void jit_gdb_listener_filter::notifyFreeingObject(ObjectKey K) {
+  inner.notifyFreeingObject(K);
+}
+
+Error jit_gdb_plugin::notifyEmitted(MaterializationResponsibility &MR) {
+  auto Registered = jit_gdb_take_registered();
+  if (Registered.empty())
+    return Error::success();
+  return MR.withResourceKeyDo([&](ResourceKey K) {
+    std::lock_guard<std::mutex> Lock(lock);
+    auto &Entries = entries[K];
+    Entries.insert(Entries.end(), Registered.begin(), Registered.end());
+  });
+}
+
+Error jit_gdb_plugin::notifyFailed(MaterializationResponsibility &MR) {
+  // the debug object memory goes away with the failed link
+  jit_gdb_unregister(jit_gdb_take_registered());
+  return Error::success();
+}
+
+Error jit_gdb_plugin::notifyRemovingResources(JITDylib &JD, ResourceKey K) {
+  std::vector<jit_code_entry *> Removed;
+  {
+    std::lock_guard<std::mutex> Lock(lock);
+    auto It = entries.find(K);
+    if (It == entries.end())
+      return Error::success();
+    Removed = std::move(It->second);
+    entries.erase(It);
+  }
+  jit_gdb_unregister(Removed);
+  return Error::success();
+}
+
+void jit_gdb_plugin::notifyTransferringResources(JITDylib &JD, ResourceKey DstKey, ResourceKey SrcKey) {
+  std::lock_guard<std::mutex> Lock(lock);
+  auto It = entries.find(SrcKey);
+  if (It == entries.end())
+    return;
+  auto Moved = std::move(It->second);
+  entries.erase(It);
+  auto &Dst = entries[DstKey];
+  Dst.insert(Dst.end(), Moved.begin(), Moved.end());
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderGDB.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// GDB JIT interface, __jit_debug_descriptor and the registration wrappers
+// JITLink's debug plugins call are defined in jit_gdb.cpp.
+
+// entries registered on the calling thread since the last call
+std::vector<jit_code_entry *> jit_gdb_take_registered();
+
+// unlink and free entries, the debugger is notified of each one
+void jit_gdb_unregister(llvm::ArrayRef<jit_code_entry *> entries);
+
+// Asynchronous registration: the registration wrappers push the entry onto a
+// lock-free queue and return, a background thread links queued entries into
+// __jit_debug_descriptor and runs the rendezvous, so the link path never waits
+// for the debugger. Reference counted, one thread serves every JIT.
+//
+// With `coalesce_every` non-zero (taken from the first start), once that many
+// objects of up to 64 KiB are registered on their own the thread merges them
+// into one symbol file (see jit_merge_debug_objects), registers it and
+// unregisters them, so the debugger holds a few large symbol files instead of
+// one per module. The merge runs on copies, unregistering does not wait for
+// it. Unregistering a member registers the others on their own again, for
+// good.
+void jit_gdb_start_async(unsigned coalesce_every = 0);
+void jit_gdb_stop_async();
+
+// Deferred registration: jit_gdb_debug_filter keeps objects from the debug
+// plugin, so none is copied and relocated for the debugger, and keeps a zlib
+// compressed copy of each with the load addresses of its sections instead,
+// until a debugger is found attached (polled every second through TracerPid
+// on Linux, IsDebuggerPresent on Windows), `signal` (when non-zero) is raised
+// or jit_gdb_flush is called. At that point the copies are expanded, their
+// section headers given the load addresses and registered, from then on
+// objects are registered as they are linked. Objects already on their way when
+// it started are parked, linked by the registration wrappers but not added to
+// __jit_debug_descriptor, and registered at the same point. Reference
+// counted, the last stop restores the signal's previous action.
+void jit_gdb_start_deferred(int signal);
+void jit_gdb_stop_deferred();
+
+// link every queued entry and register every parked and deferred one now, eg.
+// when a debugger attaches and must see everything linked so far
+void jit_gdb_flush();
+
+// copies of every debug object registered, parked or deferred so far, their
+// section addresses are the load addresses of the JIT'd code
+std::vector<std::unique_ptr<llvm::MemoryBuffer>> jit_gdb_copy_objects();
+
+// Objects registered while a batch is open (on any thread) are linked into the
+// descriptor right away but announced to the debugger when the outermost batch
+// ends: merged into one symbol file (see jit_merge_debug_objects) that is
+// registered with a single rendezvous, since debuggers only load the
+// relevant_entry of one. Objects that cannot be merged get a rendezvous each.
+void jit_gdb_begin_batch();
+void jit_gdb_end_batch();
+
+// a batch for the lifetime of the scope when `enabled`
+class jit_gdb_batch {
+    bool enabled;
+
+    public:
+
+    explicit jit_gdb_batch(bool enabled) : enabled(enabled) {
+        if (enabled) {
+            jit_gdb_begin_batch();
+        }
+    }
+    ~jit_gdb_batch() {
+        if (enabled) {
+            jit_gdb_end_batch();
+        }
+    }
+    jit_gdb_batch(const jit_gdb_batch &) = delete;
+    jit_gdb_batch & operator=(const jit_gdb_batch &) = delete;
+};
+
+// Objects compiled from M are not registered with the debugger. Called from
+// the IR transform, adds a marker section that travels with the object.
+void jit_gdb_skip_registration(llvm::Module & M);
+
+// Ties the GDB entries of JITLink objects to their resource key so they are
+// unregistered when the module is removed. Debug objects are registered
+// synchronously from the notifyEmitted of a debug plugin, this plugin claims
+// what was registered on the linking thread. jit_gdb_debug_filter uses one
+// around the ELF debug plugin, for the others it is added after them.
+class jit_gdb_plugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+    std::mutex lock;
+    llvm::DenseMap<llvm::orc::ResourceKey, std::vector<jit_code_entry *>> entries;
+
+    public:
+
+    llvm::Error notifyEmitted(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey K) override;
+    void notifyTransferringResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) override;
+};
+
+struct jit_gdb_deferred_object;
+
+// Wraps the debug plugin, objects marked with jit_gdb_skip_registration never
+// reach it, so it neither copies nor registers them, nor do objects linked
+// during deferred registration, the filter keeps their copies. The GDB entries
+// of an object are unregistered before the debug plugin frees it: the
+// registration thread and jit_gdb_copy_objects read the objects of registered
+// entries.
+class jit_gdb_debug_filter : public llvm::orc::ObjectLinkingLayer::Plugin {
+    std::unique_ptr<llvm::orc::ObjectLinkingLayer::Plugin> inner;
+    jit_gdb_plugin registered;
+
+    // deferred objects by the link making them, then by resource key
+    std::mutex lock;
+    llvm::DenseMap<llvm::orc::MaterializationResponsibility *, std::unique_ptr<jit_gdb_deferred_object>> linking;
+    llvm::DenseMap<llvm::orc::ResourceKey, std::vector<std::unique_ptr<jit_gdb_deferred_object>>> deferred;
+
+    public:
+
+    explicit jit_gdb_debug_filter(std::unique_ptr<llvm::orc::ObjectLinkingLayer::Plugin> inner);
+    ~jit_gdb_debug_filter() override;
+
+    void notifyMaterializing(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::JITLinkContext & Ctx, llvm::MemoryBufferRef InputObject) override;
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::PassConfiguration & Config) override;
+    llvm::Error notifyEmitted(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey K) override;
+    void notifyTransferringResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) override;
+};
+
+// Same for RTDyld, wraps the GDB registration listener.
+class jit_gdb_listener_filter : public llvm::JITEventListener {
+    llvm::JITEventListener & inner;
+
+    public:
+
+    explicit jit_gdb_listener_filter(llvm::JITEventListener & inner) : inner(inner) {}
+
+    void notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile & Obj, const llvm::RuntimeDyld::LoadedObjectInfo & L) override;
+    void notifyFreeingObject(ObjectKey K) override;
+};
+
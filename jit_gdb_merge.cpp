@@ -0,0 +1,516 @@
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/BinaryFormat/ELF.h>
+#include <llvm/Object/ELF.h>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/SwapByteOrder.h>
+
+#include "jit_gdb_merge.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+using elf_file = llvm::object::ELF64LEFile;
+
+namespace {
+
+struct output_section {
+    std::string name;
+    llvm::ELF::Elf64_Shdr header {};
+    std::vector<uint8_t> data;
+    bool dwarf = false;
+    // a DWARF section or an unwind table, its relocations are kept
+    bool relocatable = false;
+    // symbol indices are the output's, undefined ones tagged
+    std::vector<llvm::ELF::Elf64_Rela> relocations;
+};
+
+// where an input section went, section 0 when it was dropped
+struct placement {
+    unsigned section = 0;
+    uint64_t offset = 0;
+};
+
+} // namespace
+
+static llvm::Error unsupported(const llvm::Twine & why) {
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), "cannot merge debug objects: " + why);
+}
+
+static bool is_dwarf(const elf_file::Elf_Shdr & header, llvm::StringRef name) {
+    return name.starts_with(".debug_") && header.sh_type == llvm::ELF::SHT_PROGBITS && !(header.sh_flags & llvm::ELF::SHF_ALLOC);
+}
+
+// undefined symbols come after the locals, their index is only known at the end
+static constexpr uint32_t undefined_tag = 1u << 31;
+
+static bool is_unwind_table(const elf_file::Elf_Shdr & header, llvm::StringRef name) {
+    return header.sh_type == llvm::ELF::SHT_X86_64_UNWIND || name == ".eh_frame";
+}
+
+static bool is_kept_alloc(const elf_file::Elf_Shdr & header) {
+    if (!(header.sh_flags & llvm::ELF::SHF_ALLOC)) {
+        return false;
+    }
+    switch (header.sh_type) {
+        case llvm::ELF::SHT_PROGBITS:
+        case llvm::ELF::SHT_NOBITS:
+        case llvm::ELF::SHT_INIT_ARRAY:
+        case llvm::ELF::SHT_FINI_ARRAY:
+        case llvm::ELF::SHT_PREINIT_ARRAY:
+        case llvm::ELF::SHT_X86_64_UNWIND:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static uint32_t add_string(std::string & table, llvm::StringRef text) {
+    auto offset = static_cast<uint32_t>(table.size());
+    table.append(text.data(), text.size());
+    table.push_back('\0');
+    return offset;
+}
+
+bool jit_can_merge_debug_object(llvm::StringRef object) {
+    if (!llvm::sys::IsLittleEndianHost) {
+        return false;
+    }
+    auto file = elf_file::create(object);
+    if (!file) {
+        llvm::consumeError(file.takeError());
+        return false;
+    }
+    if (file->getHeader().e_type != llvm::ELF::ET_REL) {
+        return false;
+    }
+    auto sections = file->sections();
+    if (!sections) {
+        llvm::consumeError(sections.takeError());
+        return false;
+    }
+    for (auto & header : *sections) {
+        switch (header.sh_type) {
+            case llvm::ELF::SHT_REL:
+            case llvm::ELF::SHT_SYMTAB_SHNDX:
+                return false;
+        }
+        if (header.sh_flags & llvm::ELF::SHF_COMPRESSED) {
+            auto contents = file->getSectionContents(header);
+            if (!contents) {
+                llvm::consumeError(contents.takeError());
+                return false;
+            }
+            llvm::ELF::Elf64_Chdr chdr;
+            if (contents->size() < sizeof(chdr)) {
+                return false;
+            }
+            std::memcpy(&chdr, contents->data(), sizeof(chdr));
+            if (chdr.ch_type != llvm::ELF::ELFCOMPRESS_ZLIB || !llvm::compression::zlib::isAvailable()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+llvm::Expected<std::vector<char>> jit_merge_debug_objects(llvm::ArrayRef<llvm::StringRef> objects) {
+    if (!llvm::sys::IsLittleEndianHost) {
+        return unsupported("big-endian host");
+    }
+    if (objects.empty()) {
+        return unsupported("no objects");
+    }
+
+    std::vector<output_section> sections(1);
+    llvm::StringMap<unsigned> dwarf_sections;
+    std::vector<llvm::ELF::Elf64_Sym> symbols(1);
+    std::string strings(1, '\0');
+    // by name, what an unwind table refers to outside its object (eg. the
+    // personality routine)
+    llvm::StringMap<uint32_t> undefined;
+    std::vector<llvm::ELF::Elf64_Sym> undefined_symbols;
+    // the section symbol of each output section, made on first use
+    std::vector<uint32_t> section_symbols;
+    auto section_symbol = [&](unsigned section) {
+        section_symbols.resize(std::max<size_t>(section_symbols.size(), section + 1), 0);
+        if (!section_symbols[section]) {
+            llvm::ELF::Elf64_Sym symbol {};
+            symbol.setBindingAndType(llvm::ELF::STB_LOCAL, llvm::ELF::STT_SECTION);
+            symbol.st_shndx = static_cast<uint16_t>(section);
+            section_symbols[section] = static_cast<uint32_t>(symbols.size());
+            symbols.push_back(symbol);
+        }
+        return section_symbols[section];
+    };
+
+    bool compressed = false;
+    uint16_t machine = 0;
+    uint32_t flags = 0;
+    uint8_t osabi = 0;
+
+    for (size_t i = 0; i < objects.size(); ++i) {
+        auto file = elf_file::create(objects[i]);
+        if (!file) {
+            return file.takeError();
+        }
+        auto & header = file->getHeader();
+        if (header.e_type != llvm::ELF::ET_REL) {
+            return unsupported("object " + llvm::Twine(i) + " is not relocatable");
+        }
+        if (i == 0) {
+            machine = header.e_machine;
+            flags = header.e_flags;
+            osabi = header.e_ident[llvm::ELF::EI_OSABI];
+        } else if (header.e_machine != machine) {
+            return unsupported("objects for different machines");
+        }
+
+        auto input_sections = file->sections();
+        if (!input_sections) {
+            return input_sections.takeError();
+        }
+
+        // sections first, symbols and relocations refer to them
+        std::vector<placement> placed(input_sections->size());
+        const elf_file::Elf_Shdr * symtab = nullptr;
+        size_t symtab_index = 0;
+        for (size_t s = 1; s < input_sections->size(); ++s) {
+            auto & input = (*input_sections)[s];
+            if (input.sh_type == llvm::ELF::SHT_SYMTAB) {
+                symtab = &input;
+                symtab_index = s;
+                continue;
+            }
+            if (input.sh_type == llvm::ELF::SHT_SYMTAB_SHNDX) {
+                return unsupported("extended section indices");
+            }
+            auto name = file->getSectionName(input);
+            if (!name) {
+                return name.takeError();
+            }
+
+            if (is_kept_alloc(input)) {
+                output_section output;
+                output.name = name->str();
+                output.header.sh_type = input.sh_type;
+                output.header.sh_flags = input.sh_flags & ~static_cast<uint64_t>(llvm::ELF::SHF_GROUP);
+                output.header.sh_addr = input.sh_addr;
+                output.header.sh_size = input.sh_size;
+                output.header.sh_addralign = input.sh_addralign;
+                output.header.sh_entsize = input.sh_entsize;
+                output.relocatable = is_unwind_table(input, *name);
+                if (input.sh_type != llvm::ELF::SHT_NOBITS) {
+                    auto contents = file->getSectionContents(input);
+                    if (!contents) {
+                        return contents.takeError();
+                    }
+                    output.data.assign(contents->begin(), contents->end());
+                }
+                placed[s] = { static_cast<unsigned>(sections.size()), 0 };
+                sections.push_back(std::move(output));
+                continue;
+            }
+            if (!is_dwarf(input, *name)) {
+                continue;
+            }
+
+            auto contents = file->getSectionContents(input);
+            if (!contents) {
+                return contents.takeError();
+            }
+            llvm::ArrayRef<uint8_t> data = *contents;
+            uint64_t align = input.sh_addralign;
+            llvm::SmallVector<uint8_t, 0> inflated;
+            if (input.sh_flags & llvm::ELF::SHF_COMPRESSED) {
+                llvm::ELF::Elf64_Chdr chdr;
+                if (data.size() < sizeof(chdr)) {
+                    return unsupported("truncated compression header in " + *name);
+                }
+                std::memcpy(&chdr, data.data(), sizeof(chdr));
+                if (chdr.ch_type != llvm::ELF::ELFCOMPRESS_ZLIB || !llvm::compression::zlib::isAvailable()) {
+                    return unsupported("compression of " + *name);
+                }
+                if (auto Err = llvm::compression::zlib::decompress(data.drop_front(sizeof(chdr)), inflated, chdr.ch_size)) {
+                    return std::move(Err);
+                }
+                data = inflated;
+                align = chdr.ch_addralign;
+                compressed = true;
+            }
+            align = std::max<uint64_t>(align, 1);
+
+            auto [it, inserted] = dwarf_sections.try_emplace(*name, static_cast<unsigned>(sections.size()));
+            if (inserted) {
+                output_section output;
+                output.name = name->str();
+                output.dwarf = true;
+                output.relocatable = true;
+                output.header.sh_type = llvm::ELF::SHT_PROGBITS;
+                output.header.sh_flags = input.sh_flags & ~static_cast<uint64_t>(llvm::ELF::SHF_GROUP | llvm::ELF::SHF_COMPRESSED);
+                output.header.sh_entsize = input.sh_entsize;
+                sections.push_back(std::move(output));
+            }
+            auto & output = sections[it->second];
+            output.header.sh_addralign = std::max<uint64_t>(output.header.sh_addralign, align);
+            uint64_t offset = llvm::alignTo(output.data.size(), align);
+            output.data.resize(offset);
+            output.data.insert(output.data.end(), data.begin(), data.end());
+            placed[s] = { it->second, offset };
+        }
+
+        // symbols, section symbols are replaced by the output section's and
+        // relocations against them get the offset of the input added
+        std::vector<uint32_t> symbol_map;
+        std::vector<int64_t> section_of;
+        // output symbols for these are made when a relocation refers to them
+        std::vector<std::pair<llvm::StringRef, const elf_file::Elf_Sym *>> undefined_inputs;
+        if (symtab) {
+            auto input_symbols = file->symbols(symtab);
+            if (!input_symbols) {
+                return input_symbols.takeError();
+            }
+            auto names = file->getStringTableForSymtab(*symtab);
+            if (!names) {
+                return names.takeError();
+            }
+            symbol_map.assign(input_symbols->size(), 0);
+            undefined_inputs.assign(input_symbols->size(), {});
+            section_of.assign(input_symbols->size(), -1);
+            for (size_t k = 1; k < input_symbols->size(); ++k) {
+                auto & input = (*input_symbols)[k];
+                uint16_t shndx = input.st_shndx;
+                if (input.getType() == llvm::ELF::STT_SECTION) {
+                    section_of[k] = shndx;
+                    continue;
+                }
+                if (shndx == llvm::ELF::SHN_UNDEF) {
+                    auto name = input.getName(*names);
+                    if (!name) {
+                        return name.takeError();
+                    }
+                    undefined_inputs[k] = { *name, &input };
+                    continue;
+                }
+                placement where;
+                if (shndx == llvm::ELF::SHN_ABS) {
+                    where.section = llvm::ELF::SHN_ABS;
+                } else if (shndx >= llvm::ELF::SHN_LORESERVE || shndx >= placed.size()) {
+                    continue;
+                } else {
+                    where = placed[shndx];
+                    if (!where.section) {
+                        continue;
+                    }
+                }
+                auto name = input.getName(*names);
+                if (!name) {
+                    return name.takeError();
+                }
+                llvm::ELF::Elf64_Sym output {};
+                output.st_name = add_string(strings, *name);
+                output.setBindingAndType(llvm::ELF::STB_LOCAL, input.getType());
+                output.st_other = input.st_other;
+                output.st_shndx = static_cast<uint16_t>(where.section);
+                output.st_value = input.st_value + where.offset;
+                output.st_size = input.st_size;
+                symbol_map[k] = static_cast<uint32_t>(symbols.size());
+                symbols.push_back(output);
+            }
+        }
+
+        // relocations of the DWARF sections and unwind tables
+        for (size_t s = 1; s < input_sections->size(); ++s) {
+            auto & input = (*input_sections)[s];
+            if (input.sh_type != llvm::ELF::SHT_RELA && input.sh_type != llvm::ELF::SHT_REL) {
+                continue;
+            }
+            if (input.sh_info >= placed.size()) {
+                return unsupported("relocation section with a bad target");
+            }
+            auto target = placed[input.sh_info];
+            if (!target.section || !sections[target.section].relocatable) {
+                continue;
+            }
+            if (input.sh_type == llvm::ELF::SHT_REL) {
+                return unsupported("REL relocations");
+            }
+            if (!symtab || input.sh_link != symtab_index) {
+                return unsupported("relocations without the symbol table");
+            }
+            auto relocations = file->relas(input);
+            if (!relocations) {
+                return relocations.takeError();
+            }
+            for (auto & relocation : *relocations) {
+                uint32_t symbol = relocation.getSymbol(false);
+                int64_t addend = relocation.r_addend;
+                uint32_t output_symbol = 0;
+                if (symbol >= symbol_map.size() && symbol != 0) {
+                    return unsupported("relocation against a bad symbol");
+                }
+                if (symbol == 0) {
+                    output_symbol = 0;
+                } else if (section_of[symbol] >= 0) {
+                    auto section = static_cast<size_t>(section_of[symbol]);
+                    if (section >= placed.size() || !placed[section].section) {
+                        return unsupported("relocation against a dropped section");
+                    }
+                    output_symbol = section_symbol(placed[section].section);
+                    addend += static_cast<int64_t>(placed[section].offset);
+                } else if (symbol_map[symbol]) {
+                    output_symbol = symbol_map[symbol];
+                } else if (auto [name, input_symbol] = undefined_inputs[symbol]; input_symbol && !name.empty()) {
+                    auto [it, inserted] = undefined.try_emplace(name, static_cast<uint32_t>(undefined_symbols.size()));
+                    if (inserted) {
+                        llvm::ELF::Elf64_Sym undefined_symbol {};
+                        undefined_symbol.st_name = add_string(strings, name);
+                        undefined_symbol.setBindingAndType(input_symbol->getBinding() == llvm::ELF::STB_WEAK ? llvm::ELF::STB_WEAK : llvm::ELF::STB_GLOBAL, input_symbol->getType());
+                        undefined_symbol.st_other = input_symbol->st_other;
+                        undefined_symbols.push_back(undefined_symbol);
+                    }
+                    output_symbol = undefined_tag | it->second;
+                } else {
+                    return unsupported("relocation against a dropped symbol");
+                }
+                llvm::ELF::Elf64_Rela output {};
+                output.r_offset = relocation.r_offset + target.offset;
+                output.r_addend = addend;
+                output.setSymbolAndType(output_symbol, relocation.getType(false));
+                sections[target.section].relocations.push_back(output);
+            }
+        }
+    }
+
+    // the undefined symbols follow the locals
+    auto locals = static_cast<uint32_t>(symbols.size());
+    symbols.insert(symbols.end(), undefined_symbols.begin(), undefined_symbols.end());
+
+    // section indices: the copied and merged sections, one relocation
+    // section per relocated section, .symtab, .strtab, .shstrtab
+    std::vector<unsigned> relocated;
+    for (unsigned s = 1; s < sections.size(); ++s) {
+        auto & relocations = sections[s].relocations;
+        if (relocations.empty()) {
+            continue;
+        }
+        for (auto & relocation : relocations) {
+            uint32_t symbol = relocation.getSymbol();
+            if (symbol & undefined_tag) {
+                relocation.setSymbolAndType(locals + (symbol & ~undefined_tag), relocation.getType());
+            }
+        }
+        relocated.push_back(s);
+    }
+    size_t symtab_index = sections.size() + relocated.size();
+    size_t strtab_index = symtab_index + 1;
+    size_t shstrtab_index = symtab_index + 2;
+    if (shstrtab_index >= llvm::ELF::SHN_LORESERVE) {
+        return unsupported("too many sections");
+    }
+
+    if (compressed) {
+        for (auto & section : sections) {
+            if (!section.dwarf || section.data.empty()) {
+                continue;
+            }
+            llvm::SmallVector<uint8_t, 0> packed;
+            llvm::compression::zlib::compress(section.data, packed);
+            llvm::ELF::Elf64_Chdr chdr {};
+            chdr.ch_type = llvm::ELF::ELFCOMPRESS_ZLIB;
+            chdr.ch_size = section.data.size();
+            chdr.ch_addralign = section.header.sh_addralign;
+            std::vector<uint8_t> data(sizeof(chdr));
+            std::memcpy(data.data(), &chdr, sizeof(chdr));
+            data.insert(data.end(), packed.begin(), packed.end());
+            section.data = std::move(data);
+            section.header.sh_flags |= llvm::ELF::SHF_COMPRESSED;
+            section.header.sh_addralign = std::max<uint64_t>(section.header.sh_addralign, alignof(llvm::ELF::Elf64_Chdr));
+        }
+    }
+
+    std::vector<char> out(sizeof(llvm::ELF::Elf64_Ehdr));
+    auto append = [&out](const void * data, size_t size, uint64_t align) {
+        uint64_t offset = llvm::alignTo(out.size(), std::max<uint64_t>(align, 1));
+        out.resize(offset);
+        auto * bytes = static_cast<const char *>(data);
+        out.insert(out.end(), bytes, bytes + size);
+        return offset;
+    };
+
+    std::string section_names(1, '\0');
+    std::vector<llvm::ELF::Elf64_Shdr> headers(1);
+    for (size_t s = 1; s < sections.size(); ++s) {
+        auto & section = sections[s];
+        auto header = section.header;
+        header.sh_name = add_string(section_names, section.name);
+        if (header.sh_type == llvm::ELF::SHT_NOBITS) {
+            header.sh_offset = out.size();
+        } else {
+            header.sh_offset = append(section.data.data(), section.data.size(), header.sh_addralign);
+            header.sh_size = section.data.size();
+        }
+        headers.push_back(header);
+    }
+    for (unsigned s : relocated) {
+        auto & relocations = sections[s].relocations;
+        llvm::ELF::Elf64_Shdr header {};
+        header.sh_name = add_string(section_names, ".rela" + sections[s].name);
+        header.sh_type = llvm::ELF::SHT_RELA;
+        header.sh_flags = llvm::ELF::SHF_INFO_LINK;
+        header.sh_link = static_cast<uint32_t>(symtab_index);
+        header.sh_info = s;
+        header.sh_entsize = sizeof(llvm::ELF::Elf64_Rela);
+        header.sh_addralign = 8;
+        header.sh_size = relocations.size() * sizeof(llvm::ELF::Elf64_Rela);
+        header.sh_offset = append(relocations.data(), header.sh_size, 8);
+        headers.push_back(header);
+    }
+
+    llvm::ELF::Elf64_Shdr symtab {};
+    symtab.sh_name = add_string(section_names, ".symtab");
+    symtab.sh_type = llvm::ELF::SHT_SYMTAB;
+    symtab.sh_link = static_cast<uint32_t>(strtab_index);
+    symtab.sh_info = locals;
+    symtab.sh_entsize = sizeof(llvm::ELF::Elf64_Sym);
+    symtab.sh_addralign = 8;
+    symtab.sh_size = symbols.size() * sizeof(llvm::ELF::Elf64_Sym);
+    symtab.sh_offset = append(symbols.data(), symtab.sh_size, 8);
+    headers.push_back(symtab);
+
+    llvm::ELF::Elf64_Shdr strtab {};
+    strtab.sh_name = add_string(section_names, ".strtab");
+    strtab.sh_type = llvm::ELF::SHT_STRTAB;
+    strtab.sh_addralign = 1;
+    strtab.sh_size = strings.size();
+    strtab.sh_offset = append(strings.data(), strings.size(), 1);
+    headers.push_back(strtab);
+
+    llvm::ELF::Elf64_Shdr shstrtab {};
+    shstrtab.sh_name = add_string(section_names, ".shstrtab");
+    shstrtab.sh_type = llvm::ELF::SHT_STRTAB;
+    shstrtab.sh_addralign = 1;
+    shstrtab.sh_size = section_names.size();
+    shstrtab.sh_offset = append(section_names.data(), section_names.size(), 1);
+    headers.push_back(shstrtab);
+
+    llvm::ELF::Elf64_Ehdr ehdr {};
+    std::memcpy(ehdr.e_ident, llvm::ELF::ElfMagic, 4);
+    ehdr.e_ident[llvm::ELF::EI_CLASS] = llvm::ELF::ELFCLASS64;
+    ehdr.e_ident[llvm::ELF::EI_DATA] = llvm::ELF::ELFDATA2LSB;
+    ehdr.e_ident[llvm::ELF::EI_VERSION] = llvm::ELF::EV_CURRENT;
+    ehdr.e_ident[llvm::ELF::EI_OSABI] = osabi;
+    ehdr.e_type = llvm::ELF::ET_REL;
+    ehdr.e_machine = machine;
+    ehdr.e_version = llvm::ELF::EV_CURRENT;
+    ehdr.e_flags = flags;
+    ehdr.e_ehsize = sizeof(llvm::ELF::Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(llvm::ELF::Elf64_Shdr);
+    ehdr.e_shnum = static_cast<uint16_t>(headers.size());
+    ehdr.e_shstrndx = static_cast<uint16_t>(shstrtab_index);
+    ehdr.e_shoff = append(headers.data(), headers.size() * sizeof(llvm::ELF::Elf64_Shdr), 8);
+    std::memcpy(out.data(), &ehdr, sizeof(ehdr));
+    return out;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include <vector>
+
+// Merges debug objects as they are handed to the GDB JIT interface
+// (relocatable ELF whose allocated sections carry their load addresses) into
+// one symbol file, so debuggers scan one entry instead of many.
+//
+// Allocated sections are copied as they are. Each DWARF section is the
+// concatenation of the inputs' sections of that name, with their relocations
+// rebased onto it (debuggers apply them as for any relocatable object), the
+// relocations of unwind tables (.eh_frame) are kept too. Every defined symbol
+// becomes local, the undefined ones unwind tables refer to stay undefined.
+// zlib compressed DWARF sections are inflated, and the merged ones compressed
+// again. Other sections and their relocations are dropped. Only 64-bit
+// little-endian ELF with RELA relocations is supported.
+llvm::Expected<std::vector<char>> jit_merge_debug_objects(llvm::ArrayRef<llvm::StringRef> objects);
+
+// cheap check that jit_merge_debug_objects takes `object`
+bool jit_can_merge_debug_object(llvm::StringRef object);
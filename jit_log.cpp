@@ -0,0 +1,189 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit_log.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+std::atomic<int> jit_log_level { static_cast<int>(JIT::log_level::warning) };
+
+namespace {
+
+struct log_slot {
+    // the position the slot is free for, or that position + 1 once written
+    std::atomic<uint64_t> sequence;
+    JIT::log_level level;
+    uint32_t size;
+    char text[240];
+};
+
+// bounded multi-producer ring (Vyukov), drained by one writer thread or by
+// flush, both under drain_lock
+class log_ring {
+    static constexpr uint64_t num_slots = 4096;
+
+    std::unique_ptr<log_slot[]> slots;
+    std::atomic<uint64_t> enqueue_pos { 0 };
+    std::atomic<uint64_t> dropped { 0 };
+
+    std::mutex drain_lock;
+    uint64_t dequeue_pos = 0;
+    std::function<void(JIT::log_level, llvm::StringRef)> sink;
+
+    std::mutex writer_lock;
+    std::condition_variable writer_wake;
+    bool stopping = false;
+    // set by the writer before it waits for an empty ring, the producer that
+    // clears it wakes the writer
+    std::atomic<bool> writer_sleeping { false };
+    std::thread writer;
+    // no messages are taken once the writer is stopped at exit
+    std::atomic<bool> closed { false };
+
+    static void default_sink(JIT::log_level level, llvm::StringRef text) {
+        llvm::errs() << text << "\n";
+    }
+
+    // false while a flush drains, the writer waits for it outside writer_lock
+    // instead of holding up the producer that would wake it
+    bool empty() {
+        std::unique_lock<std::mutex> guard(drain_lock, std::try_to_lock);
+        return guard.owns_lock() && slots[dequeue_pos & (num_slots - 1)].sequence.load(std::memory_order_acquire) != dequeue_pos + 1;
+    }
+
+    public:
+
+    log_ring() : slots(new log_slot[num_slots]), sink(default_sink) {
+        for (uint64_t i = 0; i < num_slots; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        writer = std::thread([this] {
+            std::unique_lock<std::mutex> guard(writer_lock);
+            while (!stopping) {
+                writer_sleeping.store(true);
+                // pairs with the fence in push, either the producer sees the
+                // writer sleeping or the writer sees its message
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (empty()) {
+                    writer_wake.wait(guard, [this] { return stopping || !writer_sleeping.load(); });
+                }
+                writer_sleeping.store(false);
+                guard.unlock();
+                drain();
+                guard.lock();
+            }
+        });
+    }
+
+    // at exit, before llvm::errs() and the other statics constructed before
+    // the ring go away. The ring itself is never destroyed, logging from
+    // later static destructors finds it closed.
+    void close() {
+        closed = true;
+        {
+            std::lock_guard<std::mutex> guard(writer_lock);
+            stopping = true;
+        }
+        writer_wake.notify_one();
+        writer.join();
+        drain();
+    }
+
+    void push(JIT::log_level level, llvm::StringRef text) {
+        if (closed.load(std::memory_order_relaxed)) {
+            return;
+        }
+        uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        log_slot * slot;
+        for (;;) {
+            slot = &slots[pos & (num_slots - 1)];
+            uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(sequence - pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        slot->size = static_cast<uint32_t>(std::min(text.size(), sizeof(slot->text)));
+        std::memcpy(slot->text, text.data(), slot->size);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+
+        // wakes the writer when it found the ring empty, once
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (writer_sleeping.load(std::memory_order_relaxed) && writer_sleeping.exchange(false)) {
+            { std::lock_guard<std::mutex> guard(writer_lock); }
+            writer_wake.notify_one();
+        }
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> guard(drain_lock);
+        char text[sizeof(log_slot::text)];
+        for (;;) {
+            auto & slot = slots[dequeue_pos & (num_slots - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+                break;
+            }
+            auto level = slot.level;
+            uint32_t size = slot.size;
+            std::memcpy(text, slot.text, size);
+            slot.sequence.store(dequeue_pos + num_slots, std::memory_order_release);
+            ++dequeue_pos;
+            sink(level, llvm::StringRef(text, size));
+        }
+        if (auto lost = dropped.exchange(0, std::memory_order_relaxed)) {
+            llvm::SmallString<64> message;
+            (llvm::Twine("JIT log full, ") + llvm::Twine(lost) + " messages dropped.").toVector(message);
+            sink(JIT::log_level::warning, message);
+        }
+    }
+
+    void set_sink(std::function<void(JIT::log_level, llvm::StringRef)> new_sink) {
+        std::lock_guard<std::mutex> guard(drain_lock);
+        sink = new_sink ? std::move(new_sink) : default_sink;
+    }
+};
+
+log_ring & ring() {
+    static log_ring * instance = [] {
+        // constructed first so it is destroyed after the ring closes
+        llvm::errs();
+        auto * created = new log_ring;
+        std::atexit([] { ring().close(); });
+        return created;
+    }();
+    return *instance;
+}
+
+} // namespace
+
+void jit_log_write(JIT::log_level level, const llvm::Twine & message) {
+    llvm::SmallString<256> buffer;
+    ring().push(level, message.toStringRef(buffer));
+}
+
+void JIT::set_log_level(log_level level) {
+    jit_log_level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+void JIT::set_log_sink(std::function<void(log_level, llvm::StringRef)> sink) {
+    ring().set_sink(std::move(sink));
+}
+
+void JIT::flush_log() {
+    ring().drain();
+}
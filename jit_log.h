@@ -0,0 +1,42 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/ADT/Twine.h>
+
+#include <atomic>
+
+// Leveled log of the JIT.
+//
+// JIT_LOG(level, message) only builds `message` (a Twine) when `level` is
+// enabled: levels above JIT_LOG_MAX_LEVEL are compiled out, the others are
+// checked against JIT::set_log_level with one relaxed load. Enabled messages
+// are copied into a lock-free ring buffer and written to the sink
+// (JIT::set_log_sink, llvm::errs() by default) by a background thread, so
+// the thread that logs never blocks on the sink. The writer sleeps while the
+// ring is empty and the message that fills it wakes it. While the ring is full
+// messages are dropped and counted. The ring lives until the process exits,
+// at exit the writer writes what is left and later messages are dropped.
+
+// 0 error, 1 warning, 2 info, 3 debug
+#ifndef JIT_LOG_MAX_LEVEL
+#define JIT_LOG_MAX_LEVEL 3
+#endif
+
+extern std::atomic<int> jit_log_level;
+
+inline bool jit_log_enabled(JIT::log_level level) {
+    return static_cast<int>(level) <= jit_log_level.load(std::memory_order_relaxed);
+}
+
+// messages longer than a ring slot (about 240 bytes) are truncated
+void jit_log_write(JIT::log_level level, const llvm::Twine & message);
+
+#define JIT_LOG(severity, message) \
+    do { \
+        if constexpr (static_cast<int>(JIT::log_level::severity) <= JIT_LOG_MAX_LEVEL) { \
+            if (jit_log_enabled(JIT::log_level::severity)) { \
+                jit_log_write(JIT::log_level::severity, message); \
+            } \
+        } \
+    } while (0)
@@ -0,0 +1,100 @@
+#include <llvm/ExecutionEngine/JITLink/JITLink.h>
+
+#include "jit_memory.h"
+
+void jit_code_memory::set_budget(uint64_t budget, std::function<void()> over_budget) {
+    this->budget = budget;
+    this->over_budget = std::move(over_budget);
+}
+
+void jit_code_memory::allocated(uint64_t bytes) {
+    auto now = total.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (budget && now > budget && over_budget) {
+        over_budget();
+    }
+}
+
+void jit_code_memory::freed(uint64_t bytes) {
+    total.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void jit_code_memory::plugin::modifyPassConfig(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::PassConfiguration & Config) {
+    Config.PostAllocationPasses.push_back([this, &MR](llvm::jitlink::LinkGraph & G) {
+        uint64_t bytes = 0;
+        for (auto & Sec : G.sections()) {
+            if (Sec.getMemLifetime() == llvm::orc::MemLifetime::NoAlloc) {
+                continue;
+            }
+            for (auto * B : Sec.blocks()) {
+                bytes += B->getSize();
+            }
+        }
+        memory.allocated(bytes);
+        std::lock_guard<std::mutex> guard(lock);
+        pending[&MR] += bytes;
+        return llvm::Error::success();
+    });
+}
+
+llvm::Error jit_code_memory::plugin::notifyEmitted(llvm::orc::MaterializationResponsibility & MR) {
+    uint64_t bytes;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = pending.find(&MR);
+        if (it == pending.end()) {
+            return llvm::Error::success();
+        }
+        bytes = it->second;
+        pending.erase(it);
+    }
+    return MR.withResourceKeyDo([&](llvm::orc::ResourceKey K) {
+        std::lock_guard<std::mutex> guard(lock);
+        by_key[K] += bytes;
+    });
+}
+
+llvm::Error jit_code_memory::plugin::notifyFailed(llvm::orc::MaterializationResponsibility & MR) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = pending.find(&MR);
+    if (it != pending.end()) {
+        memory.freed(it->second);
+        pending.erase(it);
+    }
+    return llvm::Error::success();
+}
+
+llvm::Error jit_code_memory::plugin::notifyRemovingResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey K) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = by_key.find(K);
+    if (it != by_key.end()) {
+        memory.freed(it->second);
+        by_key.erase(it);
+    }
+    return llvm::Error::success();
+}
+
+void jit_code_memory::plugin::notifyTransferringResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = by_key.find(SrcKey);
+    if (it != by_key.end()) {
+        auto bytes = it->second;
+        by_key.erase(it);
+        by_key[DstKey] += bytes;
+    }
+}
+
+jit_code_memory::memory_manager::~memory_manager() {
+    memory.freed(bytes);
+}
+
+uint8_t * jit_code_memory::memory_manager::allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, llvm::StringRef SectionName) {
+    bytes += Size;
+    memory.allocated(Size);
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID, SectionName);
+}
+
+uint8_t * jit_code_memory::memory_manager::allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, llvm::StringRef SectionName, bool IsReadOnly) {
+    bytes += Size;
+    memory.allocated(Size);
+    return SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID, SectionName, IsReadOnly);
+}
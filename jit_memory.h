@@ -0,0 +1,66 @@
+#pragma once
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+// Bytes of JIT'd code and data currently mapped, fed by a plugin of the JITLink
+// layer or by the memory managers of the RTDyld layer. Stubs and trampolines
+// are not counted.
+class jit_code_memory {
+    std::atomic<uint64_t> total { 0 };
+    uint64_t budget = 0;
+    std::function<void()> over_budget;
+
+    public:
+
+    class plugin;
+    class memory_manager;
+
+    uint64_t bytes() const { return total.load(std::memory_order_relaxed); }
+
+    // `over_budget` is called after an allocation leaves more than `budget`
+    // bytes mapped, it must not block. Set before anything is linked.
+    void set_budget(uint64_t budget, std::function<void()> over_budget);
+
+    void allocated(uint64_t bytes);
+    void freed(uint64_t bytes);
+};
+
+// sizes the allocated sections of each link graph and releases them with the
+// resource key of the object
+class jit_code_memory::plugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+    jit_code_memory & memory;
+    std::mutex lock;
+    llvm::DenseMap<llvm::orc::MaterializationResponsibility *, uint64_t> pending;
+    llvm::DenseMap<llvm::orc::ResourceKey, uint64_t> by_key;
+
+    public:
+
+    plugin(jit_code_memory & memory) : memory(memory) {}
+
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::PassConfiguration & Config) override;
+    llvm::Error notifyEmitted(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey K) override;
+    void notifyTransferringResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) override;
+};
+
+// RTDyld creates one memory manager per object and destroys it with the
+// object's resources
+class jit_code_memory::memory_manager : public llvm::SectionMemoryManager {
+    jit_code_memory & memory;
+    uint64_t bytes = 0;
+
+    public:
+
+    memory_manager(jit_code_memory & memory) : memory(memory) {}
+    ~memory_manager() override;
+
+    uint8_t * allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, llvm::StringRef SectionName) override;
+    uint8_t * allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, llvm::StringRef SectionName, bool IsReadOnly) override;
+};
@@ -0,0 +1,195 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/SHA256.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit_log.h"
+#include "jit_object_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+static const char * object_extension = ".o";
+static const char * bypass_flag = "jit.no_object_cache";
+
+static bool bypassed(const llvm::Module & M) {
+    return M.getModuleFlag(bypass_flag) != nullptr;
+}
+
+jit_object_cache::jit_object_cache(llvm::StringRef dir, uint64_t size_limit) : dir(dir.str()), size_limit(size_limit) {
+    if (auto EC = llvm::sys::fs::create_directories(dir)) {
+        JIT_LOG(warning, "JIT object cache could not create " + dir + ": " + EC.message());
+    }
+    evict();
+}
+
+void jit_object_cache::set_target(const llvm::orc::JITTargetMachineBuilder & JTMB) {
+    target_id = JTMB.getTargetTriple().str()
+        + "|" + JTMB.getCPU()
+        + "|" + JTMB.getFeatures().getString()
+        + (JTMB.getOptions().CompressDebugSections != llvm::DebugCompressionType::None ? "|zdebug" : "")
+        + (JTMB.getOptions().DebuggerTuning == llvm::DebuggerKind::LLDB ? "|lldb" : "")
+        + "|" LLVM_VERSION_STRING;
+}
+
+void jit_object_cache::bypass(llvm::Module & M) {
+    M.setModuleFlag(llvm::Module::Override, bypass_flag, llvm::ConstantAsMetadata::get(llvm::ConstantInt::getTrue(M.getContext())));
+}
+
+std::string jit_object_cache::key(const llvm::Module & M) const {
+    llvm::SmallVector<char, 0> buffer;
+    {
+        llvm::raw_svector_ostream OS(buffer);
+        llvm::WriteBitcodeToFile(M, OS);
+        OS << target_id;
+    }
+    return llvm::toHex(llvm::SHA256::hash(llvm::arrayRefFromStringRef(llvm::StringRef(buffer.data(), buffer.size()))), true);
+}
+
+std::string jit_object_cache::path(llvm::StringRef key) const {
+    llvm::SmallString<256> result(dir);
+    llvm::sys::path::append(result, key + object_extension);
+    return std::string(result);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> jit_object_cache::getObject(const llvm::Module * M) {
+    if (bypassed(*M)) {
+        return nullptr;
+    }
+    auto K = key(*M);
+    auto P = path(K);
+
+    int FD;
+    if (llvm::sys::fs::openFileForReadWrite(P, FD, llvm::sys::fs::CD_OpenExisting, llvm::sys::fs::OF_None)) {
+        ++misses;
+        std::lock_guard<std::mutex> guard(lock);
+        pending[M] = std::move(K);
+        return nullptr;
+    }
+
+    auto buffer = llvm::MemoryBuffer::getOpenFile(llvm::sys::fs::convertFDToNativeFile(FD), P, -1, false);
+    // touch it, eviction removes the least recently used objects first
+    llvm::sys::fs::setLastAccessAndModificationTime(FD, std::chrono::system_clock::now());
+    llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+
+    if (!buffer) {
+        ++misses;
+        std::lock_guard<std::mutex> guard(lock);
+        pending[M] = std::move(K);
+        return nullptr;
+    }
+
+    ++hits;
+    JIT_LOG(debug, "JIT object cache hit " + llvm::Twine(K));
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.erase(M);
+    }
+    return std::move(*buffer);
+}
+
+void jit_object_cache::notifyObjectCompiled(const llvm::Module * M, llvm::MemoryBufferRef Obj) {
+    if (bypassed(*M)) {
+        return;
+    }
+    std::string K;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = pending.find(M);
+        if (it != pending.end()) {
+            K = std::move(it->second);
+            pending.erase(it);
+        }
+    }
+    if (K.empty()) {
+        K = key(*M);
+    }
+    auto P = path(K);
+
+    // write to a unique temporary and rename it into place, concurrent writers
+    // of the same key produce identical objects so the last rename wins
+    auto temp = llvm::sys::fs::TempFile::create(P + ".tmp-%%%%%%%%");
+    if (!temp) {
+        llvm::logAllUnhandledErrors(temp.takeError(), llvm::errs(), "JIT object cache write failed: ");
+        return;
+    }
+    {
+        llvm::raw_fd_ostream OS(temp->FD, false);
+        OS << Obj.getBuffer();
+        OS.flush();
+        if (OS.has_error()) {
+            JIT_LOG(warning, "JIT object cache write failed: " + OS.error().message());
+            OS.clear_error();
+            llvm::consumeError(temp->discard());
+            return;
+        }
+    }
+    if (auto Err = temp->keep(P)) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT object cache write failed: ");
+        return;
+    }
+
+    bool over_limit;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size += Obj.getBufferSize();
+        over_limit = size > size_limit;
+    }
+    if (over_limit) {
+        evict();
+    }
+}
+
+// rescan the directory and remove the least recently used objects until the
+// cache is back under 90% of the limit.
+void jit_object_cache::evict() {
+    struct entry {
+        std::string path;
+        llvm::sys::TimePoint<> used;
+        uint64_t size;
+    };
+    std::vector<entry> entries;
+    uint64_t total = 0;
+
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator it(dir, EC), end; it != end && !EC; it.increment(EC)) {
+        if (llvm::sys::path::extension(it->path()) != object_extension) {
+            continue;
+        }
+        auto status = it->status();
+        if (!status) {
+            continue;
+        }
+        entries.push_back({ it->path(), status->getLastModificationTime(), status->getSize() });
+        total += status->getSize();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    size = total;
+    if (size <= size_limit) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) { return a.used < b.used; });
+    auto target = size_limit / 10 * 9;
+    for (auto & e : entries) {
+        if (size <= target) {
+            break;
+        }
+        // another process may have removed it already
+        llvm::sys::fs::remove(e.path);
+        size -= e.size;
+    }
+    JIT_LOG(info, "JIT object cache evicted down to " + llvm::Twine(size) + " bytes.");
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// On-disk object cache shared by all JIT instances (and processes) pointing at
+// the same directory.
+//
+// Objects are keyed by a SHA-256 of the module bitcode as it reaches the
+// compile layer (i.e. after the optimization stage) together with the target
+// triple, CPU, features and LLVM version. Files are written to a temporary
+// name and renamed into place, so readers never see a partial object. Once the
+// directory grows past the size limit the least recently used objects are
+// removed. Modules marked with `bypass` are neither looked up nor stored.
+class jit_object_cache : public llvm::ObjectCache {
+    std::string dir;
+    uint64_t size_limit;
+    std::string target_id;
+
+    std::mutex lock;
+    // key of each module between getObject and notifyObjectCompiled
+    std::map<const llvm::Module *, std::string> pending;
+    // approximate size of the directory, rescanned when over the limit
+    uint64_t size = 0;
+
+    std::string key(const llvm::Module & M) const;
+    std::string path(llvm::StringRef key) const;
+    void evict();
+
+    public:
+
+    // lookups of modules that do not bypass the cache, see JIT::stats
+    std::atomic<uint64_t> hits { 0 };
+    std::atomic<uint64_t> misses { 0 };
+
+    jit_object_cache(llvm::StringRef dir, uint64_t size_limit);
+
+    // must be called before the first compile
+    void set_target(const llvm::orc::JITTargetMachineBuilder & JTMB);
+
+    // for modules that embed addresses of this process, their keys would
+    // never be seen again
+    static void bypass(llvm::Module & M);
+
+    void notifyObjectCompiled(const llvm::Module * M, llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module * M) override;
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+// host CPU and features, PIC, large code model, shared by the compile stage
+// and everything that optimizes ahead of it
+llvm::orc::JITTargetMachineBuilder host_target_machine_builder();
+
+// run the new pass manager default pipeline for the given level over M.
+void optimize_module(llvm::Module & M, JIT::opt_level opt, llvm::TargetMachine * TM);
@@ -0,0 +1,69 @@
+#include <llvm/ExecutionEngine/JITLink/JITLink.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Process.h>
+
+#include "jit_log.h"
+#include "jit_perf.h"
+
+jit_perf_map::jit_perf_map() {
+    auto path = "/tmp/perf-" + llvm::Twine(llvm::sys::Process::getProcessId()) + ".map";
+    std::error_code EC;
+    out = std::make_unique<llvm::raw_fd_ostream>(path.str(), EC, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+    if (EC) {
+        JIT_LOG(warning, "JIT cannot open " + path + ": " + EC.message() + ", perf map disabled.");
+        out.reset();
+    }
+}
+
+jit_perf_map::~jit_perf_map() = default;
+
+llvm::JITEventListener & jit_perf_map::event_listener() {
+    if (!rtdyld_listener) {
+        rtdyld_listener = std::make_unique<listener>(*this);
+    }
+    return *rtdyld_listener;
+}
+
+void jit_perf_map::add(uint64_t address, uint64_t size, llvm::StringRef name) {
+    if (!out || size == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    *out << llvm::format_hex_no_prefix(address, 1) << " " << llvm::format_hex_no_prefix(size, 1) << " " << name << "\n";
+    // perf reads the map after the process is gone, flush so a crash keeps it
+    out->flush();
+}
+
+void jit_perf_map::plugin::modifyPassConfig(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::PassConfiguration & Config) {
+    Config.PostFixupPasses.push_back([this](llvm::jitlink::LinkGraph & G) {
+        for (auto * Sym : G.defined_symbols()) {
+            if (Sym->hasName() && Sym->isCallable()) {
+                map.add(Sym->getAddress().getValue(), Sym->getSize(), Sym->getName());
+            }
+        }
+        return llvm::Error::success();
+    });
+}
+
+void jit_perf_map::listener::notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile & Obj, const llvm::RuntimeDyld::LoadedObjectInfo & L) {
+    for (auto & [Sym, size] : llvm::object::computeSymbolSizes(Obj)) {
+        auto type = Sym.getType();
+        if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+            llvm::consumeError(type.takeError());
+            continue;
+        }
+        auto name = Sym.getName();
+        auto address = Sym.getAddress();
+        auto section = Sym.getSection();
+        if (!name || !address || !section || *section == Obj.section_end()) {
+            llvm::consumeError(name.takeError());
+            llvm::consumeError(address.takeError());
+            llvm::consumeError(section.takeError());
+            continue;
+        }
+        // the symbol address is relative to its section in the object
+        auto load = L.getSectionLoadAddress(**section);
+        map.add(load + *address - (*section)->getAddress(), size, *name);
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// /tmp/perf-<pid>.map, one "start size name" line per JIT'd function, which
+// perf report uses to name samples in anonymous executable memory. Entries
+// are appended as objects are linked and never removed, perf resolves an
+// address to the most recent entry covering it.
+class jit_perf_map {
+    std::mutex lock;
+    std::unique_ptr<llvm::raw_fd_ostream> out;
+
+    public:
+
+    class plugin;
+    class listener;
+
+    private:
+
+    std::unique_ptr<listener> rtdyld_listener;
+
+    public:
+
+    jit_perf_map();
+    ~jit_perf_map();
+
+    // for the RTDyld layer, which only keeps a reference
+    llvm::JITEventListener & event_listener();
+
+    explicit operator bool() const { return out != nullptr; }
+
+    void add(uint64_t address, uint64_t size, llvm::StringRef name);
+};
+
+// names the callable symbols of every link graph once their addresses are
+// final
+class jit_perf_map::plugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+    jit_perf_map & map;
+
+    public:
+
+    plugin(jit_perf_map & map) : map(map) {}
+
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::PassConfiguration & Config) override;
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility & MR) override { return llvm::Error::success(); }
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey K) override { return llvm::Error::success(); }
+    void notifyTransferringResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) override {}
+};
+
+// the same for objects loaded by RTDyld
+class jit_perf_map::listener : public llvm::JITEventListener {
+    jit_perf_map & map;
+
+    public:
+
+    listener(jit_perf_map & map) : map(map) {}
+
+    void notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile & Obj, const llvm::RuntimeDyld::LoadedObjectInfo & L) override;
+};
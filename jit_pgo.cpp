@@ -0,0 +1,180 @@
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/ProfileSummary.h>
+#include <llvm/ProfileData/InstrProf.h>
+#include <llvm/ProfileData/ProfileCommon.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit_pgo.h"
+
+#include <algorithm>
+
+static const char * profile_header = "# jit edge profile v1";
+
+// conditional branches and switches in block order, successor i of each
+// terminator owns one counter.
+static llvm::SmallVector<llvm::Instruction *, 16> profiled_terminators(llvm::Function & F) {
+    llvm::SmallVector<llvm::Instruction *, 16> result;
+    for (auto & BB : F) {
+        auto * T = BB.getTerminator();
+        if (auto * Br = llvm::dyn_cast_or_null<llvm::BranchInst>(T); Br && Br->isConditional()) {
+            result.push_back(T);
+        } else if (llvm::isa_and_nonnull<llvm::SwitchInst>(T)) {
+            result.push_back(T);
+        }
+    }
+    return result;
+}
+
+size_t count_edges(llvm::Function & F) {
+    size_t edges = 0;
+    for (auto * T : profiled_terminators(F)) {
+        edges += T->getNumSuccessors();
+    }
+    return edges;
+}
+
+void instrument_edges(llvm::Function & F, std::atomic<uint64_t> * counters) {
+    auto * PtrTy = llvm::PointerType::getUnqual(F.getContext());
+
+    uint64_t first = 0;
+    for (auto * T : profiled_terminators(F)) {
+        llvm::IRBuilder<> B(T);
+        llvm::Value * index;
+        if (auto * Br = llvm::dyn_cast<llvm::BranchInst>(T)) {
+            // successor 0 is taken when the condition holds
+            index = B.CreateSelect(Br->getCondition(), B.getInt64(first), B.getInt64(first + 1));
+        } else {
+            // successor 0 is the default, successor i + 1 is case i
+            auto * Sw = llvm::cast<llvm::SwitchInst>(T);
+            index = B.getInt64(first);
+            for (auto & Case : Sw->cases()) {
+                auto * match = B.CreateICmpEQ(Sw->getCondition(), Case.getCaseValue());
+                index = B.CreateSelect(match, B.getInt64(first + 1 + Case.getCaseIndex()), index);
+            }
+        }
+        auto * base = B.CreateIntToPtr(B.getInt64(reinterpret_cast<uintptr_t>(counters)), PtrTy);
+        auto * counter = B.CreateGEP(B.getInt64Ty(), base, index);
+        B.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, B.getInt64(1), llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+        first += T->getNumSuccessors();
+    }
+}
+
+bool apply_profile(llvm::Function & F, const JIT::function_profile & profile) {
+    auto terminators = profiled_terminators(F);
+    if (count_edges(F) != profile.edges.size()) {
+        return false;
+    }
+
+    F.setEntryCount(llvm::Function::ProfileCount(profile.calls, llvm::Function::PCT_Real));
+
+    llvm::MDBuilder MDB(F.getContext());
+    size_t first = 0;
+    for (auto * T : terminators) {
+        auto counts = llvm::ArrayRef<uint64_t>(profile.edges).slice(first, T->getNumSuccessors());
+        first += T->getNumSuccessors();
+
+        // never executed, keep whatever the frontend emitted
+        uint64_t max = *std::max_element(counts.begin(), counts.end());
+        if (max == 0) {
+            continue;
+        }
+        // branch weights are 32 bit
+        uint64_t scale = max / UINT32_MAX + 1;
+        llvm::SmallVector<uint32_t, 8> weights;
+        for (auto count : counts) {
+            weights.push_back(static_cast<uint32_t>(count / scale));
+        }
+        T->setMetadata(llvm::LLVMContext::MD_prof, MDB.createBranchWeights(weights));
+    }
+    return true;
+}
+
+void set_profile_summary(llvm::Module & M, llvm::ArrayRef<JIT::function_profile> profile) {
+    llvm::InstrProfSummaryBuilder builder(llvm::ProfileSummaryBuilder::DefaultCutoffs.vec());
+    for (auto & fn : profile) {
+        // the first counter of a record is the entry count
+        std::vector<uint64_t> counts = { fn.calls };
+        counts.insert(counts.end(), fn.edges.begin(), fn.edges.end());
+        builder.addRecord(llvm::InstrProfRecord(std::move(counts)));
+    }
+    M.setProfileSummary(builder.getSummary()->getMD(M.getContext()), llvm::ProfileSummary::PSK_Instr);
+}
+
+// one function per line: calls, edge count, edges, then the name which runs to
+// the end of the line.
+llvm::Error write_profile(llvm::StringRef file_name, llvm::ArrayRef<JIT::function_profile> profile) {
+    std::error_code EC;
+    llvm::raw_fd_ostream os(file_name, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        return llvm::createFileError(file_name, EC);
+    }
+    os << profile_header << "\n";
+    for (auto & fn : profile) {
+        os << fn.calls << " " << fn.edges.size();
+        for (auto count : fn.edges) {
+            os << " " << count;
+        }
+        os << " " << fn.name << "\n";
+    }
+    os.close();
+    if (os.has_error()) {
+        return llvm::createFileError(file_name, os.error());
+    }
+    return llvm::Error::success();
+}
+
+llvm::Expected<std::vector<JIT::function_profile>> read_profile(llvm::StringRef file_name) {
+    auto buffer = llvm::MemoryBuffer::getFile(file_name, /*IsText=*/true);
+    if (!buffer) {
+        return llvm::createFileError(file_name, buffer.getError());
+    }
+
+    auto malformed = [&](size_t line) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s:%zu: malformed profile", file_name.str().c_str(), line);
+    };
+
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+    if (lines.empty() || lines.front().rtrim() != profile_header) {
+        return malformed(1);
+    }
+
+    std::vector<JIT::function_profile> profile;
+    for (size_t i = 1; i < lines.size(); ++i) {
+        auto rest = lines[i].rtrim();
+        auto next = [&](uint64_t & value) {
+            llvm::StringRef field;
+            std::tie(field, rest) = rest.split(' ');
+            return !field.getAsInteger(10, value);
+        };
+
+        auto & fn = profile.emplace_back();
+        uint64_t edges = 0;
+        if (!next(fn.calls) || !next(edges)) {
+            return malformed(i + 1);
+        }
+        // every count takes a digit and a space, checked before sizing the
+        // vector from a number read from the file
+        if (edges > rest.size() / 2) {
+            return malformed(i + 1);
+        }
+        fn.edges.resize(edges);
+        for (auto & count : fn.edges) {
+            if (!next(count)) {
+                return malformed(i + 1);
+            }
+        }
+        if (rest.empty()) {
+            return malformed(i + 1);
+        }
+        fn.name = rest.str();
+    }
+    return profile;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+
+#include <atomic>
+#include <vector>
+
+// Edge profiling for compile_mode::pgo.
+//
+// Every conditional branch and switch of a tier 0 body counts the successor it
+// takes. The counter index is computed from the branch condition, so the CFG
+// is left untouched and the counters map back onto the same terminators of
+// the pristine copy when the function is recompiled.
+
+// number of edge counters instrument_edges needs for F
+size_t count_edges(llvm::Function & F);
+
+// count every taken successor into counters[0, count_edges(F))
+void instrument_edges(llvm::Function & F, std::atomic<uint64_t> * counters);
+
+// set the entry count and the branch weights of F from a profile collected by
+// instrument_edges on an identical body, returns false when the profile does
+// not match the body.
+bool apply_profile(llvm::Function & F, const JIT::function_profile & profile);
+
+// whole program summary, the inliner and codegen use it to tell hot from cold
+void set_profile_summary(llvm::Module & M, llvm::ArrayRef<JIT::function_profile> profile);
+
+llvm::Error write_profile(llvm::StringRef file_name, llvm::ArrayRef<JIT::function_profile> profile);
+llvm::Expected<std::vector<JIT::function_profile>> read_profile(llvm::StringRef file_name);
@@ -0,0 +1,528 @@
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/DebugInfo/DIContext.h>
+#include <llvm/DebugInfo/DWARF/DWARFContext.h>
+#include <llvm/DebugInfo/Symbolize/SymbolizableObjectFile.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Path.h>
+
+#include "jit_gdb.h"
+#include "jit_profiler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define JIT_PROFILER_SUPPORTED 1
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#endif
+
+// the profiler the signal handler records into, and handlers in flight
+static std::atomic<JIT::profiling_state *> active_profiler { nullptr };
+static std::atomic<int> handlers_running { 0 };
+
+#ifdef JIT_PROFILER_SUPPORTED
+static struct sigaction previous_action;
+
+// Stack of the thread, read outside the handler (pthread_getattr_np is not
+// async-signal-safe). Samples of threads where it is unknown keep their leaf
+// PC only. initial-exec so the handler's first access does not allocate.
+struct stack_range {
+    uint64_t low = 0;
+    uint64_t high = 0;
+};
+static thread_local stack_range thread_stack __attribute__((tls_model("initial-exec")));
+#endif
+
+void JIT::profiling_state::add_thread() {
+#ifdef JIT_PROFILER_SUPPORTED
+    if (thread_stack.high) {
+        return;
+    }
+    pthread_attr_t attributes;
+    if (pthread_getattr_np(pthread_self(), &attributes) != 0) {
+        return;
+    }
+    void * low = nullptr;
+    size_t size = 0;
+    if (pthread_attr_getstack(&attributes, &low, &size) == 0) {
+        thread_stack.low = reinterpret_cast<uint64_t>(low);
+        thread_stack.high = thread_stack.low + size;
+    }
+    pthread_attr_destroy(&attributes);
+#endif
+}
+
+#ifdef JIT_PROFILER_SUPPORTED
+
+static void on_sigprof(int, siginfo_t *, void * context) {
+    ++handlers_running;
+    if (auto * profiler = active_profiler.load()) {
+        int saved_errno = errno;
+        profiler->record(context);
+        errno = saved_errno;
+    }
+    --handlers_running;
+}
+#endif
+
+JIT::profiling_state::profiling_state(unsigned frequency, size_t capacity) :
+    frequency(frequency),
+    samples(std::make_unique<sample[]>(capacity)),
+    capacity(capacity)
+{}
+
+JIT::profiling_state::~profiling_state() {
+    stop();
+}
+
+llvm::Expected<std::unique_ptr<JIT::profiling_state>> JIT::profiling_state::start(unsigned frequency, size_t capacity) {
+#ifdef JIT_PROFILER_SUPPORTED
+    if (frequency == 0 || frequency > 1000000) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT profiling frequency must be between 1 and 1000000 Hz");
+    }
+    std::unique_ptr<profiling_state> profiler(new profiling_state(frequency, capacity));
+    add_thread();
+
+    JIT::profiling_state * expected = nullptr;
+    if (!active_profiler.compare_exchange_strong(expected, profiler.get())) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT profiler already running in this process");
+    }
+
+    struct sigaction action = {};
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_action) != 0) {
+        active_profiler = nullptr;
+        return llvm::errorCodeToError(std::error_code(errno, std::generic_category()));
+    }
+
+    struct itimerval timer = {};
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / frequency;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+        auto error = std::error_code(errno, std::generic_category());
+        sigaction(SIGPROF, &previous_action, nullptr);
+        active_profiler = nullptr;
+        return llvm::errorCodeToError(error);
+    }
+
+    profiler->running = true;
+    profiler->started = std::chrono::steady_clock::now();
+    return profiler;
+#else
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT profiling is only supported on Linux x86-64 and AArch64");
+#endif
+}
+
+void JIT::profiling_state::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    stopped = std::chrono::steady_clock::now();
+#ifdef JIT_PROFILER_SUPPORTED
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    active_profiler = nullptr;
+    // a handler that got in before the profiler was cleared finishes its
+    // sample, later ones see no profiler
+    while (handlers_running.load() != 0) {
+    }
+    sigaction(SIGPROF, &previous_action, nullptr);
+#endif
+}
+
+void JIT::profiling_state::record(void * context) {
+#ifdef JIT_PROFILER_SUPPORTED
+    auto index = next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= capacity) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    auto & S = samples[index];
+
+    auto & mcontext = static_cast<ucontext_t *>(context)->uc_mcontext;
+#if defined(__x86_64__)
+    uint64_t pc = mcontext.gregs[REG_RIP];
+    uint64_t fp = mcontext.gregs[REG_RBP];
+    uint64_t sp = mcontext.gregs[REG_RSP];
+#else
+    uint64_t pc = mcontext.pc;
+    uint64_t fp = mcontext.regs[29];
+    uint64_t sp = mcontext.sp;
+#endif
+
+    // [fp] is the caller's frame pointer and [fp + 8] the return address on
+    // both targets. Only walk up the stack of the interrupted thread, between
+    // sp and its top, frames are 16-byte aligned on both and callers sit at
+    // higher addresses, anything else is a frame without a frame pointer and
+    // ends the walk.
+    uint64_t low = std::max(thread_stack.low, sp);
+    uint64_t high = thread_stack.high;
+    uint32_t depth = 0;
+    S.pcs[depth++] = pc;
+    while (depth < max_frames && fp % 16 == 0 && fp >= low && high >= 16 && fp <= high - 16) {
+        auto * frame = reinterpret_cast<const uint64_t *>(fp);
+        uint64_t caller_fp = frame[0];
+        uint64_t return_address = frame[1];
+        if (return_address == 0) {
+            break;
+        }
+        S.pcs[depth++] = return_address;
+        if (caller_fp <= fp) {
+            break;
+        }
+        fp = caller_fp;
+    }
+    S.depth = depth;
+#endif
+}
+
+namespace {
+
+// one registered debug object and its executable sections
+struct jit_object {
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    std::unique_ptr<llvm::object::ObjectFile> file;
+    std::unique_ptr<llvm::symbolize::SymbolizableObjectFile> symbols;
+};
+
+struct location {
+    uint64_t address;
+    unsigned function;
+    unsigned line;
+};
+
+struct function {
+    std::string name;
+    std::string file;
+    bool jit;
+};
+
+// resolves the PCs of a profile, each distinct PC to one location
+class symbolizer {
+    std::vector<jit_object> objects;
+    // start, end and object of every executable section, by start
+    std::vector<std::tuple<uint64_t, uint64_t, size_t>> ranges;
+    llvm::DenseMap<uint64_t, unsigned> by_pc;
+    std::map<std::pair<std::string, std::string>, unsigned> by_function;
+
+    public:
+
+    std::vector<location> locations;
+    std::vector<function> functions;
+
+    symbolizer() {
+        for (auto & buffer : jit_gdb_copy_objects()) {
+            auto file = llvm::object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+            if (!file) {
+                llvm::consumeError(file.takeError());
+                continue;
+            }
+            auto symbols = llvm::symbolize::SymbolizableObjectFile::create(file->get(), llvm::DWARFContext::create(**file), false);
+            if (!symbols) {
+                llvm::consumeError(symbols.takeError());
+                continue;
+            }
+            for (auto & section : (*file)->sections()) {
+                if (section.isText() && section.getSize() > 0) {
+                    ranges.emplace_back(section.getAddress(), section.getAddress() + section.getSize(), objects.size());
+                }
+            }
+            objects.push_back({ std::move(buffer), std::move(*file), std::move(*symbols) });
+        }
+        llvm::sort(ranges);
+    }
+
+    // `return_address` PCs are looked up one byte back, inside the call
+    unsigned resolve(uint64_t pc, bool return_address) {
+        uint64_t address = return_address ? pc - 1 : pc;
+        auto it = by_pc.find(address);
+        if (it != by_pc.end()) {
+            return it->second;
+        }
+
+        std::string name, file;
+        unsigned line = 0;
+        bool jit = false;
+        auto range = llvm::upper_bound(ranges, address, [](uint64_t address, const auto & range) { return address < std::get<0>(range); });
+        if (range != ranges.begin() && address < std::get<1>(*std::prev(range))) {
+            auto & object = objects[std::get<2>(*std::prev(range))];
+            auto info = object.symbols->symbolizeCode(
+                { address, llvm::object::SectionedAddress::UndefSection },
+                llvm::DILineInfoSpecifier(llvm::DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath, llvm::DILineInfoSpecifier::FunctionNameKind::LinkageName),
+                true
+            );
+            if (info.FunctionName != llvm::DILineInfo::BadString) {
+                name = info.FunctionName;
+            }
+            if (info.FileName != llvm::DILineInfo::BadString) {
+                file = info.FileName;
+            }
+            line = info.Line;
+            jit = true;
+        }
+#ifdef JIT_PROFILER_SUPPORTED
+        if (!jit) {
+            Dl_info info;
+            if (dladdr(reinterpret_cast<void *>(address), &info) && info.dli_sname) {
+                name = info.dli_sname;
+            }
+        }
+#endif
+        if (name.empty()) {
+            llvm::raw_string_ostream(name) << llvm::format_hex(address, 2);
+        }
+
+        auto [function_it, added] = by_function.try_emplace({ name, file }, functions.size());
+        if (added) {
+            functions.push_back({ name, file, jit });
+        }
+        unsigned index = locations.size();
+        locations.push_back({ address, function_it->second, line });
+        by_pc[address] = index;
+        return index;
+    }
+};
+
+// the samples of a profile as location indices, leaf first
+std::vector<std::vector<unsigned>> resolve_samples(JIT::profiling_state & profiler, symbolizer & symbols) {
+    std::vector<std::vector<unsigned>> stacks;
+    size_t count = std::min(profiler.next.load(), profiler.capacity);
+    stacks.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto & S = profiler.samples[i];
+        std::vector<unsigned> stack;
+        for (uint32_t depth = 0; depth < S.depth; ++depth) {
+            stack.push_back(symbols.resolve(S.pcs[depth], depth > 0));
+        }
+        if (!stack.empty()) {
+            stacks.push_back(std::move(stack));
+        }
+    }
+    return stacks;
+}
+
+auto count_format(uint64_t count) {
+    return llvm::format("%9llu", static_cast<unsigned long long>(count));
+}
+
+std::string function_label(const function & F) {
+    if (F.file.empty()) {
+        return F.name;
+    }
+    return F.name + " (" + llvm::sys::path::filename(F.file).str() + ")";
+}
+
+// appends protobuf wire format
+class proto_writer {
+    public:
+
+    std::string out;
+
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+    void integer(unsigned field, uint64_t value) {
+        varint(field << 3);
+        varint(value);
+    }
+    void bytes(unsigned field, llvm::StringRef value) {
+        varint(field << 3 | 2);
+        varint(value.size());
+        out.append(value.begin(), value.end());
+    }
+    void packed(unsigned field, llvm::ArrayRef<uint64_t> values) {
+        proto_writer packed;
+        for (auto value : values) {
+            packed.varint(value);
+        }
+        bytes(field, packed.out);
+    }
+};
+
+} // namespace
+
+void JIT::profiling_state::write_report(llvm::raw_ostream & os) {
+    symbolizer symbols;
+    auto stacks = resolve_samples(*this, symbols);
+    auto & functions = symbols.functions;
+    auto & locations = symbols.locations;
+
+    std::vector<uint64_t> self(functions.size()), total(functions.size());
+    std::map<std::pair<unsigned, unsigned>, uint64_t> lines;
+    std::map<std::pair<unsigned, unsigned>, uint64_t> calls;
+    uint64_t in_jit = 0;
+    for (auto & stack : stacks) {
+        auto & leaf = locations[stack.front()];
+        ++self[leaf.function];
+        if (functions[leaf.function].jit) {
+            ++in_jit;
+            ++lines[{ leaf.function, leaf.line }];
+        }
+        // recursion counts once towards the total
+        std::vector<unsigned> seen;
+        for (size_t i = 0; i < stack.size(); ++i) {
+            unsigned F = locations[stack[i]].function;
+            if (!llvm::is_contained(seen, F)) {
+                seen.push_back(F);
+                ++total[F];
+            }
+            if (i + 1 < stack.size()) {
+                ++calls[{ locations[stack[i + 1]].function, F }];
+            }
+        }
+    }
+
+    auto percent = [&](uint64_t count) {
+        return llvm::format("%5.1f%%", stacks.empty() ? 0.0 : 100.0 * count / stacks.size());
+    };
+    auto seconds = std::chrono::duration<double>(stopped - started).count();
+
+    os << "JIT profile: " << stacks.size() << " samples at " << frequency << " Hz over " << llvm::format("%.2f", seconds) << "s, "
+       << in_jit << " in JIT'd code, " << dropped.load() << " dropped\n";
+
+    std::vector<unsigned> order(functions.size());
+    for (unsigned i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    llvm::sort(order, [&](unsigned a, unsigned b) { return self[a] != self[b] ? self[a] > self[b] : total[a] > total[b]; });
+
+    os << "\nflat profile of JIT'd functions\n";
+    os << "     self  self%     total total%  function\n";
+    for (unsigned F : order) {
+        if (!functions[F].jit || total[F] == 0) {
+            continue;
+        }
+        os << count_format(self[F]) << " " << percent(self[F]) << " "
+           << count_format(total[F]) << " " << percent(total[F]) << "  " << function_label(functions[F]) << "\n";
+    }
+    os << count_format(stacks.size() - in_jit) << " " << percent(stacks.size() - in_jit) << "  outside JIT'd code\n";
+
+    os << "\nhot lines of JIT'd code\n";
+    os << "     self  self%  location\n";
+    std::vector<std::pair<std::pair<unsigned, unsigned>, uint64_t>> hot(lines.begin(), lines.end());
+    llvm::sort(hot, [](const auto & a, const auto & b) { return a.second > b.second; });
+    for (auto & [key, count] : hot) {
+        auto & F = functions[key.first];
+        os << count_format(count) << " " << percent(count) << "  "
+           << (F.file.empty() ? "??" : llvm::sys::path::filename(F.file).str()) << ":" << key.second << "  " << F.name << "\n";
+    }
+
+    os << "\ncall graph of JIT'd functions\n";
+    llvm::sort(order, [&](unsigned a, unsigned b) { return total[a] > total[b]; });
+    for (unsigned F : order) {
+        if (!functions[F].jit || total[F] == 0) {
+            continue;
+        }
+        os << function_label(functions[F]) << "  total " << total[F] << ", self " << self[F] << "\n";
+        for (auto & [edge, count] : calls) {
+            if (edge.second == F) {
+                os << "    called by  " << count_format(count) << "  " << function_label(functions[edge.first]) << "\n";
+            }
+        }
+        for (auto & [edge, count] : calls) {
+            if (edge.first == F) {
+                os << "    calls      " << count_format(count) << "  " << function_label(functions[edge.second]) << "\n";
+            }
+        }
+    }
+}
+
+llvm::Error JIT::profiling_state::write_pprof(llvm::StringRef file_name) {
+    symbolizer symbols;
+    auto stacks = resolve_samples(*this, symbols);
+
+    std::vector<std::string> strings { "" };
+    llvm::StringMap<uint64_t> string_ids;
+    auto string_id = [&](llvm::StringRef value) -> uint64_t {
+        if (value.empty()) {
+            return 0;
+        }
+        auto [it, added] = string_ids.try_emplace(value, strings.size());
+        if (added) {
+            strings.push_back(value.str());
+        }
+        return it->second;
+    };
+
+    uint64_t period = 1000000000ull / frequency;
+    proto_writer profile;
+    auto value_type = [&](unsigned field, llvm::StringRef type, llvm::StringRef unit) {
+        proto_writer VT;
+        VT.integer(1, string_id(type));
+        VT.integer(2, string_id(unit));
+        profile.bytes(field, VT.out);
+    };
+    value_type(1, "samples", "count");
+    value_type(1, "cpu", "nanoseconds");
+
+    // ids are indices + 1, 0 means unset in profile.proto
+    for (auto & stack : stacks) {
+        proto_writer S;
+        std::vector<uint64_t> ids;
+        for (unsigned L : stack) {
+            ids.push_back(L + 1);
+        }
+        S.packed(1, ids);
+        S.packed(2, { 1, period });
+        profile.bytes(2, S.out);
+    }
+    for (unsigned i = 0; i < symbols.locations.size(); ++i) {
+        auto & L = symbols.locations[i];
+        proto_writer line;
+        line.integer(1, L.function + 1);
+        line.integer(2, L.line);
+        proto_writer location;
+        location.integer(1, i + 1);
+        location.integer(3, L.address);
+        location.bytes(4, line.out);
+        profile.bytes(4, location.out);
+    }
+    for (unsigned i = 0; i < symbols.functions.size(); ++i) {
+        auto & F = symbols.functions[i];
+        proto_writer function;
+        function.integer(1, i + 1);
+        function.integer(2, string_id(F.name));
+        function.integer(3, string_id(F.name));
+        function.integer(4, string_id(F.file));
+        profile.bytes(5, function.out);
+    }
+    profile.integer(10, std::chrono::duration_cast<std::chrono::nanoseconds>(stopped - started).count());
+    value_type(11, "cpu", "nanoseconds");
+    profile.integer(12, period);
+    // the string table last, every string is interned by now
+    for (auto & value : strings) {
+        profile.bytes(6, value);
+    }
+
+    std::error_code EC;
+    llvm::raw_fd_ostream out(file_name, EC, llvm::sys::fs::OF_None);
+    if (EC) {
+        return llvm::createFileError(file_name, EC);
+    }
+    out << profile.out;
+    out.close();
+    if (out.has_error()) {
+        return llvm::createFileError(file_name, out.error());
+    }
+    return llvm::Error::success();
+}
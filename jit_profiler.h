@@ -0,0 +1,69 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/Support/Error.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+// Sampling profiler, Linux on x86-64 and AArch64.
+//
+// An ITIMER_PROF timer sends SIGPROF to whichever thread is burning CPU. The
+// handler records the interrupted PC and the return addresses found by walking
+// the frame pointer chain into a preallocated buffer, without locks or
+// allocation. JIT'd code needs options.frame_pointers for callers beyond the
+// leaf to show up, and the walk stays within the thread's stack, known for
+// the thread that started profiling, threads that called JIT::lookup and
+// those that called JIT::profile_thread.
+//
+// Samples are resolved when profiling stops, through the symbol tables and
+// DWARF of the debug objects registered with the GDB JIT interface (JITLink
+// with debug support, or the RTDyld GDB listener), so only code whose objects
+// are still registered at that point is attributed. Other PCs are named with
+// dladdr where possible.
+struct JIT::profiling_state {
+    static constexpr unsigned max_frames = 32;
+
+    struct sample {
+        uint32_t depth = 0;
+        // leaf first, return addresses after it
+        uint64_t pcs[max_frames];
+    };
+
+    unsigned frequency;
+    std::unique_ptr<sample[]> samples;
+    size_t capacity;
+    std::atomic<size_t> next { 0 };
+    std::atomic<uint64_t> dropped { 0 };
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point stopped;
+
+    // installs the handler and arms the timer, one profiler per process
+    static llvm::Expected<std::unique_ptr<profiling_state>> start(unsigned frequency, size_t capacity);
+    ~profiling_state();
+
+    // disarms the timer and waits for handlers still running
+    void stop();
+
+    // flat profile, hot lines and call graph
+    void write_report(llvm::raw_ostream & os);
+    // pprof profile.proto, uncompressed (pprof accepts it as is)
+    llvm::Error write_pprof(llvm::StringRef file_name);
+
+    // called from the signal handler
+    void record(void * context);
+
+    // reads the stack bounds of the calling thread, once per thread, which
+    // the handler needs to walk its frames
+    static void add_thread();
+
+    private:
+
+    profiling_state(unsigned frequency, size_t capacity);
+
+    bool running = false;
+};
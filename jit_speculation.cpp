@@ -0,0 +1,188 @@
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit_log.h"
+#include "jit_speculation.h"
+
+JIT::speculation_state::speculation_state(JIT & owner) :
+    owner(owner)
+{
+    worker = std::thread([this] { run_worker(); });
+}
+
+JIT::speculation_state::~speculation_state() {
+    stop();
+}
+
+void JIT::speculation_state::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void JIT::speculation_state::request(llvm::StringRef name, unsigned depth) {
+    if (requested.count(name)) {
+        return;
+    }
+    requested[name] = { depth, status::queued };
+    queue.push_back(name.str());
+}
+
+void JIT::speculation_state::on_compile(llvm::Module & M) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto & F : M) {
+            if (F.isDeclaration()) {
+                continue;
+            }
+
+            // a function whose lookup was not started by the worker yet is
+            // compiled because it was called.
+            unsigned depth = 0;
+            auto it = requested.find(F.getName());
+            if (it != requested.end() && it->second.state == status::started) {
+                depth = it->second.depth;
+            } else {
+                requested[F.getName()] = { 0, status::started };
+                trace.push_back(F.getName().str());
+            }
+            if (depth >= owner.opts.speculation_depth) {
+                continue;
+            }
+
+            // the other functions of the module are declarations in the
+            // partition, the worker ignores names the JIT does not define.
+            for (auto & I : llvm::instructions(F)) {
+                auto * call = llvm::dyn_cast<llvm::CallBase>(&I);
+                auto * callee = call ? call->getCalledFunction() : nullptr;
+                if (callee && callee->isDeclaration() && !callee->isIntrinsic()) {
+                    request(callee->getName(), depth + 1);
+                }
+            }
+            if (auto next = trace_next.find(F.getName()); next != trace_next.end()) {
+                for (auto & name : next->second) {
+                    request(name, depth + 1);
+                }
+            }
+        }
+    }
+    queue_cv.notify_one();
+}
+
+void JIT::speculation_state::run_worker() {
+    auto & ES = owner.jit->getExecutionSession();
+    auto impl_name = owner.jit->getMainJITDylib().getName() + ".impl";
+
+    while (true) {
+        std::vector<std::string> batch;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            queue_cv.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            while (!queue.empty()) {
+                auto & record = requested[queue.front()];
+                if (record.state == status::queued) {
+                    record.state = status::started;
+                    batch.push_back(std::move(queue.front()));
+                }
+                queue.pop_front();
+            }
+        }
+
+        // created by the CompileOnDemandLayer on the first lazy module
+        auto * impl = ES.getJITDylibByName(impl_name);
+        if (batch.empty() || !impl) {
+            continue;
+        }
+
+        llvm::orc::SymbolLookupSet symbols;
+        for (auto & name : batch) {
+            symbols.add(owner.jit->mangleAndIntern(name), llvm::orc::SymbolLookupFlags::WeaklyReferencedSymbol);
+        }
+        auto result = ES.lookup(llvm::orc::makeJITDylibSearchOrder(impl, llvm::orc::JITDylibLookupFlags::MatchAllSymbols), std::move(symbols));
+        prune();
+        if (!result) {
+            llvm::logAllUnhandledErrors(result.takeError(), llvm::errs(), "JIT speculation failed: ");
+            continue;
+        }
+        speculated += result->size();
+        JIT_LOG(info, "JIT speculation: " + llvm::Twine(result->size()) + " functions compiled ahead of their first call.");
+    }
+}
+
+void JIT::speculation_state::prune() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (requested.size() <= max_requested) {
+        return;
+    }
+    // the batch just looked up went through on_compile, so no started
+    // request is waiting for its depth
+    for (auto it = requested.begin(); it != requested.end();) {
+        auto current = it++;
+        if (current->second.state == status::started) {
+            requested.erase(current);
+        }
+    }
+}
+
+std::vector<std::string> JIT::speculation_state::get_trace() {
+    std::lock_guard<std::mutex> guard(lock);
+    return trace;
+}
+
+void JIT::speculation_state::load_trace(const std::vector<std::string> & names) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < names.size(); ++i) {
+        auto & next = trace_next[names[i]];
+        for (size_t j = i + 1; j < names.size() && j <= i + trace_window; ++j) {
+            next.push_back(names[j]);
+        }
+    }
+}
+
+// one function name per line
+llvm::Error write_speculation_trace(llvm::StringRef file_name, llvm::ArrayRef<std::string> trace) {
+    std::error_code EC;
+    llvm::raw_fd_ostream os(file_name, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        return llvm::createFileError(file_name, EC);
+    }
+    for (auto & name : trace) {
+        os << name << "\n";
+    }
+    os.close();
+    if (os.has_error()) {
+        return llvm::createFileError(file_name, os.error());
+    }
+    return llvm::Error::success();
+}
+
+llvm::Expected<std::vector<std::string>> read_speculation_trace(llvm::StringRef file_name) {
+    auto buffer = llvm::MemoryBuffer::getFile(file_name, /*IsText=*/true);
+    if (!buffer) {
+        return llvm::createFileError(file_name, buffer.getError());
+    }
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+
+    std::vector<std::string> trace;
+    for (auto line : lines) {
+        if (!line.rtrim().empty()) {
+            trace.push_back(line.rtrim().str());
+        }
+    }
+    return trace;
+}
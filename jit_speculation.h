@@ -0,0 +1,77 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/Module.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Speculative compilation for lazy mode.
+//
+// Every partition the lazy JIT compiles is reported to on_compile, which queues
+// the direct callees of its functions (and the functions that followed them in
+// a loaded trace) for a background thread. The thread looks them up in the
+// implementation JITDylib of the CompileOnDemandLayer, so they are compiled
+// before their lazy stubs are first called. Speculated functions queue their
+// own callees up to options::speculation_depth.
+struct JIT::speculation_state {
+    enum class status { queued, started };
+
+    struct request_record {
+        unsigned depth = 0;
+        status state = status::queued;
+    };
+
+    // functions compiled after a traced function that are speculated with it
+    static constexpr size_t trace_window = 4;
+    // past this many, the worker forgets the requests that were started. A
+    // callee requested again after that costs a lookup of code that is
+    // already there.
+    static constexpr size_t max_requested = 1 << 16;
+
+    JIT & owner;
+
+    // guards everything below up to the worker
+    std::mutex lock;
+    std::condition_variable queue_cv;
+    llvm::StringMap<request_record> requested;
+    std::deque<std::string> queue;
+    bool stopping = false;
+    // functions compiled on demand, in order
+    std::vector<std::string> trace;
+    // loaded trace, function -> functions compiled right after it
+    llvm::StringMap<std::vector<std::string>> trace_next;
+    std::thread worker;
+
+    std::atomic<size_t> speculated { 0 };
+
+    speculation_state(JIT & owner);
+    ~speculation_state();
+
+    // join the worker, speculation requests are queued but not run afterwards
+    void stop();
+
+    // called by the compile stage with the context lock held
+    void on_compile(llvm::Module & M);
+
+    std::vector<std::string> get_trace();
+    void load_trace(const std::vector<std::string> & names);
+
+    private:
+
+    // lock held
+    void request(llvm::StringRef name, unsigned depth);
+    void run_worker();
+    // worker, between lookups
+    void prune();
+};
+
+llvm::Error write_speculation_trace(llvm::StringRef file_name, llvm::ArrayRef<std::string> trace);
+llvm::Expected<std::vector<std::string>> read_speculation_trace(llvm::StringRef file_name);
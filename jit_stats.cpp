@@ -0,0 +1,298 @@
+#include <llvm/ExecutionEngine/JITLink/JITLink.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MathExtras.h>
+
+#include "jit_object_cache.h"
+#include "jit_stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <iterator>
+
+static const char * object_buffer_suffix = "-jitted-objectbuffer";
+
+static uint64_t thread_cpu_ns() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    auto ticks = [](FILETIME t) {
+        return (static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime;
+    };
+    // 100 ns units
+    return (ticks(kernel) + ticks(user)) * 100;
+#else
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// SimpleCompiler names the object after its module
+static llvm::StringRef module_of_object(llvm::StringRef name) {
+    name.consume_back(object_buffer_suffix);
+    return name;
+}
+
+const char * JIT::pipeline_stage_name(pipeline_stage stage) {
+    switch (stage) {
+        case pipeline_stage::parse: return "parse";
+        case pipeline_stage::verify: return "verify";
+        case pipeline_stage::optimize: return "optimize";
+        case pipeline_stage::codegen: return "codegen";
+        case pipeline_stage::link: return "link";
+        case pipeline_stage::finalize: return "finalize";
+        case pipeline_stage::eh_frame: return "eh_frame";
+        case pipeline_stage::debug_registration: return "debug_registration";
+    }
+    llvm_unreachable("unknown JIT::pipeline_stage");
+}
+
+jit_stats::timestamp jit_stats::timestamp::now() {
+    timestamp t;
+    t.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    t.cpu_ns = thread_cpu_ns();
+    t.thread = std::this_thread::get_id();
+    return t;
+}
+
+jit_stats::timer::timer(jit_stats * stats, stage s, llvm::StringRef module) : stats(stats), s(s) {
+    if (stats) {
+        this->module = module.str();
+        start = timestamp::now();
+    }
+}
+
+jit_stats::timer::~timer() {
+    if (stats) {
+        stats->record(s, module, start, timestamp::now());
+    }
+}
+
+void jit_stats::record(stage s, llvm::StringRef module, const timestamp & start, const timestamp & end) {
+    uint64_t wall = end.wall_ns > start.wall_ns ? end.wall_ns - start.wall_ns : 0;
+    uint64_t cpu = start.thread == end.thread && end.cpu_ns > start.cpu_ns ? end.cpu_ns - start.cpu_ns : 0;
+
+    if (trace) {
+        trace->complete(JIT::pipeline_stage_name(s), module, start.wall_ns, end.wall_ns);
+    }
+
+    auto & counters = stages[static_cast<size_t>(s)];
+    counters.count.fetch_add(1, std::memory_order_relaxed);
+    counters.wall_ns.fetch_add(wall, std::memory_order_relaxed);
+    counters.cpu_ns.fetch_add(cpu, std::memory_order_relaxed);
+    auto max = counters.max_wall_ns.load(std::memory_order_relaxed);
+    while (wall > max && !counters.max_wall_ns.compare_exchange_weak(max, wall, std::memory_order_relaxed)) {
+    }
+    uint64_t us = wall / 1000;
+    size_t bucket = us ? std::min<size_t>(llvm::Log2_64(us), counters.wall_us_log2.size() - 1) : 0;
+    counters.wall_us_log2[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(modules_lock);
+    auto & time = modules[module.str()][static_cast<size_t>(s)];
+    time.count += 1;
+    time.wall_ns += wall;
+    time.cpu_ns += cpu;
+}
+
+void jit_stats::object_received(const llvm::MemoryBuffer & object) {
+    std::lock_guard<std::mutex> guard(objects_lock);
+    objects[&object] = timestamp::now();
+}
+
+void jit_stats::object_emitted(const llvm::MemoryBuffer & object) {
+    auto end = timestamp::now();
+    timestamp start;
+    {
+        std::lock_guard<std::mutex> guard(objects_lock);
+        auto it = objects.find(&object);
+        if (it == objects.end()) {
+            return;
+        }
+        start = it->second;
+        objects.erase(it);
+    }
+    record(stage::link, module_of_object(object.getBufferIdentifier()), start, end);
+
+    // RTDyld has applied every relocation of the object by now
+    auto obj = llvm::object::ObjectFile::createObjectFile(object.getMemBufferRef());
+    if (!obj) {
+        llvm::consumeError(obj.takeError());
+        return;
+    }
+    uint64_t count = 0;
+    for (auto & Sec : (*obj)->sections()) {
+        count += std::distance(Sec.relocation_begin(), Sec.relocation_end());
+    }
+    relocations.fetch_add(count, std::memory_order_relaxed);
+}
+
+JIT::pipeline_stats jit_stats::snapshot() {
+    JIT::pipeline_stats stats;
+    for (size_t i = 0; i < JIT::num_pipeline_stages; ++i) {
+        auto & counters = stages[i];
+        auto & out = stats.stages[i];
+        out.total.count = counters.count.load(std::memory_order_relaxed);
+        out.total.wall_ns = counters.wall_ns.load(std::memory_order_relaxed);
+        out.total.cpu_ns = counters.cpu_ns.load(std::memory_order_relaxed);
+        out.max_wall_ns = counters.max_wall_ns.load(std::memory_order_relaxed);
+        for (size_t b = 0; b < out.wall_us_log2.size(); ++b) {
+            out.wall_us_log2[b] = counters.wall_us_log2[b].load(std::memory_order_relaxed);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(modules_lock);
+        stats.modules = modules;
+    }
+    stats.functions = functions.load(std::memory_order_relaxed);
+    stats.relocations = relocations.load(std::memory_order_relaxed);
+    stats.stubs = stubs.load(std::memory_order_relaxed);
+    stats.object_bytes = object_bytes.load(std::memory_order_relaxed);
+    if (object_cache) {
+        stats.object_cache_hits = object_cache->hits.load(std::memory_order_relaxed);
+        stats.object_cache_misses = object_cache->misses.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+// upper bound of the histogram bucket holding the given fraction of the runs
+static uint64_t percentile_us(const JIT::stage_stats & stats, double fraction) {
+    uint64_t target = static_cast<uint64_t>(fraction * stats.total.count);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < stats.wall_us_log2.size(); ++b) {
+        seen += stats.wall_us_log2[b];
+        if (seen > target || seen == stats.total.count) {
+            return 2ull << b;
+        }
+    }
+    return 0;
+}
+
+void jit_stats::dump(llvm::raw_ostream & os) {
+    auto stats = snapshot();
+    auto ms = [](uint64_t ns) { return llvm::format("%10.3f", ns / 1e6); };
+
+    os << "--- JIT pipeline stats START ---\n";
+    os << "stage                   count    wall ms     cpu ms    mean us   p50 us <   p99 us <     max us\n";
+    for (size_t i = 0; i < JIT::num_pipeline_stages; ++i) {
+        auto & stage = stats.stages[i];
+        if (stage.total.count == 0) {
+            continue;
+        }
+        os << llvm::format("%-20s %8llu ", JIT::pipeline_stage_name(static_cast<JIT::pipeline_stage>(i)), static_cast<unsigned long long>(stage.total.count))
+           << ms(stage.total.wall_ns) << " " << ms(stage.total.cpu_ns) << " "
+           << llvm::format("%10llu %10llu %10llu %10llu\n",
+                  static_cast<unsigned long long>(stage.total.wall_ns / stage.total.count / 1000),
+                  static_cast<unsigned long long>(percentile_us(stage, 0.5)),
+                  static_cast<unsigned long long>(percentile_us(stage, 0.99)),
+                  static_cast<unsigned long long>(stage.max_wall_ns / 1000));
+    }
+    os << "functions " << stats.functions << ", relocations " << stats.relocations << ", stubs " << stats.stubs << ", object bytes " << stats.object_bytes << "\n";
+    if (object_cache) {
+        os << "object cache hits " << stats.object_cache_hits << ", misses " << stats.object_cache_misses << "\n";
+    }
+
+    os << "wall ms per module:\n";
+    for (auto & [module, times] : stats.modules) {
+        os << "  " << module << ":";
+        for (size_t i = 0; i < JIT::num_pipeline_stages; ++i) {
+            if (times[i].count) {
+                os << " " << JIT::pipeline_stage_name(static_cast<JIT::pipeline_stage>(i)) << " " << llvm::format("%.3f", times[i].wall_ns / 1e6);
+            }
+        }
+        os << "\n";
+    }
+    os << "--- JIT pipeline stats END ---\n";
+}
+
+void jit_stats::plugin::modifyPassConfig(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::PassConfiguration & Config) {
+    if (where != position::first) {
+        return;
+    }
+    {
+        // the graph was just built from the object, linking starts here
+        std::lock_guard<std::mutex> guard(stats.links_lock);
+        stats.links[&MR] = { module_of_object(G.getName()).str(), timestamp::now() };
+    }
+    Config.PostFixupPasses.push_back([this, &MR](llvm::jitlink::LinkGraph & G) {
+        uint64_t count = 0;
+        for (auto * B : G.blocks()) {
+            count += B->edges_size();
+        }
+        stats.relocations.fetch_add(count, std::memory_order_relaxed);
+
+        auto now = timestamp::now();
+        link_record link;
+        {
+            std::lock_guard<std::mutex> guard(stats.links_lock);
+            auto it = stats.links.find(&MR);
+            if (it == stats.links.end()) {
+                return llvm::Error::success();
+            }
+            link = it->second;
+            it->second.mark = now;
+        }
+        stats.record(stage::link, link.module, link.mark, now);
+        return llvm::Error::success();
+    });
+}
+
+llvm::Error jit_stats::plugin::notifyEmitted(llvm::orc::MaterializationResponsibility & MR) {
+    auto now = timestamp::now();
+    link_record link;
+    {
+        std::lock_guard<std::mutex> guard(stats.links_lock);
+        auto it = stats.links.find(&MR);
+        if (it == stats.links.end()) {
+            return llvm::Error::success();
+        }
+        link = it->second;
+        if (where == position::last) {
+            stats.links.erase(it);
+        } else {
+            it->second.mark = now;
+        }
+    }
+    switch (where) {
+        case position::first:
+            stats.record(stage::finalize, link.module, link.mark, now);
+            break;
+        case position::after_eh_frame:
+            stats.record(stage::eh_frame, link.module, link.mark, now);
+            break;
+        case position::last:
+            stats.record(stage::debug_registration, link.module, link.mark, now);
+            break;
+    }
+    return llvm::Error::success();
+}
+
+llvm::Error jit_stats::plugin::notifyFailed(llvm::orc::MaterializationResponsibility & MR) {
+    std::lock_guard<std::mutex> guard(stats.links_lock);
+    stats.links.erase(&MR);
+    return llvm::Error::success();
+}
+
+llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> jit_stats::compiler::operator()(llvm::Module & M) {
+    uint64_t count = 0;
+    for (auto & F : M) {
+        if (!F.isDeclaration()) {
+            ++count;
+        }
+    }
+    stats.functions.fetch_add(count, std::memory_order_relaxed);
+
+    auto object = [&] {
+        timer T(&stats, stage::codegen, M.getModuleIdentifier());
+        return (*inner)(M);
+    }();
+    if (object) {
+        stats.object_bytes.fetch_add((*object)->getBufferSize(), std::memory_order_relaxed);
+    }
+    return object;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "jit.h"
+#include "jit_trace.h"
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class jit_object_cache;
+
+// Wall and CPU time of each compile pipeline stage, see JIT::stats.
+//
+// Parse, verify and optimize are timed in place, codegen by a wrapper around
+// the compiler of the IR compile layer. JITLink stages are split by three
+// plugins: the first one times the link graph passes and, when the object is
+// emitted, finalization up to the first notifyEmitted, the one after the EH
+// frame plugin times its registration and the last one (added after every
+// debug plugin) the debug object registration. RTDyld is timed as a single
+// link stage, from the object entering the object layer to its emission.
+class jit_stats {
+    public:
+
+    using stage = JIT::pipeline_stage;
+
+    // every recorded stage is also a span of `trace` when set, the hits and
+    // misses of `object_cache` are reported with the counts when set
+    jit_stats(jit_trace * trace, const jit_object_cache * object_cache = nullptr) : trace(trace), object_cache(object_cache) {}
+
+    struct timestamp {
+        uint64_t wall_ns = 0;
+        uint64_t cpu_ns = 0;
+        std::thread::id thread;
+
+        static timestamp now();
+    };
+
+    // records the enclosing scope, a null stats records nothing
+    class timer {
+        jit_stats * stats;
+        stage s;
+        std::string module;
+        timestamp start;
+
+        public:
+
+        timer(jit_stats * stats, stage s, llvm::StringRef module);
+        ~timer();
+    };
+
+    class plugin;
+    class compiler;
+
+    std::atomic<uint64_t> functions { 0 };
+    std::atomic<uint64_t> relocations { 0 };
+    std::atomic<uint64_t> stubs { 0 };
+    std::atomic<uint64_t> object_bytes { 0 };
+
+    // CPU time only counts when both ends were taken on the same thread
+    void record(stage s, llvm::StringRef module, const timestamp & start, const timestamp & end);
+
+    // RTDyld link stage, keyed by the object buffer that travels from the
+    // object transform layer to the emitted notification
+    void object_received(const llvm::MemoryBuffer & object);
+    void object_emitted(const llvm::MemoryBuffer & object);
+
+    JIT::pipeline_stats snapshot();
+    void dump(llvm::raw_ostream & os);
+
+    private:
+
+    jit_trace * trace;
+    const jit_object_cache * object_cache;
+
+    struct stage_counters {
+        std::atomic<uint64_t> count { 0 };
+        std::atomic<uint64_t> wall_ns { 0 };
+        std::atomic<uint64_t> cpu_ns { 0 };
+        std::atomic<uint64_t> max_wall_ns { 0 };
+        std::array<std::atomic<uint64_t>, 32> wall_us_log2 {};
+    };
+    std::array<stage_counters, JIT::num_pipeline_stages> stages;
+
+    std::mutex modules_lock;
+    std::map<std::string, std::array<JIT::stage_time, JIT::num_pipeline_stages>> modules;
+
+    // objects in flight through the RTDyld layer
+    std::mutex objects_lock;
+    llvm::DenseMap<const llvm::MemoryBuffer *, timestamp> objects;
+
+    // link graphs in flight through the JITLink layer
+    struct link_record {
+        std::string module;
+        // end of the previous stage
+        timestamp mark;
+    };
+    std::mutex links_lock;
+    llvm::DenseMap<llvm::orc::MaterializationResponsibility *, link_record> links;
+
+    friend class plugin;
+};
+
+class jit_stats::plugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+    public:
+
+    enum class position {
+        // before every other plugin
+        first,
+        // right after the EHFrameRegistrationPlugin
+        after_eh_frame,
+        // after every debug plugin
+        last,
+    };
+
+    plugin(jit_stats & stats, position where) : stats(stats), where(where) {}
+
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility & MR, llvm::jitlink::LinkGraph & G, llvm::jitlink::PassConfiguration & Config) override;
+    llvm::Error notifyEmitted(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility & MR) override;
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey K) override { return llvm::Error::success(); }
+    void notifyTransferringResources(llvm::orc::JITDylib & JD, llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) override {}
+
+    private:
+
+    jit_stats & stats;
+    position where;
+};
+
+// times the wrapped compiler and counts the functions and object bytes it
+// produces
+class jit_stats::compiler : public llvm::orc::IRCompileLayer::IRCompiler {
+    jit_stats & stats;
+    std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler> inner;
+
+    public:
+
+    compiler(jit_stats & stats, std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler> inner) :
+        IRCompiler(inner->getManglingOptions()), stats(stats), inner(std::move(inner)) {}
+
+    llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(llvm::Module & M) override;
+};
@@ -0,0 +1,441 @@
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+#include "jit_log.h"
+#include "jit_pgo.h"
+#include "jit_stats.h"
+#include "jit_tiered.h"
+
+#include <algorithm>
+
+static std::string tier_name(unsigned tier, unsigned module_id, llvm::StringRef name) {
+    return ("__jit_tier" + llvm::Twine(tier) + "." + llvm::Twine(module_id) + "." + name).str();
+}
+
+static bool is_tierable(const llvm::Function & F) {
+    return !F.isDeclaration()
+        && !F.isIntrinsic()
+        && !F.hasAvailableExternallyLinkage()
+        && !F.hasFnAttribute(llvm::Attribute::Naked);
+}
+
+static void on_tier_up(JIT::tiered_state::function_record * fn) {
+    fn->module->state->request_tier_up(*fn);
+}
+
+// insert `if (fn.calls++ == threshold - 1) on_tier_up(&fn)` after the allocas
+// of the entry block (only the increment for a 0 threshold), the records live
+// in the host process so their addresses are baked into the IR as constants.
+static void inject_call_counter(llvm::Function & F, JIT::tiered_state::function_record & fn, uint64_t threshold) {
+    auto & Ctx = F.getContext();
+    auto * PtrTy = llvm::PointerType::getUnqual(Ctx);
+
+    auto & Entry = F.getEntryBlock();
+    auto IP = Entry.begin();
+    while (llvm::isa<llvm::AllocaInst>(*IP)) {
+        ++IP;
+    }
+
+    llvm::IRBuilder<> B(&Entry, IP);
+    auto * counter = B.CreateIntToPtr(B.getInt64(reinterpret_cast<uintptr_t>(&fn.calls)), PtrTy);
+    auto * old = B.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, B.getInt64(1), llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+    if (threshold == 0) {
+        return;
+    }
+    auto * hit = llvm::cast<llvm::Instruction>(B.CreateICmpEQ(old, B.getInt64(threshold - 1)));
+
+    auto * weights = llvm::MDBuilder(Ctx).createBranchWeights(1, static_cast<uint32_t>(std::min<uint64_t>(threshold, UINT32_MAX)));
+    auto * then = llvm::SplitBlockAndInsertIfThen(hit, hit->getNextNode(), false, weights);
+
+    llvm::IRBuilder<> T(then);
+    auto * callback_ty = llvm::FunctionType::get(T.getVoidTy(), { PtrTy }, false);
+    auto * callback = T.CreateIntToPtr(T.getInt64(reinterpret_cast<uintptr_t>(&on_tier_up)), PtrTy);
+    T.CreateCall(callback_ty, callback, { T.CreateIntToPtr(T.getInt64(reinterpret_cast<uintptr_t>(&fn)), PtrTy) });
+}
+
+static void erase_global_ctors_dtors(llvm::Module & M) {
+    for (auto * name : { "llvm.global_ctors", "llvm.global_dtors" }) {
+        if (auto * GV = M.getNamedGlobal(name)) {
+            GV->eraseFromParent();
+        }
+    }
+}
+
+// give the public declaration of a callee the body of its tier 0 function as
+// an available_externally definition, the inliner may use it while calls that
+// are not inlined still go through the stub.
+static void provide_callee_body(llvm::Module & M, const JIT::tiered_state::function_record & fn) {
+    auto * decl = M.getFunction(fn.name);
+    auto * body = M.getFunction(fn.tier0_name);
+    if (!decl || !body || !decl->isDeclaration() || body->isDeclaration() || !body->use_empty()) {
+        return;
+    }
+    apply_profile(*body, fn.snapshot());
+
+    for (auto [from, to] : llvm::zip(body->args(), decl->args())) {
+        from.replaceAllUsesWith(&to);
+    }
+    decl->splice(decl->end(), body);
+    decl->copyMetadata(body, 0);
+    if (body->hasPersonalityFn()) {
+        decl->setPersonalityFn(body->getPersonalityFn());
+    }
+    decl->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+    body->eraseFromParent();
+}
+
+JIT::function_profile JIT::tiered_state::function_record::snapshot() const {
+    JIT::function_profile profile;
+    profile.name = name;
+    profile.calls = calls.load(std::memory_order_relaxed);
+    profile.edges.reserve(num_edges);
+    for (size_t i = 0; i < num_edges; ++i) {
+        profile.edges.push_back(edges[i].load(std::memory_order_relaxed));
+    }
+    return profile;
+}
+
+JIT::tiered_state::tiered_state(JIT & owner) :
+    owner(owner),
+    pgo(owner.opts.mode == compile_mode::pgo),
+    make_stubs(llvm::orc::createLocalIndirectStubsManagerBuilder(owner.jit->getTargetTriple()))
+{
+    worker = std::thread([this] { run_worker(); });
+}
+
+JIT::tiered_state::~tiered_state() {
+    stop();
+}
+
+void JIT::tiered_state::stop() {
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+llvm::Error JIT::tiered_state::add(llvm::orc::ThreadSafeModule && module, llvm::orc::ResourceTrackerSP tracker) {
+    auto record = std::make_unique<module_record>();
+    auto & mod = *record;
+    mod.state = this;
+    mod.tracker = tracker;
+    mod.stubs = make_stubs();
+
+    llvm::orc::IndirectStubsManager::StubInitsMap stub_inits;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        mod.id = next_module_id++;
+
+        auto Err = module.withModuleDo([&](llvm::Module & M) -> llvm::Error {
+            // bodies are rewritten below, lazily loaded bitcode has to be read
+            if (auto Err = M.materializeAll()) {
+                return Err;
+            }
+
+            // give internal symbols unique external names, the tier-up clone
+            // references them from another module.
+            promote(M);
+
+            std::vector<llvm::Function *> bodies;
+            for (auto & F : M) {
+                if (is_tierable(F)) {
+                    bodies.push_back(&F);
+                }
+            }
+
+            for (auto * F : bodies) {
+                auto & fn = mod.functions.emplace_back();
+                fn.module = &mod;
+                fn.name = F->getName().str();
+                fn.tier0_name = tier_name(0, mod.id, fn.name);
+                mod.by_name[fn.name] = &fn;
+                stub_inits[fn.name] = { llvm::orc::ExecutorAddr(), llvm::JITSymbolFlags::fromGlobalValue(*F) | llvm::JITSymbolFlags::Callable };
+
+                // route every use of the function, including calls from
+                // inside this module, through a declaration of the public
+                // name that resolves to the stub.
+                auto * stub = llvm::Function::Create(F->getFunctionType(), llvm::GlobalValue::ExternalLinkage, "", M);
+                stub->setCallingConv(F->getCallingConv());
+                stub->setAttributes(F->getAttributes());
+                F->replaceAllUsesWith(stub);
+                stub->takeName(F);
+                stub->setDSOLocal(false);
+
+                F->setName(fn.tier0_name);
+                F->setLinkage(llvm::GlobalValue::ExternalLinkage);
+                F->setVisibility(llvm::GlobalValue::HiddenVisibility);
+                F->setComdat(nullptr);
+            }
+            return llvm::Error::success();
+        });
+        if (Err) {
+            return Err;
+        }
+    }
+
+    if (mod.functions.empty()) {
+        return owner.jit->addIRModule(std::move(tracker), std::move(module));
+    }
+
+    mod.pristine = llvm::orc::cloneToNewContext(module);
+    mod.pristine.withModuleDo(erase_global_ctors_dtors);
+
+    auto threshold = owner.opts.tier_up_threshold;
+    module.withModuleDo([&](llvm::Module & M) {
+        for (auto & fn : mod.functions) {
+            auto & F = *M.getFunction(fn.tier0_name);
+            if (pgo) {
+                fn.num_edges = count_edges(F);
+                fn.edges = std::make_unique<std::atomic<uint64_t>[]>(fn.num_edges);
+                instrument_edges(F, fn.edges.get());
+            }
+            inject_call_counter(F, fn, threshold);
+        }
+    });
+    JIT::set_module_opt_level(module, opt_level::O0);
+
+    // continue from the profile of a previous run, functions that were hot
+    // are recompiled as soon as tier 0 is in place.
+    std::vector<function_record *> hot;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto & fn : mod.functions) {
+            auto it = loaded_profile.find(fn.name);
+            if (it == loaded_profile.end()) {
+                continue;
+            }
+            fn.calls = it->second.calls;
+            if (it->second.edges.size() == fn.num_edges) {
+                for (size_t i = 0; i < fn.num_edges; ++i) {
+                    fn.edges[i] = it->second.edges[i];
+                }
+            }
+            if (threshold > 0 && fn.calls >= threshold) {
+                hot.push_back(&fn);
+            }
+        }
+    }
+
+    auto & ES = owner.jit->getExecutionSession();
+    auto & JD = owner.jit->getMainJITDylib();
+
+    if (auto Err = mod.stubs->createStubs(stub_inits)) {
+        return Err;
+    }
+    owner.metrics->stubs.fetch_add(stub_inits.size(), std::memory_order_relaxed);
+    llvm::orc::SymbolMap stubs;
+    for (auto & fn : mod.functions) {
+        stubs[owner.jit->mangleAndIntern(fn.name)] = mod.stubs->findStub(fn.name, false);
+    }
+    if (auto Err = JD.define(llvm::orc::absoluteSymbols(std::move(stubs)), tracker)) {
+        return Err;
+    }
+    if (auto Err = owner.jit->addIRModule(tracker, std::move(module))) {
+        return Err;
+    }
+
+    // compile tier 0 now and point the stubs at it.
+    llvm::orc::SymbolLookupSet bodies;
+    for (auto & fn : mod.functions) {
+        bodies.add(owner.jit->mangleAndIntern(fn.tier0_name));
+    }
+    auto addrs = ES.lookup(llvm::orc::makeJITDylibSearchOrder(&JD, llvm::orc::JITDylibLookupFlags::MatchAllSymbols), std::move(bodies));
+    if (!addrs) {
+        return addrs.takeError();
+    }
+    for (auto & fn : mod.functions) {
+        if (auto Err = mod.stubs->updatePointer(fn.name, (*addrs)[owner.jit->mangleAndIntern(fn.tier0_name)].getAddress())) {
+            return Err;
+        }
+    }
+
+    JIT_LOG(debug, "JIT tiered: " + llvm::Twine(mod.functions.size()) + " functions compiled at tier 0.");
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        modules.push_back(std::move(record));
+    }
+    for (auto * fn : hot) {
+        request_tier_up(*fn);
+    }
+    return llvm::Error::success();
+}
+
+void JIT::tiered_state::request_tier_up(function_record & fn) {
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        queue.push_back(&fn);
+    }
+    queue_cv.notify_one();
+}
+
+std::unique_ptr<JIT::tiered_state::module_record> JIT::tiered_state::remove(const llvm::orc::ResourceTracker & tracker) {
+    std::unique_ptr<module_record> record;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = llvm::find_if(modules, [&](auto & mod) { return mod->tracker.get() == &tracker; });
+        if (it == modules.end()) {
+            return nullptr;
+        }
+        record = std::move(*it);
+        modules.erase(it);
+    }
+
+    std::unique_lock<std::mutex> guard(queue_lock);
+    llvm::erase_if(queue, [&](function_record * fn) { return fn->module == record.get(); });
+    queue_cv.wait(guard, [&] { return !running || running->module != record.get(); });
+    return record;
+}
+
+void JIT::tiered_state::reoptimize() {
+    std::vector<function_record *> ran;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto & mod : modules) {
+            for (auto & fn : mod->functions) {
+                if (!fn.promoted && fn.calls > 0) {
+                    ran.push_back(&fn);
+                }
+            }
+        }
+    }
+    for (auto * fn : ran) {
+        request_tier_up(*fn);
+    }
+}
+
+std::vector<JIT::function_profile> JIT::tiered_state::profile() {
+    std::vector<JIT::function_profile> result;
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto & mod : modules) {
+        for (auto & fn : mod->functions) {
+            result.push_back(fn.snapshot());
+        }
+    }
+    return result;
+}
+
+void JIT::tiered_state::load_profile(std::vector<JIT::function_profile> profile) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto & fn : profile) {
+        auto name = fn.name;
+        loaded_profile[name] = std::move(fn);
+    }
+}
+
+void JIT::tiered_state::run_worker() {
+    while (true) {
+        function_record * fn;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            queue_cv.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            fn = queue.front();
+            queue.pop_front();
+            running = fn;
+        }
+        tier_up(*fn);
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            running = nullptr;
+        }
+        queue_cv.notify_all();
+    }
+}
+
+// callees of fn in the same module that ran, candidates for inlining
+std::vector<JIT::tiered_state::function_record *> JIT::tiered_state::hot_callees(function_record & fn) {
+    std::vector<function_record *> callees;
+    fn.module->pristine.withModuleDo([&](llvm::Module & M) {
+        for (auto & I : llvm::instructions(*M.getFunction(fn.tier0_name))) {
+            auto * call = llvm::dyn_cast<llvm::CallBase>(&I);
+            auto * callee = call ? call->getCalledFunction() : nullptr;
+            if (!callee) {
+                continue;
+            }
+            auto it = fn.module->by_name.find(callee->getName());
+            if (it != fn.module->by_name.end() && it->second != &fn && it->second->calls > 0
+                && llvm::find(callees, it->second) == callees.end()) {
+                callees.push_back(it->second);
+            }
+        }
+    });
+    return callees;
+}
+
+void JIT::tiered_state::tier_up(function_record & fn) {
+    // requested again before the first recompile finished
+    if (fn.promoted) {
+        return;
+    }
+
+    auto & mod = *fn.module;
+    auto tier1_name = tier_name(1, mod.id, fn.name);
+
+    std::vector<function_record *> callees;
+    std::vector<JIT::function_profile> summary;
+    if (pgo) {
+        callees = hot_callees(fn);
+        summary = profile();
+    }
+
+    // clone only this body (and hot callee bodies in pgo mode), everything
+    // else it references becomes a declaration that resolves to the tier 0
+    // module or to other stubs.
+    auto module = llvm::orc::cloneToNewContext(mod.pristine, [&](const llvm::GlobalValue & GV) {
+        return GV.getName() == fn.tier0_name || llvm::any_of(callees, [&](function_record * callee) {
+            return GV.getName() == callee->tier0_name;
+        });
+    });
+    auto opt = module.withModuleDo([&](llvm::Module & M) {
+        auto & F = *M.getFunction(fn.tier0_name);
+        if (pgo) {
+            apply_profile(F, fn.snapshot());
+            for (auto * callee : callees) {
+                provide_callee_body(M, *callee);
+            }
+            set_profile_summary(M, summary);
+        }
+        F.setName(tier1_name);
+        return JIT::module_opt_level(M, owner.opts.tier_up_opt);
+    });
+    JIT::set_module_opt_level(module, opt);
+
+    if (auto Err = owner.jit->addIRModule(mod.tracker, std::move(module))) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT tier-up failed: ");
+        return;
+    }
+    auto addr = owner.jit->lookup(tier1_name);
+    if (!addr) {
+        llvm::logAllUnhandledErrors(addr.takeError(), llvm::errs(), "JIT tier-up failed: ");
+        return;
+    }
+    if (auto Err = mod.stubs->updatePointer(fn.name, *addr)) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT tier-up failed: ");
+        return;
+    }
+
+    fn.promoted = true;
+    ++tier_ups;
+    JIT_LOG(info, "JIT tier-up: " + llvm::Twine(fn.name) + " recompiled after " + llvm::Twine(fn.calls.load()) + " calls.");
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "jit.h"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/Support/Error.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Tiered compilation.
+//
+// Every function of a module added in tiered mode is renamed to a private
+// tier 0 body and its public name is defined as an indirect stub. Tier 0 is
+// compiled at O0 with a call counter at the entry of each body, once a counter
+// crosses the threshold the body is recompiled at the tier-up level on a
+// background thread and the stub pointer is redirected to it.
+//
+// All calls (including calls inside the module) and all lookups go through the
+// stub, so the address returned by JIT::lookup never changes across tier-ups.
+//
+// In pgo mode tier 0 also counts branch edges (see jit_pgo.h), the recompile
+// annotates the body with the profile and carries the bodies of its hot
+// callees from the same module as available_externally copies of their
+// public names so they can be inlined.
+struct JIT::tiered_state {
+    struct module_record;
+
+    struct function_record {
+        // bumped by the tier 0 body on every call
+        std::atomic<uint64_t> calls { 0 };
+        std::atomic<bool> promoted { false };
+        std::string name;
+        std::string tier0_name;
+        module_record * module = nullptr;
+        // pgo mode, bumped by the tier 0 body for every branch edge taken
+        std::unique_ptr<std::atomic<uint64_t>[]> edges;
+        size_t num_edges = 0;
+
+        JIT::function_profile snapshot() const;
+    };
+
+    struct module_record {
+        unsigned id = 0;
+        tiered_state * state = nullptr;
+        // tier 0, the stub symbols and every tier-up of the module
+        llvm::orc::ResourceTrackerSP tracker;
+        std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+        // promoted, counter free copy of the module used for recompilation
+        llvm::orc::ThreadSafeModule pristine;
+        std::deque<function_record> functions;
+        llvm::StringMap<function_record *> by_name;
+    };
+
+    JIT & owner;
+    bool pgo;
+    std::function<std::unique_ptr<llvm::orc::IndirectStubsManager>()> make_stubs;
+
+    // guards modules, promote, next_module_id and loaded_profile
+    std::mutex lock;
+    std::vector<std::unique_ptr<module_record>> modules;
+    llvm::orc::SymbolLinkagePromoter promote;
+    unsigned next_module_id = 0;
+    // from load_profile, seeds the counters of functions added later
+    std::unordered_map<std::string, JIT::function_profile> loaded_profile;
+
+    std::mutex queue_lock;
+    std::condition_variable queue_cv;
+    std::deque<function_record *> queue;
+    // being recompiled by the worker
+    function_record * running = nullptr;
+    bool stopping = false;
+    std::thread worker;
+
+    std::atomic<size_t> tier_ups { 0 };
+
+    tiered_state(JIT & owner);
+    ~tiered_state();
+
+    // join the worker, queued tier-ups are dropped
+    void stop();
+
+    llvm::Error add(llvm::orc::ThreadSafeModule && module, llvm::orc::ResourceTrackerSP tracker);
+
+    // forget the module of `tracker` and wait until the worker no longer uses
+    // it, its code is removed by the caller before the record is destroyed
+    std::unique_ptr<module_record> remove(const llvm::orc::ResourceTracker & tracker);
+
+    // called from JIT'd code when a counter crosses the threshold
+    void request_tier_up(function_record & fn);
+
+    void reoptimize();
+    std::vector<JIT::function_profile> profile();
+    void load_profile(std::vector<JIT::function_profile> profile);
+
+    private:
+
+    void run_worker();
+    void tier_up(function_record & fn);
+    std::vector<function_record *> hot_callees(function_record & fn);
+};
@@ -0,0 +1,147 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit_log.h"
+#include "jit_trace.h"
+
+#include <atomic>
+#include <chrono>
+
+static std::atomic<jit_trace *> active_trace { nullptr };
+
+// when the calling thread's LLVM profiler started, LLVM's timestamps are
+// relative to the start of the writing thread's profiler
+static thread_local uint64_t profiler_started_ns = 0;
+
+uint64_t jit_trace::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+jit_trace::jit_trace(llvm::StringRef file_name, unsigned granularity_us) : file_name(file_name.str()), granularity_us(granularity_us) {}
+
+llvm::Expected<std::unique_ptr<jit_trace>> jit_trace::start(llvm::StringRef file_name, unsigned granularity_us) {
+    if (llvm::timeTraceProfilerEnabled()) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT trace needs LLVM's time trace profiler, already running on this thread");
+    }
+    std::unique_ptr<jit_trace> trace(new jit_trace(file_name, granularity_us));
+    jit_trace * expected = nullptr;
+    if (!active_trace.compare_exchange_strong(expected, trace.get())) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "JIT trace already running in this process");
+    }
+    // drops profilers handed over after the last trace
+    llvm::timeTraceProfilerCleanup();
+    trace->origin_ns = now_ns();
+    return trace;
+}
+
+jit_trace::~jit_trace() {
+    if (auto Err = write()) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "JIT trace not written: ");
+    } else {
+        JIT_LOG(info, "JIT trace written to " + file_name + ".");
+    }
+    active_trace = nullptr;
+}
+
+bool jit_trace::enter_thread() {
+    if (llvm::timeTraceProfilerEnabled()) {
+        return false;
+    }
+    llvm::timeTraceProfilerInitialize(granularity_us, "jit");
+    profiler_started_ns = now_ns();
+    return true;
+}
+
+jit_trace::scope::scope(jit_trace * trace, const char * name, llvm::StringRef detail) : trace(trace), name(name) {
+    if (trace) {
+        owns_profiler = trace->enter_thread();
+        this->detail = detail.str();
+        start_ns = now_ns();
+    }
+}
+
+jit_trace::scope::~scope() {
+    if (trace) {
+        trace->complete(name, detail, start_ns, now_ns());
+        // hands the scopes over for the write, the thread keeps no profiler
+        // once it leaves the JIT
+        if (owns_profiler) {
+            llvm::timeTraceProfilerFinishThread();
+        }
+    }
+}
+
+void jit_trace::complete(const char * name, llvm::StringRef detail, uint64_t start_ns, uint64_t end_ns) {
+    std::lock_guard<std::mutex> guard(lock);
+    events.push_back({ name, detail.str(), llvm::get_threadid(), start_ns, end_ns > start_ns ? end_ns - start_ns : 0 });
+}
+
+llvm::Error jit_trace::write() {
+    // LLVM writes from the calling thread's profiler
+    enter_thread();
+    uint64_t base_ns = profiler_started_ns;
+
+    llvm::SmallString<0> buffer;
+    llvm::raw_svector_ostream llvm_trace(buffer);
+    llvm::timeTraceProfilerWrite(llvm_trace);
+    llvm::timeTraceProfilerCleanup();
+
+    auto json = llvm::json::parse(buffer);
+    if (!json) {
+        return json.takeError();
+    }
+    auto * root = json->getAsObject();
+    auto * llvm_events = root ? root->getArray("traceEvents") : nullptr;
+    if (!llvm_events) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "malformed LLVM time trace");
+    }
+
+    // everything relative to the start of the trace, LLVM's scopes start
+    // out relative to the writing thread's profiler
+    auto relative_us = [this](uint64_t ns) {
+        return (static_cast<int64_t>(ns) - static_cast<int64_t>(origin_ns)) / 1000;
+    };
+    auto llvm_offset_us = relative_us(base_ns);
+    llvm::json::Array merged;
+    for (auto & E : *llvm_events) {
+        if (auto * event = E.getAsObject()) {
+            if (auto ts = event->getInteger("ts")) {
+                (*event)["ts"] = *ts + llvm_offset_us;
+            }
+        }
+        merged.push_back(std::move(E));
+    }
+
+    auto pid = static_cast<int64_t>(llvm::sys::Process::getProcessId());
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto & e : events) {
+        merged.push_back(llvm::json::Object {
+            { "pid", pid },
+            { "tid", static_cast<int64_t>(e.tid) },
+            { "ph", "X" },
+            { "cat", "jit" },
+            { "name", e.name },
+            { "ts", relative_us(e.start_ns) },
+            { "dur", static_cast<int64_t>(e.duration_ns / 1000) },
+            { "args", llvm::json::Object { { "detail", e.detail } } },
+        });
+    }
+    (*root)["traceEvents"] = std::move(merged);
+
+    std::error_code EC;
+    llvm::raw_fd_ostream out(file_name, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        return llvm::createFileError(file_name, EC);
+    }
+    out << llvm::json::Value(std::move(*root));
+    out.flush();
+    if (out.has_error()) {
+        return llvm::createFileError(file_name, out.error());
+    }
+    return llvm::Error::success();
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of the JIT in Chrome trace event format (chrome://tracing,
+// ui.perfetto.dev), see JIT::options::trace_file.
+//
+// The JIT records its own spans (module adds, materialization tasks, pipeline
+// stages, lookups, static initializers) on whichever thread runs them. A
+// thread gets an LLVM time trace profiler for the duration of its outermost
+// span, so the per-pass scopes of the optimization pipeline and of codegen
+// are recorded too, and hands it over to LLVM when the span ends, so threads
+// keep no profiler once they leave the JIT and the write picks up every
+// thread's scopes. One trace per process.
+class jit_trace {
+    struct event {
+        const char * name;
+        std::string detail;
+        uint64_t tid;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+    };
+
+    std::string file_name;
+    unsigned granularity_us;
+    // steady clock, like LLVM's timestamps
+    uint64_t origin_ns;
+
+    std::mutex lock;
+    std::vector<event> events;
+
+    public:
+
+    // records the enclosing scope, a null trace records nothing
+    class scope {
+        jit_trace * trace;
+        const char * name;
+        std::string detail;
+        uint64_t start_ns;
+        // the outermost span of the thread, which started its LLVM profiler
+        bool owns_profiler = false;
+
+        public:
+
+        scope(jit_trace * trace, const char * name, llvm::StringRef detail = {});
+        ~scope();
+    };
+
+    // fails when LLVM's time trace profiler is already running on this thread
+    static llvm::Expected<std::unique_ptr<jit_trace>> start(llvm::StringRef file_name, unsigned granularity_us);
+    // writes the trace
+    ~jit_trace();
+
+    // a span that ended on this thread, times from the steady clock
+    void complete(const char * name, llvm::StringRef detail, uint64_t start_ns, uint64_t end_ns);
+
+    static uint64_t now_ns();
+
+    private:
+
+    jit_trace(llvm::StringRef file_name, unsigned granularity_us);
+
+    // gives the calling thread an LLVM time trace profiler, false when it
+    // already had one
+    bool enter_thread();
+    llvm::Error write();
+};
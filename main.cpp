@@ -1,139 +1,56 @@
 #include "jit.h"
 
-#if true
-//===- JITLoaderGDB.h - Register objects via GDB JIT interface -*- C++ -*-===//
-//
-// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
-// See https://llvm.org/LICENSE.txt for license information.
-// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
-//
-//===----------------------------------------------------------------------===//
-
-#include "llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderGDB.h"
-
-#include "llvm/ExecutionEngine/JITSymbol.h"
-#include "llvm/Support/BinaryStreamReader.h"
-#include "llvm/Support/FormatVariadic.h"
-
-#include <cstdint>
-#include <mutex>
-#include <utility>
-
-#define DEBUG_TYPE "orc"
-
-// First version as landed in August 2009
-static constexpr uint32_t JitDescriptorVersion = 1;
-
-extern "C" {
-
-// We put information about the JITed function in this global, which the
-// debugger reads.  Make sure to specify the version statically, because the
-// debugger checks the version before we can set it during runtime.
-struct JIT_DLL_EXPORT jit_descriptor __jit_debug_descriptor = {JitDescriptorVersion, 0,
-                                                nullptr, nullptr};
-
-// Debuggers that implement the GDB JIT interface put a special breakpoint in
-// this function.
-LLVM_ATTRIBUTE_NOINLINE JIT_DLL_EXPORT void __jit_debug_register_code() {
-  // The noinline and the asm prevent calls to this function from being
-  // optimized out.
-#if !defined(_MSC_VER)
-  asm volatile("" ::: "memory");
-#endif
-}
-}
-
-using namespace llvm;
-using namespace llvm::orc;
-
-#define LLVM_DEBUG(x) x
-
-// Register debug object, return error message or null for success.
-static void appendJITDebugDescriptor(const char *ObjAddr, size_t Size) {
-  LLVM_DEBUG({
-    dbgs() << "Adding debug object to GDB JIT interface "
-           << formatv("([{0:x16} -- {1:x16}])",
-                      reinterpret_cast<uintptr_t>(ObjAddr),
-                      reinterpret_cast<uintptr_t>(ObjAddr + Size))
-           << "\n";
-  });
-
-  jit_code_entry *E = new jit_code_entry;
-  E->symfile_addr = ObjAddr;
-  E->symfile_size = Size;
-  E->prev_entry = nullptr;
-
-  // Serialize rendezvous with the debugger as well as access to shared data.
-  static std::mutex JITDebugLock;
-  std::lock_guard<std::mutex> Lock(JITDebugLock);
-
-  // Insert this entry at the head of the list.
-  jit_code_entry *NextEntry = __jit_debug_descriptor.first_entry;
-  E->next_entry = NextEntry;
-  if (NextEntry) {
-    NextEntry->prev_entry = E;
-  }
-
-  __jit_debug_descriptor.first_entry = E;
-  __jit_debug_descriptor.relevant_entry = E;
-  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
-}
-
-extern "C" JIT_DLL_EXPORT orc::shared::CWrapperFunctionResult
-llvm_orc_registerJITLoaderGDBAllocAction(const char *Data, size_t Size) {
-  using namespace orc::shared;
-  return WrapperFunction<SPSError(SPSExecutorAddrRange, bool)>::handle(
-             Data, Size,
-             [](ExecutorAddrRange R, bool AutoRegisterCode) {
-               appendJITDebugDescriptor(R.Start.toPtr<const char *>(),
-                                        R.size());
-               // Run into the rendezvous breakpoint.
-               if (AutoRegisterCode)
-                 __jit_debug_register_code();
-               return Error::success();
-             })
-      .release();
-}
-
-extern "C" JIT_DLL_EXPORT orc::shared::CWrapperFunctionResult
-llvm_orc_registerJITLoaderGDBWrapper(const char *Data, uint64_t Size) {
-  using namespace orc::shared;
-  return WrapperFunction<SPSError(SPSExecutorAddrRange, bool)>::handle(
-             Data, Size,
-             [](ExecutorAddrRange R, bool AutoRegisterCode) {
-               appendJITDebugDescriptor(R.Start.toPtr<const char *>(),
-                                        R.size());
-               // Run into the rendezvous breakpoint.
-               if (AutoRegisterCode)
-                 __jit_debug_register_code();
-               return Error::success();
-             })
-      .release();
-}
-#endif
-
 extern "C" JIT_DLL_EXPORT int main(int argc, char *argv[]);
 
 #define STR_(x) #x
 #define STR(x) STR_(x)
 
+static llvm::cl::opt<std::string> source_file(llvm::cl::Positional, llvm::cl::desc("<C source>"), llvm::cl::init("jit_code.c"));
+static llvm::cl::opt<bool> accel_tables("jit-accel-tables", llvm::cl::desc("Emit DWARF accelerator tables for the JIT'd code"));
+static llvm::cl::opt<bool> print_stats("jit-stats", llvm::cl::desc("Print the time spent in each JIT pipeline stage"));
+static llvm::cl::opt<JIT::log_level> log_level("jit-log-level", llvm::cl::desc("Most verbose JIT messages written to stderr"), llvm::cl::init(JIT::log_level::warning),
+    llvm::cl::values(
+        clEnumValN(JIT::log_level::error, "error", "errors only"),
+        clEnumValN(JIT::log_level::warning, "warning", "errors and disabled features"),
+        clEnumValN(JIT::log_level::info, "info", "configuration and progress"),
+        clEnumValN(JIT::log_level::debug, "debug", "every step")));
+static llvm::cl::opt<std::string> trace_file("jit-trace", llvm::cl::desc("Write a Chrome trace of the JIT to this file on exit"), llvm::cl::value_desc("file"));
 
 int main(int argc, char *argv[]) {
 
     JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
     
-    JIT jit = JIT(true);
+    JIT::set_log_level(log_level);
+
+    JIT::options opts;
+    opts.jitlink = true;
+    opts.debug_accelerator_tables = accel_tables;
+    opts.trace_file = trace_file;
+    JIT jit = JIT(opts);
     
-    llvm::outs() << "invoking [ " STR(CLANG_EXE) " jit_code.c -emit-llvm -O0 -g3 -Xclang -triple -Xclang " STR(jit_target_triple) " -S -o tmp.ll" " ]\n";
+    auto source = llvm::MemoryBuffer::getFile(source_file);
+    if (!source) {
+        llvm::errs() << "cannot read " << source_file << ": " << source.getError().message() << "\n";
+        return 1;
+    }
     
-    system(STR(CLANG_EXE) " jit_code.c -emit-llvm -O0 -g3 -Xclang -triple -Xclang " STR(jit_target_triple) " -S -o tmp.ll");
+    llvm::outs() << "compiling [ " << source_file << " -O0 -g3 -Xclang -triple -Xclang " STR(jit_target_triple) " ] in-process\n";
     
-    jit.add_IR_module("tmp.ll");
+    auto module = jit.add_C_source((*source)->getBuffer(), source_file, { "-O0", "-g3" });
     
     int (*main_func)(void) = jit.lookup_as_pointer<int(void)>("j");
    
     int res = main_func();
     llvm::outs() << "j() = " << res << "\n";
+
+    if (print_stats) {
+        jit.dump_stats(llvm::outs());
+    }
+    
+    if (auto Err = jit.remove_module(module)) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "remove_module: ");
+        return 1;
+    }
     
     return 0;
 }
@@ -0,0 +1,178 @@
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "bench_module.h"
+#include "jit.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Adds, looks up and calls modules from many threads at once, each thread
+// also looking up the modules of the others, and runs add_IR_modules batches
+// that another thread cancels halfway. Exits non-zero on the first wrong
+// result.
+
+static llvm::cl::opt<unsigned> num_threads("threads", llvm::cl::desc("Application threads"), llvm::cl::init(8));
+static llvm::cl::opt<unsigned> num_modules("modules", llvm::cl::desc("Modules added by each thread"), llvm::cl::init(50));
+static llvm::cl::opt<unsigned> functions("functions", llvm::cl::desc("Functions per module"), llvm::cl::init(8));
+static llvm::cl::opt<unsigned> compile_threads("compile-threads", llvm::cl::desc("JIT compile threads"), llvm::cl::init(4));
+static llvm::cl::opt<bool> rtdyld("rtdyld", llvm::cl::desc("Link with RTDyld instead of JITLink"));
+
+static std::atomic<unsigned> failures { 0 };
+
+// modules added so far by each thread
+static std::unique_ptr<std::atomic<unsigned>[]> progress;
+
+static void fail(const llvm::Twine & message) {
+    if (failures++ == 0) {
+        llvm::errs() << "stress_concurrent: " << message << "\n";
+    }
+}
+
+static std::string module_name(unsigned thread, unsigned module) {
+    return "t" + std::to_string(thread) + "_m" + std::to_string(module);
+}
+
+static std::string module_text(llvm::StringRef name) {
+    bench_module_shape shape;
+    shape.functions = functions;
+    shape.call_density = 1.0;
+    llvm::LLVMContext context;
+    auto M = generate_bench_module(context, name, shape);
+    std::string text;
+    llvm::raw_string_ostream os(text);
+    M->print(os, nullptr);
+    return os.str();
+}
+
+// each leaf returns x * (i + 1) + i, the entry their sum
+static int expected_entry(int x) {
+    int sum = 0;
+    for (unsigned i = 0; i < functions; ++i) {
+        sum += x * static_cast<int>(i + 1) + static_cast<int>(i);
+    }
+    return sum;
+}
+
+static void call_entry(JIT & jit, const std::string & name) {
+    auto addr = jit.lookup(name + "_entry");
+    if (!addr) {
+        fail("lookup of " + name + "_entry failed: " + llvm::toString(addr.takeError()));
+        return;
+    }
+    int result = addr->toPtr<int(int)>()(3);
+    if (result != expected_entry(3)) {
+        fail(name + "_entry(3) returned " + llvm::Twine(result) + ", expected " + llvm::Twine(expected_entry(3)));
+    }
+}
+
+static void add_and_lookup(JIT & jit, unsigned thread) {
+    for (unsigned m = 0; m < num_modules; ++m) {
+        auto name = module_name(thread, m);
+        auto context = std::make_unique<llvm::LLVMContext>();
+        bench_module_shape shape;
+        shape.functions = functions;
+        shape.call_density = 1.0;
+        shape.seed = m;
+        auto M = generate_bench_module(*context, name, shape);
+        if (!jit.add_IR_module(llvm::orc::ThreadSafeModule(std::move(M), std::move(context)))) {
+            fail("adding " + name + " failed");
+            return;
+        }
+        call_entry(jit, name);
+        progress[thread].store(m + 1);
+
+        // the latest module of the neighbour thread, possibly still being
+        // linked by it
+        unsigned neighbour = (thread + 1) % num_threads;
+        if (unsigned added = progress[neighbour].load()) {
+            call_entry(jit, module_name(neighbour, added - 1));
+        }
+    }
+}
+
+static void add_batch(JIT & jit, unsigned batch, bool cancel_halfway) {
+    std::vector<JIT::module_source> sources;
+    for (unsigned m = 0; m < num_modules; ++m) {
+        auto name = "b" + std::to_string(batch) + "_m" + std::to_string(m);
+        sources.push_back({ name, llvm::MemoryBuffer::getMemBufferCopy(module_text(name), name) });
+    }
+
+    std::atomic<bool> cancel { false };
+    std::atomic<bool> done { false };
+    std::thread canceller;
+    if (cancel_halfway) {
+        canceller = std::thread([&] {
+            // cancel once the batch started parsing, lookups of symbols that
+            // may not exist yet would exit
+            auto prefix = "b" + std::to_string(batch) + "_";
+            while (!done.load()) {
+                auto stats = jit.stats();
+                if (llvm::any_of(stats.modules, [&](auto & module) { return llvm::StringRef(module.first).starts_with(prefix); })) {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+            cancel = true;
+        });
+    }
+    auto results = jit.add_IR_modules(std::move(sources), &cancel);
+    done = true;
+    if (canceller.joinable()) {
+        canceller.join();
+    }
+
+    if (results.size() != num_modules) {
+        fail("add_IR_modules returned " + llvm::Twine(results.size()) + " results for " + llvm::Twine(num_modules) + " modules");
+        return;
+    }
+    unsigned added = 0;
+    for (auto & result : results) {
+        if (result.added) {
+            ++added;
+            call_entry(jit, result.name);
+        } else if (!cancel_halfway || result.error != "cancelled") {
+            fail("batch module " + result.name + " not added: " + result.error);
+        }
+    }
+    if (!cancel_halfway && added != num_modules) {
+        fail("batch " + llvm::Twine(batch) + " added " + llvm::Twine(added) + " of " + llvm::Twine(num_modules) + " modules");
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
+
+    JIT::set_log_level(JIT::log_level::error);
+
+    progress.reset(new std::atomic<unsigned>[num_threads]());
+
+    JIT::options opts;
+    opts.jitlink = !rtdyld;
+    opts.compile_threads = compile_threads;
+    {
+        JIT jit(opts);
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&jit, t] { add_and_lookup(jit, t); });
+        }
+        // batches run next to the single adds
+        threads.emplace_back([&jit] { add_batch(jit, 0, false); });
+        threads.emplace_back([&jit] { add_batch(jit, 1, true); });
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    }
+
+    if (failures) {
+        llvm::errs() << "stress_concurrent: " << failures << " failures\n";
+        return 1;
+    }
+    llvm::outs() << "stress_concurrent: " << num_threads << " threads, " << num_threads * num_modules << " modules, no failures\n";
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "bench_module.h"
+#include "jit.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Adds and removes modules with debug information from several threads while
+// the registration thread coalesces their debug objects and a profiler is
+// started and stopped over and over, which copies every registered object.
+// Both read the objects of registered GDB entries, so an object freed before
+// its entry is unregistered shows up as a crash here (or under ASan, as a use
+// after free). Exits non-zero on the first wrong result.
+
+static llvm::cl::opt<unsigned> num_threads("threads", llvm::cl::desc("Threads adding and removing modules"), llvm::cl::init(4));
+static llvm::cl::opt<unsigned> functions("functions", llvm::cl::desc("Functions per module"), llvm::cl::init(8));
+static llvm::cl::opt<unsigned> coalesce("coalesce", llvm::cl::desc("Debug objects merged per registration"), llvm::cl::init(4));
+static llvm::cl::opt<unsigned> seconds("seconds", llvm::cl::desc("Time spent adding and removing"), llvm::cl::init(3));
+static llvm::cl::opt<bool> profile("profile", llvm::cl::desc("Start and stop the profiler meanwhile"), llvm::cl::init(true));
+
+static std::atomic<unsigned> failures { 0 };
+
+static void fail(const llvm::Twine & message) {
+    if (failures++ == 0) {
+        llvm::errs() << "stress_debug_remove: " << message << "\n";
+    }
+}
+
+// each leaf returns x * (i + 1) + i, the entry their sum
+static int expected_entry(int x) {
+    int sum = 0;
+    for (unsigned i = 0; i < functions; ++i) {
+        sum += x * static_cast<int>(i + 1) + static_cast<int>(i);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[]) {
+
+    JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
+
+    JIT::set_log_level(JIT::log_level::error);
+
+    JIT::options opts;
+    opts.jitlink = true;
+    opts.async_debug_registration = true;
+    opts.coalesce_debug_objects = coalesce;
+    JIT jit(opts);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    std::atomic<uint64_t> removed { 0 };
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t] {
+            jit.profile_thread();
+            for (unsigned round = 0; std::chrono::steady_clock::now() < deadline && failures == 0; ++round) {
+                // a few at a time, so entries of live and removed modules sit
+                // in the same merged registrations
+                std::vector<JIT::module_handle> handles;
+                for (unsigned m = 0; m < 8; ++m) {
+                    auto name = "t" + std::to_string(t) + "_r" + std::to_string(round) + "_m" + std::to_string(m);
+                    auto context = std::make_unique<llvm::LLVMContext>();
+                    bench_module_shape shape;
+                    shape.functions = functions;
+                    shape.call_density = 0.5;
+                    shape.debug_info = true;
+                    shape.seed = round * 8 + m;
+                    handles.push_back(jit.add_IR_module(llvm::orc::ThreadSafeModule(generate_bench_module(*context, name, shape), std::move(context))));
+                    int result = jit.lookup_as_pointer<int(int)>(name + "_entry")(3);
+                    if (result != expected_entry(3)) {
+                        fail(name + "_entry(3) returned " + llvm::Twine(result) + ", expected " + llvm::Twine(expected_entry(3)));
+                    }
+                }
+                if (round % 2) {
+                    jit.flush_debug_registration();
+                }
+                for (auto handle : handles) {
+                    if (auto Err = jit.remove_module(handle)) {
+                        fail(llvm::toString(std::move(Err)));
+                    }
+                    ++removed;
+                }
+            }
+        });
+    }
+
+    unsigned profiles = 0;
+    while (profile && std::chrono::steady_clock::now() < deadline && failures == 0) {
+        if (auto Err = jit.start_profiling(10000)) {
+            // not on this platform, the removals still race the coalescing
+            llvm::outs() << "stress_debug_remove: no profiler, " << llvm::toString(std::move(Err)) << "\n";
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        if (auto Err = jit.stop_profiling(llvm::nulls())) {
+            fail(llvm::toString(std::move(Err)));
+        }
+        ++profiles;
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    if (failures) {
+        return 1;
+    }
+    llvm::outs() << "stress_debug_remove: " << removed << " modules removed, " << profiles << " profiles taken\n";
+    return 0;
+}
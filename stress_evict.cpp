@@ -0,0 +1,102 @@
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "bench_module.h"
+#include "jit.h"
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Calls the modules of a JIT with a code budget far below what they need from
+// many threads at once, so modules are evicted and reloaded while other
+// threads are on their way into them. The addresses are looked up once and
+// must stay callable across evictions. Exits non-zero on the first wrong
+// result or when nothing was evicted and reloaded.
+
+static llvm::cl::opt<unsigned> num_threads("threads", llvm::cl::desc("Application threads"), llvm::cl::init(8));
+static llvm::cl::opt<unsigned> num_modules("modules", llvm::cl::desc("Modules added"), llvm::cl::init(64));
+static llvm::cl::opt<unsigned> functions("functions", llvm::cl::desc("Functions per module"), llvm::cl::init(16));
+static llvm::cl::opt<unsigned> budget_kib("budget", llvm::cl::desc("Code budget in KiB"), llvm::cl::init(256));
+static llvm::cl::opt<unsigned> seconds("seconds", llvm::cl::desc("Time spent calling"), llvm::cl::init(3));
+static llvm::cl::opt<bool> rtdyld("rtdyld", llvm::cl::desc("Link with RTDyld instead of JITLink"));
+
+static std::atomic<unsigned> failures { 0 };
+
+static void fail(const llvm::Twine & message) {
+    if (failures++ == 0) {
+        llvm::errs() << "stress_evict: " << message << "\n";
+    }
+}
+
+// each leaf returns x * (i + 1) + i, the entry their sum
+static int expected_entry(int x) {
+    int sum = 0;
+    for (unsigned i = 0; i < functions; ++i) {
+        sum += x * static_cast<int>(i + 1) + static_cast<int>(i);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[]) {
+
+    JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
+
+    JIT::set_log_level(JIT::log_level::error);
+
+    JIT::options opts;
+    opts.jitlink = !rtdyld;
+    opts.code_budget = static_cast<uint64_t>(budget_kib) << 10;
+    JIT jit(opts);
+
+    std::vector<int (*)(int)> entries;
+    for (unsigned m = 0; m < num_modules; ++m) {
+        auto name = "m" + std::to_string(m);
+        auto context = std::make_unique<llvm::LLVMContext>();
+        bench_module_shape shape;
+        shape.functions = functions;
+        shape.call_density = 1.0;
+        shape.strings = 4;
+        shape.string_length = 256;
+        shape.seed = m;
+        jit.add_IR_module(llvm::orc::ThreadSafeModule(generate_bench_module(*context, name, shape), std::move(context)));
+        entries.push_back(jit.lookup_as_pointer<int(int)>(name + "_entry"));
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937 random(t);
+            // a few hot modules per thread and a random cold one now and then,
+            // so both recently used and idle modules exist
+            std::uniform_int_distribution<size_t> pick(0, entries.size() - 1);
+            while (std::chrono::steady_clock::now() < deadline && failures == 0) {
+                size_t m = random() % 8 == 0 ? pick(random) : (t * 3 + random() % 3) % entries.size();
+                int x = static_cast<int>(random() % 100);
+                int result = entries[m](x);
+                if (result != expected_entry(x)) {
+                    fail("m" + llvm::Twine(m) + "_entry(" + llvm::Twine(x) + ") returned " + llvm::Twine(result) + ", expected " + llvm::Twine(expected_entry(x)));
+                }
+            }
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    if (failures) {
+        return 1;
+    }
+
+    auto stats = jit.budget_stats();
+    llvm::outs() << "stress_evict: " << stats.evictions << " evictions, " << stats.recompiles << " recompiles, "
+                 << stats.resident_bytes << " bytes resident\n";
+    if (stats.evictions == 0 || stats.recompiles == 0) {
+        llvm::errs() << "stress_evict: the budget of " << budget_kib << " KiB evicted and reloaded nothing\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "bench_module.h"
+#include "jit.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Adds and links modules, removes them all again and checks that the JIT's
+// mapped code and data return to where they started and that the process
+// resident set shrinks by at least half of what the modules mapped. Runs a
+// few rounds so leaks across add and remove cycles show up too.
+
+static llvm::cl::opt<unsigned> num_modules("modules", llvm::cl::desc("Modules added per round"), llvm::cl::init(200));
+static llvm::cl::opt<unsigned> functions("functions", llvm::cl::desc("Functions per module"), llvm::cl::init(200));
+static llvm::cl::opt<unsigned> rounds("rounds", llvm::cl::desc("Add and remove rounds"), llvm::cl::init(3));
+static llvm::cl::opt<bool> rtdyld("rtdyld", llvm::cl::desc("Link with RTDyld instead of JITLink"));
+
+// current resident set, 0 where it cannot be read
+static uint64_t rss_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size, resident;
+    if (statm >> size >> resident) {
+        return resident * llvm::sys::Process::getPageSizeEstimate();
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    JIT::main_llvm_init main_init(argc, const_cast<const char**>(argv));
+
+    JIT::set_log_level(JIT::log_level::error);
+
+    JIT::options opts;
+    opts.jitlink = !rtdyld;
+    JIT jit(opts);
+
+    bench_module_shape shape;
+    shape.functions = functions;
+    shape.call_density = 1.0;
+    shape.strings = 8;
+    shape.string_length = 256;
+
+    uint64_t baseline = jit.budget_stats().resident_bytes;
+    for (unsigned round = 0; round < rounds; ++round) {
+        std::vector<JIT::module_handle> handles;
+        for (unsigned m = 0; m < num_modules; ++m) {
+            auto name = "r" + std::to_string(round) + "_m" + std::to_string(m);
+            auto context = std::make_unique<llvm::LLVMContext>();
+            auto M = generate_bench_module(*context, name, shape);
+            handles.push_back(jit.add_IR_module(llvm::orc::ThreadSafeModule(std::move(M), std::move(context))));
+            // links the module
+            jit.lookup_as_pointer<int(int)>(name + "_entry")(1);
+        }
+
+        uint64_t mapped = jit.budget_stats().resident_bytes;
+        uint64_t rss_added = rss_bytes();
+        if (mapped <= baseline) {
+            llvm::errs() << "stress_remove: round " << round << " mapped " << mapped << " bytes, no more than the " << baseline << " before adding\n";
+            return 1;
+        }
+
+        for (auto handle : handles) {
+            if (auto Err = jit.remove_module(handle)) {
+                llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "stress_remove: ");
+                return 1;
+            }
+        }
+
+        uint64_t remaining = jit.budget_stats().resident_bytes;
+        uint64_t rss_removed = rss_bytes();
+        if (remaining != baseline) {
+            llvm::errs() << "stress_remove: round " << round << " left " << remaining << " bytes mapped, " << baseline << " before adding\n";
+            return 1;
+        }
+        uint64_t module_bytes = mapped - baseline;
+        if (rss_added && rss_removed + module_bytes / 2 > rss_added) {
+            llvm::errs() << "stress_remove: round " << round << " RSS went from " << rss_added << " to " << rss_removed
+                         << " bytes after removing " << module_bytes << " bytes of modules\n";
+            return 1;
+        }
+        llvm::outs() << "stress_remove: round " << round << ", " << module_bytes << " bytes mapped and freed, RSS "
+                     << rss_added << " -> " << rss_removed << " bytes\n";
+    }
+    return 0;
+}